@@ -31,6 +31,11 @@ enum rsu_clinet_command_code {
 	COMMAND_VERIFY_IMAGE,
 	COMMAND_VERIFY_RAW_IMAGE,
 	COMMAND_COPY_TO_FILE,
+	COMMAND_COPY_SLOT,
+	COMMAND_SLOT_DIGEST,
+	COMMAND_SLOT_CHECK,
+	COMMAND_PRIORITY_ORDER,
+	COMMAND_COMPACT_CPB,
 	COMMAND_STATUS_LOG,
 	COMMAND_NOTIFY,
 	COMMAND_CLEAR_ERROR_STATUS,
@@ -58,6 +63,8 @@ static const struct option opts[] = {
 	{"priority", required_argument, NULL, 'p'},
 	{"enable", required_argument, NULL, 'E'},
 	{"disable", required_argument, NULL, 'D'},
+	{"reorder", required_argument, NULL, 'Q'},
+	{"compact-cpb", no_argument, NULL, 'M'},
 	{"add", required_argument, NULL, 'a'},
 	{"add-factory-update", required_argument, NULL, 'u'},
 	{"add-raw", required_argument, NULL, 'A'},
@@ -66,6 +73,9 @@ static const struct option opts[] = {
 	{"verify", required_argument, NULL, 'v'},
 	{"verify-raw", required_argument, NULL, 'V'},
 	{"copy", required_argument, NULL, 'f'},
+	{"copy-slot", required_argument, NULL, 'o'},
+	{"digest", required_argument, NULL, 'j'},
+	{"check", no_argument, NULL, 'K'},
 	{"request", required_argument, NULL, 'r'},
 	{"notify", required_argument, NULL, 'n'},
 	{"clear-error-status", no_argument, NULL, 'C'},
@@ -105,6 +115,8 @@ static void rsu_client_usage(void)
 	       "set the selected slot as the highest priority\n");
 	printf("%-32s  %s", "-D|--disable slot_num",
 	       "disable selected slot but to not erase it\n");
+	printf("%-32s  %s", "-Q|--reorder slot_num[,slot_num...]",
+	       "set the listed slots as the highest priorities, in order\n");
 	printf("%-32s  %s", "-r|--request slot_num",
 	       "request the selected slot to be loaded after the next reboot\n");
 	printf("%-32s  %s", "-R|--request-factory",
@@ -123,6 +135,12 @@ static void rsu_client_usage(void)
 	       "verify raw image on the selected slot\n");
 	printf("%-32s  %s", "-f|--copy file_name -s|--slot slot_num",
 	       "read the data in a selected slot then write to a file\n");
+	printf("%-32s  %s", "-o|--copy-slot src_slot -s|--slot slot_num",
+	       "copy the app image in a source slot to the selected slot\n");
+	printf("%-32s  %s", "-j|--digest crc32|sha256 -s|--slot slot_num",
+	       "display the digest of the app image in the selected slot\n");
+	printf("%-32s  %s", "-K|--check -s|--slot slot_num",
+	       "check the app image in the selected slot is consistent\n");
 	printf("%-32s  %s", "-g|--log", "print the status log\n");
 	printf("%-32s  %s", "-n|--notify value", "report software state\n");
 	printf("%-32s  %s", "-C|--clear-error-status",
@@ -143,6 +161,8 @@ static void rsu_client_usage(void)
 	printf("%-32s  %s", "-X|--save-spt file_name", "save spt to a file\n");
 	printf("%-32s  %s", "-b|--create-empty-cpb", "create a empty cpb\n");
 	printf("%-32s  %s", "-B|--restore-cpb file_name", "restore cpb from a file\n");
+	printf("%-32s  %s", "-M|--compact-cpb",
+	       "remove spent pointers from the cpb\n");
 	printf("%-32s  %s", "-P|--save-cpb file_name", "save cpb to a file\n");
 	printf("%-32s  %s", "-k|--check-running-factory", "check if currently running the factory image\n");
 	printf("%-32s  %s", "-h|--help", "show usage message\n");
@@ -346,6 +366,86 @@ static int rsu_client_copy_to_file(char *file_name, int slot_num)
 	return rsu_slot_copy_to_file(slot_num, file_name);
 }
 
+/*
+ * rsu_client_copy_slot() - copy the app image from a slot to another slot
+ * src_slot: the source slot
+ * slot_num: the selected slot
+ *
+ * Return: 0 on success, or negative on error
+ */
+static int rsu_client_copy_slot(int src_slot, int slot_num)
+{
+	return rsu_slot_copy(src_slot, slot_num);
+}
+
+/*
+ * rsu_client_slot_digest() - display the digest of the app image in a slot
+ * algo: the digest algorithm
+ * slot_num: the selected slot
+ *
+ * Return: 0 on success, or negative on error
+ */
+static int rsu_client_slot_digest(int algo, int slot_num)
+{
+	__u8 digest[RSU_DIGEST_SHA256_SZ];
+	int len;
+	int x;
+	int rtn;
+
+	rtn = rsu_slot_digest(slot_num, algo, digest);
+	if (rtn)
+		return rtn;
+
+	if (algo == RSU_DIGEST_CRC32)
+		len = RSU_DIGEST_CRC32_SZ;
+	else
+		len = RSU_DIGEST_SHA256_SZ;
+
+	for (x = 0; x < len; x++)
+		printf("%02x", digest[x]);
+	printf("\n");
+
+	return 0;
+}
+
+/*
+ * rsu_client_reorder() - give a list of slots the highest priorities
+ * slot_list: comma separated slot numbers, highest priority first
+ *
+ * All the priority changes are written to flash together.
+ *
+ * Return: 0 on success, or negative on error
+ */
+static int rsu_client_reorder(char *slot_list)
+{
+	char *endptr;
+	int priority = 1;
+	int slot;
+	int rtn;
+
+	rtn = rsu_priority_begin();
+	if (rtn)
+		return rtn;
+
+	while (*slot_list) {
+		slot = strtol(slot_list, &endptr, 0);
+		if (endptr == slot_list || (*endptr && *endptr != ',')) {
+			rsu_priority_abort();
+			return -1;
+		}
+
+		rtn = rsu_priority_set(slot, priority++);
+		if (rtn) {
+			rsu_priority_abort();
+			return rtn;
+		}
+
+		slot_list = *endptr ? endptr + 1 : endptr;
+	}
+
+	return rsu_priority_commit();
+}
+
 /*
  * rsu_client_display_dcmf_version() - display the version of each of the four
  *				       DCMF copies in flash
@@ -438,6 +538,8 @@ int main(int argc, char *argv[])
 	int c;
 	int index = 0;
 	int slot_num = -1;
+	int src_slot = -1;
+	int digest_algo = RSU_DIGEST_SHA256;
 	int slot_address = -1;
 	int slot_size = -1;
 	char slot_name[MAX_SLOT_NAME + 1] = "";
@@ -445,6 +547,7 @@ int main(int argc, char *argv[])
 	int notify_value = -1;
 	enum rsu_clinet_command_code command = COMMAND_NONE;
 	char *filename = NULL;
+	char *slot_list = NULL;
 	int ret;
 
 	if (argc == 1) {
@@ -452,14 +555,14 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	ret = librsu_init("");
+	ret = librsu_init_lazy("");
 	if (ret) {
-		printf("librsu_init return %d\n", ret);
+		printf("librsu_init_lazy return %d\n", ret);
 		return ret;
 	}
 
 	while ((c = getopt_long(argc, argv,
-				"cghRl:z:p:t:a:u:A:s:e:v:V:f:r:E:D:n:CZmyxd:W:X:bB:P:S:L:k",
+				"cghRl:z:p:t:a:u:A:s:e:v:V:f:o:j:KQ:Mr:E:D:n:CZmyxd:W:X:bB:P:S:L:k",
 				opts, &index)) != -1) {
 		switch (c) {
 		case 'c':
@@ -569,6 +672,41 @@ int main(int argc, char *argv[])
 			command = COMMAND_COPY_TO_FILE;
 			filename = optarg;
 			break;
+		case 'o':
+			if (command != COMMAND_NONE)
+				error_exit("Only one command allowed");
+			command = COMMAND_COPY_SLOT;
+			src_slot = strtol(optarg, &endptr, 0);
+			if (*endptr || src_slot < 0)
+				error_exit("Invalid source slot number");
+			break;
+		case 'j':
+			if (command != COMMAND_NONE)
+				error_exit("Only one command allowed");
+			command = COMMAND_SLOT_DIGEST;
+			if (strcmp(optarg, "crc32") == 0)
+				digest_algo = RSU_DIGEST_CRC32;
+			else if (strcmp(optarg, "sha256") == 0)
+				digest_algo = RSU_DIGEST_SHA256;
+			else
+				error_exit("Invalid digest algorithm");
+			break;
+		case 'K':
+			if (command != COMMAND_NONE)
+				error_exit("Only one command allowed");
+			command = COMMAND_SLOT_CHECK;
+			break;
+		case 'Q':
+			if (command != COMMAND_NONE)
+				error_exit("Only one command allowed");
+			command = COMMAND_PRIORITY_ORDER;
+			slot_list = optarg;
+			break;
+		case 'M':
+			if (command != COMMAND_NONE)
+				error_exit("Only one command allowed");
+			command = COMMAND_COMPACT_CPB;
+			break;
 		case 'g':
 			if (command != COMMAND_NONE)
 				error_exit("Only one command allowed");
@@ -773,6 +911,40 @@ int main(int argc, char *argv[])
 		if (ret < 0)
 			error_exit("Failed to copy app image to file");
 		break;
+	case COMMAND_COPY_SLOT:
+		if (slot_num < 0)
+			error_exit("Slot number must be set");
+		ret = rsu_client_copy_slot(src_slot, slot_num);
+		if (ret < 0)
+			error_exit("Failed to copy app image to slot");
+		break;
+	case COMMAND_SLOT_DIGEST:
+		if (slot_num < 0)
+			error_exit("Slot number must be set");
+		ret = rsu_client_slot_digest(digest_algo, slot_num);
+		if (ret < 0)
+			error_exit("Failed to compute slot digest");
+		break;
+	case COMMAND_SLOT_CHECK:
+		if (slot_num < 0)
+			error_exit("Slot number must be set");
+		ret = rsu_slot_check(slot_num);
+		if (ret < 0)
+			error_exit("Slot image is not consistent");
+		break;
+	case COMMAND_PRIORITY_ORDER:
+		if (slot_num >= 0)
+			error_exit("Slot number should not be set");
+		ret = rsu_client_reorder(slot_list);
+		if (ret < 0)
+			error_exit("Failed to reorder slots");
+		break;
+	case COMMAND_COMPACT_CPB:
+		if (slot_num >= 0)
+			error_exit("Slot number should not be set");
+		if (rsu_cpb_compact())
+			error_exit("Failed to compact CPB");
+		break;
 	case COMMAND_STATUS_LOG:
 		if (slot_num >= 0)
 			error_exit("Slot number should not be set");
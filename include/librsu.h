@@ -10,6 +10,7 @@ extern "C" {
 #endif
 
 #include <linux/types.h>
+#include <sys/uio.h>
 
 /*
  * LIBRSU Error Codes
@@ -30,6 +31,17 @@ extern "C" {
 #define EARGS		14
 #define ECORRUPTED_CPB	15
 #define ECORRUPTED_SPT	16
+#define ECANCEL		17
+#define ECTXBUSY	18
+
+/*
+ * Slot digest algorithms, and the size of the digest they produce
+ */
+#define RSU_DIGEST_CRC32	0
+#define RSU_DIGEST_SHA256	1
+
+#define RSU_DIGEST_CRC32_SZ	4
+#define RSU_DIGEST_SHA256_SZ	32
 
 #define STATE_DCIO_CORRUPTED		0xF004D00F
 #define STATE_CPB0_CORRUPTED		0xF004D010
@@ -57,6 +69,20 @@ extern "C" {
  */
 int librsu_init(char *filename);
 
+/*
+ * librsu_init_lazy() - Load the configuration file, but defer accessing flash
+ * filename: configuration file to load
+ *            (if Null or empty string, the default is /etc/librsu.rc)
+ *
+ * The flash devices are opened and the SPT/CPB loaded by the first call which
+ * needs them, so status queries which only use sysfs, like rsu_status_log()
+ * or rsu_dcmf_version(), never touch flash. Flash errors are then reported
+ * by that call as -ELIB instead of by the initialization.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int librsu_init_lazy(char *filename);
+
 /*
  * librsu_exit() - cleanup internal data and release librsu
  *
@@ -64,6 +90,100 @@ int librsu_init(char *filename);
  */
 void librsu_exit(void);
 
+/*
+ * rsu_ctx - library context, holding all the state for one RSU target
+ *
+ * librsu_init() sets up the process default context, which every thread uses
+ * until it selects another one with rsu_use(). Each library call locks the
+ * context it operates on until it returns, so calls made on the same context
+ * by several threads are serialized, while threads using different contexts
+ * run in parallel. Callbacks run by library calls may call the library again.
+ */
+struct rsu_ctx;
+
+/*
+ * rsu_open() - Load a configuration file into a new library context
+ * filename: configuration file to load
+ *            (if Null or empty string, the default is /etc/librsu.rc)
+ * ctx: set to the new context on success
+ *
+ * The context is initialized as by librsu_init(), but it is not selected.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_open(char *filename, struct rsu_ctx **ctx);
+
+/*
+ * rsu_close() - release a library context from rsu_open()
+ * ctx: context to release, which is kept if an asynchronous operation is
+ *      still running with it
+ *
+ * Returns nothing
+ */
+void rsu_close(struct rsu_ctx *ctx);
+
+/*
+ * rsu_use() - select the context used by the calling thread
+ * ctx: context to use, or NULL for the process default context
+ *
+ * All the other library calls made by the thread then operate on that
+ * context. Any number of threads may select the same context; no lock is
+ * held between calls.
+ *
+ * Returns nothing
+ */
+void rsu_use(struct rsu_ctx *ctx);
+
+/*
+ * rsu_ctx_name() - get the name of a context
+ * ctx: context
+ *
+ * Returns the target name for contexts from rsu_targets_open(), or an empty
+ * string otherwise
+ */
+char *rsu_ctx_name(struct rsu_ctx *ctx);
+
+/*
+ * rsu_targets_open() - open one context per target of a multi-target cfg file
+ * filename: configuration file to load
+ * ctxs: array filled in with the new contexts, in file order
+ * max: size of the array
+ *
+ * Each target starts with a 'target <name>' line, followed by its own 'root'
+ * and 'rsu-dev' lines; lines before the first target, like 'log', apply to
+ * all targets. The 'metadata-cache', 'digest-cache' and 'program-journal'
+ * files can only be set per target, and are rejected before the first
+ * target. The contexts are initialized as by librsu_init_lazy() and released
+ * with rsu_close().
+ *
+ * Returns the number of targets opened, or Error Code
+ */
+int rsu_targets_open(char *filename, struct rsu_ctx **ctxs, int max);
+
+/*
+ * rsu_target_fn - function run for each target by rsu_targets_run(), with
+ *                 the context of the target selected
+ * index: index of the target
+ * arg: argument passed to rsu_targets_run()
+ *
+ * Returns the per-target result
+ */
+typedef int (*rsu_target_fn)(int index, void *arg);
+
+/*
+ * rsu_targets_run() - run a function for several contexts in parallel
+ * ctxs: contexts to run the function for
+ * count: number of contexts
+ * fn: function to run, in a separate thread for each context
+ * arg: argument passed to each call of fn
+ * results: array filled in with the result of each call of fn, or -ELIB if
+ *          it could not be run
+ *
+ * Returns 0 once all the calls are complete, or Error Code
+ */
+int rsu_targets_run(struct rsu_ctx **ctxs, int count, rsu_target_fn fn,
+		    void *arg, int *results);
+
 /*
  * librsu_slot_count() - get the number of slots defined
  *
@@ -181,6 +301,55 @@ int rsu_slot_program_factory_update_file(int slot, char *filename);
  */
 int rsu_slot_program_buf_raw(int slot, void *buf, int size);
 
+/*
+ * rsu_slot_program_iov() - program a slot using FPGA config data from a list
+ *                          of buffers and enter slot into CPB
+ * slot: slot number
+ * iov: buffers holding consecutive parts of the data
+ * iovcnt: number of buffers
+ *
+ * The buffers are read in place, image blocks may span several of them.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_iov(int slot, const struct iovec *iov, int iovcnt);
+
+/*
+ * rsu_slot_program_iov_raw() - program a slot using raw data from a list of
+ *                              buffers. The slot is not entered into the CPB
+ * slot: slot number
+ * iov: buffers holding consecutive parts of the data
+ * iovcnt: number of buffers
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_iov_raw(int slot, const struct iovec *iov, int iovcnt);
+
+/*
+ * rsu_slot_program_fd() - program a slot using FPGA config data read from a
+ *                         file descriptor and enter slot into CPB
+ * slot: slot number
+ * fd: file descriptor, read from its current offset until end of file
+ *
+ * Any readable descriptor can be used, like a file, memfd, pipe or socket.
+ * Images from descriptors which can not be rewound, like pipes and sockets,
+ * are programmed as they are read, without being checked first.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_fd(int slot, int fd);
+
+/*
+ * rsu_slot_program_fd_raw() - program a slot using raw data read from a file
+ *                             descriptor. The slot is not entered into the
+ *                             CPB
+ * slot: slot number
+ * fd: file descriptor, read from its current offset until end of file
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_fd_raw(int slot, int fd);
+
 /*
  * rsu_slot_program_file_raw() - program a slot using raw data from a file.
  *                               The slot is not entered into the CPB
@@ -191,6 +360,107 @@ int rsu_slot_program_buf_raw(int slot, void *buf, int size);
  */
 int rsu_slot_program_file_raw(int slot, char *filename);
 
+/*
+ * rsu_program - handle for programming a slot with data pushed by the caller
+ *
+ * The handle must only be used by a thread which has the context selected
+ * when programming began.
+ */
+struct rsu_program;
+
+/*
+ * rsu_slot_program_begin() - start programming a slot with FPGA config data
+ *                            given by rsu_slot_program_write(), and enter
+ *                            the slot into CPB on commit
+ * slot: slot number
+ * prog: set to the new programming handle
+ *
+ * Unlike rsu_slot_program_file() and rsu_slot_program_buf(), the image can
+ * not be checked before being programmed, so a bad image is only detected
+ * while programming and leaves the slot partially programmed.
+ *
+ * The handle belongs to the context selected when it is opened, and is used
+ * in that context by the following calls. Until it is committed or aborted,
+ * the calls erasing or programming slots in that context fail with
+ * -ECTXBUSY, and the context cannot be released.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_begin(int slot, struct rsu_program **prog);
+
+/*
+ * rsu_slot_program_begin_raw() - start programming a slot with raw data given
+ *                                by rsu_slot_program_write(). The slot is
+ *                                not entered into the CPB
+ * slot: slot number
+ * prog: set to the new programming handle
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_begin_raw(int slot, struct rsu_program **prog);
+
+/*
+ * rsu_slot_program_write() - program the next data of a slot
+ * prog: programming handle
+ * buf: data, which can be of any size
+ * len: bytes in buf
+ *
+ * Data is programmed as each 4KB image block is complete. Once an error
+ * occurred, it is returned by the following writes and by the commit.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_write(struct rsu_program *prog, void *buf, int len);
+
+/*
+ * rsu_slot_program_commit() - program the remaining data of a slot, complete
+ *                             the programming and free the handle
+ * prog: programming handle
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_commit(struct rsu_program *prog);
+
+/*
+ * rsu_slot_program_abort() - stop programming a slot and free the handle
+ * prog: programming handle
+ *
+ * The slot is left partially programmed, and must be erased before being
+ * programmed again.
+ *
+ * Returns nothing
+ */
+void rsu_slot_program_abort(struct rsu_program *prog);
+
+/*
+ * rsu_slot_program_file_resume() - resume the programming of a slot from a
+ *                                  file after an interruption
+ * slot: slot number
+ * filename: input data file
+ *
+ * When a program-journal file is configured, the programming of image files
+ * records how far it got. This function checks that the journal is for the
+ * same slot and image file, checks the part of the slot recorded as
+ * programmed, and programs the rest of the image. The regular or raw mode of
+ * the interrupted programming is kept.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_file_resume(int slot, char *filename);
+
+/*
+ * rsu_cancel() - cancel the program or verify operation in progress
+ * ctx: context running the operation, or NULL for the default context
+ *
+ * This can be called from any thread. The operation stops at the next image
+ * block boundary and returns -ECANCEL; a cancelled image file programming
+ * can be continued with rsu_slot_program_file_resume(). A cancel made while
+ * no program or verify operation runs is ignored.
+ *
+ * Returns nothing
+ */
+void rsu_cancel(struct rsu_ctx *ctx);
+
 /*
  * rsu_slot_verify_buf() - verify FPGA config data in a slot against a buffer
  * slot: slot number
@@ -220,6 +490,48 @@ int rsu_slot_verify_file(int slot, char *filename);
  */
 int rsu_slot_verify_buf_raw(int slot, void *buf, int size);
 
+/*
+ * rsu_slot_verify_iov() - verify FPGA config data in a slot against a list of
+ *                         buffers
+ * slot: slot number
+ * iov: buffers holding consecutive parts of the data
+ * iovcnt: number of buffers
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_iov(int slot, const struct iovec *iov, int iovcnt);
+
+/*
+ * rsu_slot_verify_iov_raw() - verify raw data in a slot against a list of
+ *                             buffers
+ * slot: slot number
+ * iov: buffers holding consecutive parts of the data
+ * iovcnt: number of buffers
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_iov_raw(int slot, const struct iovec *iov, int iovcnt);
+
+/*
+ * rsu_slot_verify_fd() - verify FPGA config data in a slot against data read
+ *                        from a file descriptor
+ * slot: slot number
+ * fd: file descriptor, read from its current offset until end of file
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_fd(int slot, int fd);
+
+/*
+ * rsu_slot_verify_fd_raw() - verify raw data in a slot against data read from
+ *                            a file descriptor
+ * slot: slot number
+ * fd: file descriptor, read from its current offset until end of file
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_fd_raw(int slot, int fd);
+
 /*
  * rsu_slot_verify_file_raw() - verify raw data in a slot against a file
  * slot: slot number
@@ -277,7 +589,322 @@ int rsu_slot_verify_callback(int slot, rsu_data_callback callback);
 int rsu_slot_verify_callback_raw(int slot, rsu_data_callback callback);
 
 /*
- * rsu_slot_copy_to_file() - read the data in a slot and write to a file
+ * rsu_borrow_callback - function pointer type for callback functions lending
+ *                       their own buffers, for the functions below
+ * buf: set to the next data, in memory owned by the caller which must stay
+ *      valid and unchanged until the next call
+ *
+ * Returns the number of bytes at buf, 0 at the end of the data, or a
+ * negative value on error
+ */
+typedef int (*rsu_borrow_callback)(void **buf);
+
+/*
+ * rsu_slot_program_borrow() - program and verify a slot using FPGA config
+ *                             data lent by a callback function. Enter the
+ *                             slot into the CPB
+ * slot: slot number
+ * callback: callback function to lend input data
+ *
+ * Whole 4KB blocks are used in place. Only the signature blocks, which are
+ * adjusted for the slot, and the blocks spanning two buffers are copied.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_borrow(int slot, rsu_borrow_callback callback);
+
+/*
+ * rsu_slot_program_borrow_raw() - program and verify a slot using raw data
+ *                                 lent by a callback function. The slot is
+ *                                 not entered into the CPB
+ * slot: slot number
+ * callback: callback function to lend input data
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_program_borrow_raw(int slot, rsu_borrow_callback callback);
+
+/*
+ * rsu_slot_verify_borrow() - verify a slot using FPGA config data lent by a
+ *                            callback function
+ * slot: slot number
+ * callback: callback function to lend input data
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_borrow(int slot, rsu_borrow_callback callback);
+
+/*
+ * rsu_slot_verify_borrow_raw() - verify a slot using raw data lent by a
+ *                                callback function
+ * slot: slot number
+ * callback: callback function to lend input data
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_verify_borrow_raw(int slot, rsu_borrow_callback callback);
+
+/*
+ * Phases reported by rsu_progress_callback functions
+ */
+#define RSU_PROGRESS_ERASE	0
+#define RSU_PROGRESS_PROGRAM	1
+#define RSU_PROGRESS_VERIFY	2
+#define RSU_PROGRESS_COPY	3
+
+/*
+ * struct rsu_progress - progress of a long running operation
+ * phase: RSU_PROGRESS_* phase of the operation
+ * done: bytes processed so far
+ * total: bytes to process, or 0 if not known in advance, like for image copies
+ *        which stop at the end of the image
+ * rate: throughput in hundredths of MB/s
+ * elapsed_ms: time since the phase started
+ * eta_ms: estimated time to completion, or -1 if not known
+ */
+struct rsu_progress {
+	int phase;
+	__u64 done;
+	__u64 total;
+	__u32 rate;
+	__u32 elapsed_ms;
+	int eta_ms;
+};
+
+/*
+ * rsu_progress_callback - function called with the progress of an operation
+ * progress: progress of the operation
+ * arg: argument given when the callback was registered
+ *
+ * It is called when a phase starts, at most once per reporting interval while
+ * it runs, and when it ends.
+ */
+typedef void (*rsu_progress_callback)(struct rsu_progress *progress,
+				      void *arg);
+
+/*
+ * rsu_progress_set() - register a progress callback for the current context
+ * callback: function called with the progress of erase, program, verify and
+ *           copy operations, or NULL to stop progress reporting
+ * arg: argument passed to callback
+ * interval_ms: shortest time between two reports of a phase, or 0 for the
+ *              default of 500ms
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_progress_set(rsu_progress_callback callback, void *arg,
+		     int interval_ms);
+
+/*
+ * rsu_async - handle for program, verify and erase operations run in the
+ *             background by a library worker thread
+ *
+ * An operation runs with the context the calling thread had selected when it
+ * was started. Until the operation completes, the context belongs to the
+ * worker thread and other calls using it fail with -ECTXBUSY; a separate
+ * context from rsu_open() can be used meanwhile, for example for status
+ * queries. A handle runs one operation at a time and can be reused once the
+ * previous one has completed.
+ */
+struct rsu_async;
+
+/*
+ * rsu_async_callback - function called by the worker thread when an
+ *                      operation completes
+ * op: operation handle
+ * result: result of the operation, as returned by the blocking function
+ * arg: argument given to rsu_async_new()
+ *
+ * The context is released before the callback is called, so it can use the
+ * library. As it runs on the worker thread, it cannot free the handle or start
+ * another operation with it; rsu_async_wait() returns the result at once.
+ */
+typedef void (*rsu_async_callback)(struct rsu_async *op, int result,
+				   void *arg);
+
+/*
+ * rsu_async_new() - create an operation handle
+ * callback: optional function called when an operation completes
+ * arg: argument passed to callback
+ *
+ * Returns the new handle, or NULL on error
+ */
+struct rsu_async *rsu_async_new(rsu_async_callback callback, void *arg);
+
+/*
+ * rsu_async_free() - wait for the operation of a handle, and free it
+ * op: operation handle
+ *
+ * Returns nothing
+ */
+void rsu_async_free(struct rsu_async *op);
+
+/*
+ * rsu_async_set_progress() - register a progress callback for the operations
+ *                            of a handle
+ * op: operation handle
+ * callback: function called with the progress of the operations, in place of
+ *           the one of the context, or NULL to use the one of the context
+ * arg: argument passed to callback
+ *
+ * Must not be called while an operation is running.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_async_set_progress(struct rsu_async *op,
+			   rsu_progress_callback callback, void *arg);
+
+/*
+ * rsu_async_fd() - get the completion file descriptor of a handle
+ * op: operation handle
+ *
+ * The eventfd becomes readable for poll()/select() when an operation
+ * completes, and is reset by rsu_async_result() or rsu_async_wait().
+ *
+ * Returns the file descriptor
+ */
+int rsu_async_fd(struct rsu_async *op);
+
+/*
+ * rsu_async_result() - get the result of a completed operation
+ * op: operation handle
+ * result: set to the result of the operation, as returned by the blocking
+ *         function
+ *
+ * Returns 0 if the operation completed, 1 if it is still running, or Error
+ * Code if no operation was started
+ */
+int rsu_async_result(struct rsu_async *op, int *result);
+
+/*
+ * rsu_async_wait() - wait for an operation to complete
+ * op: operation handle
+ *
+ * Returns the result of the operation, as returned by the blocking function
+ */
+int rsu_async_wait(struct rsu_async *op);
+
+/*
+ * rsu_async_cancel() - cancel the operation of a handle, as rsu_cancel()
+ *                      does for the context the operation runs with.
+ *                      Does nothing once the operation has completed.
+ * op: operation handle
+ *
+ * Returns nothing
+ */
+void rsu_async_cancel(struct rsu_async *op);
+
+/*
+ * rsu_async_slot_erase() - start rsu_slot_erase() in the background
+ * op: operation handle
+ * slot: slot number
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_erase(struct rsu_async *op, int slot);
+
+/*
+ * rsu_async_slot_program_buf() - start rsu_slot_program_buf() in the
+ *                                background
+ * op: operation handle
+ * slot: slot number
+ * buf: pointer to data buffer, which must be kept until completion
+ * size: bytes to write
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_program_buf(struct rsu_async *op, int slot, void *buf,
+			       int size);
+
+/*
+ * rsu_async_slot_program_file() - start rsu_slot_program_file() in the
+ *                                 background
+ * op: operation handle
+ * slot: slot number
+ * filename: input data file
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_program_file(struct rsu_async *op, int slot,
+				char *filename);
+
+/*
+ * rsu_async_slot_program_buf_raw() - start rsu_slot_program_buf_raw() in the
+ *                                    background
+ * op: operation handle
+ * slot: slot number
+ * buf: pointer to data buffer, which must be kept until completion
+ * size: bytes to write
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_program_buf_raw(struct rsu_async *op, int slot, void *buf,
+				   int size);
+
+/*
+ * rsu_async_slot_program_file_raw() - start rsu_slot_program_file_raw() in
+ *                                     the background
+ * op: operation handle
+ * slot: slot number
+ * filename: input data file
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_program_file_raw(struct rsu_async *op, int slot,
+				    char *filename);
+
+/*
+ * rsu_async_slot_verify_buf() - start rsu_slot_verify_buf() in the background
+ * op: operation handle
+ * slot: slot number
+ * buf: pointer to data buffer, which must be kept until completion
+ * size: bytes to verify
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_verify_buf(struct rsu_async *op, int slot, void *buf,
+			      int size);
+
+/*
+ * rsu_async_slot_verify_file() - start rsu_slot_verify_file() in the
+ *                                background
+ * op: operation handle
+ * slot: slot number
+ * filename: input data file
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_verify_file(struct rsu_async *op, int slot,
+			       char *filename);
+
+/*
+ * rsu_async_slot_verify_buf_raw() - start rsu_slot_verify_buf_raw() in the
+ *                                   background
+ * op: operation handle
+ * slot: slot number
+ * buf: pointer to data buffer, which must be kept until completion
+ * size: bytes to verify
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_verify_buf_raw(struct rsu_async *op, int slot, void *buf,
+				  int size);
+
+/*
+ * rsu_async_slot_verify_file_raw() - start rsu_slot_verify_file_raw() in the
+ *                                    background
+ * op: operation handle
+ * slot: slot number
+ * filename: input data file
+ *
+ * Returns 0 if the operation was started, or Error Code
+ */
+int rsu_async_slot_verify_file_raw(struct rsu_async *op, int slot,
+				   char *filename);
+
+/*
+ * rsu_slot_copy_to_file() - read the FPGA config data in a slot and write to a
+ *                           file. Trailing erased flash is not written.
  * slot: slot number
  * filename: output data file
  *
@@ -285,6 +912,45 @@ int rsu_slot_verify_callback_raw(int slot, rsu_data_callback callback);
  */
 int rsu_slot_copy_to_file(int slot, char *filename);
 
+/*
+ * rsu_slot_copy() - copy the FPGA config data in a slot to another slot and
+ *                   enter the destination slot into CPB. The image pointers
+ *                   are relocated to the destination slot, and the data is
+ *                   verified as it is written.
+ * src_slot: source slot number
+ * dst_slot: destination slot number, must be erased
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_copy(int src_slot, int dst_slot);
+
+/*
+ * rsu_slot_check() - check the consistency of the FPGA config data in a slot
+ *                    without the original image. The CRC of every signature
+ *                    block is checked, and all section pointers must be
+ *                    within the slot and point to non-erased data.
+ * slot: slot number
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_check(int slot);
+
+/*
+ * rsu_slot_digest() - compute the digest of the FPGA config data in a slot.
+ *                     The image pointers are normalized to slot offset zero
+ *                     and trailing 0xFF bytes are ignored, so the digest
+ *                     matches the one of the original image file. If a
+ *                     digest-cache is configured, the digest recorded when
+ *                     the slot was programmed is used when still valid.
+ * slot: slot number
+ * algo: RSU_DIGEST_CRC32 or RSU_DIGEST_SHA256
+ * out: buffer for the digest, RSU_DIGEST_CRC32_SZ or RSU_DIGEST_SHA256_SZ
+ *      bytes, the CRC32 is stored most significant byte first
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_slot_digest(int slot, int algo, __u8 *out);
+
 /*
  * rsu_slot_enable() - Set the selected slot as the highest prioirity.  It will
  *                     be the first slot tried after a power-on reset
@@ -303,6 +969,39 @@ int rsu_slot_enable(int slot);
  */
 int rsu_slot_disable(int slot);
 
+/*
+ * rsu_priority_begin() - Start staging changes to the slot priorities. The
+ *                        current priorities are copied, changed in memory by
+ *                        rsu_priority_set() and written to flash at once by
+ *                        rsu_priority_commit().
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_priority_begin(void);
+
+/*
+ * rsu_priority_set() - Stage a new priority for a slot. Slots with a lower
+ *                      priority keep their order, below the selected slot.
+ * slot: slot number
+ * priority: new priority, 1 being the highest, or 0 to disable the slot
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_priority_set(int slot, int priority);
+
+/*
+ * rsu_priority_commit() - Write the staged priorities to flash, with at most
+ *                         one CPB compaction, and end the staging.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int rsu_priority_commit(void);
+
+/*
+ * rsu_priority_abort() - Drop the staged priorities without writing them.
+ */
+void rsu_priority_abort(void);
+
 /*
  * rsu_slot_load_after_reboot() - Request that the selected slot be loaded after
  *                                the next reboot, no matter the priority. A
@@ -433,6 +1132,85 @@ int rsu_max_retry(__u8 *value);
  */
 int rsu_dcmf_status(int *status);
 
+/*
+ * rsu_status_snapshot - structure to capture all the RSU status at once
+ * status: same as filled in by rsu_status_log()
+ * dcmf_version: same as filled in by rsu_dcmf_version()
+ * dcmf_status: same as filled in by rsu_dcmf_status()
+ * max_retry: same as filled in by rsu_max_retry()
+ * valid: mask of RSU_SNAPSHOT_* bits telling which of the above were read
+ */
+struct rsu_status_snapshot {
+	struct rsu_status_info status;
+	__u32 dcmf_version[4];
+	int dcmf_status[4];
+	__u8 max_retry;
+	__u32 valid;
+};
+
+#define RSU_SNAPSHOT_STATUS		(1 << 0)
+#define RSU_SNAPSHOT_DCMF_VERSION	(1 << 1)
+#define RSU_SNAPSHOT_DCMF_STATUS	(1 << 2)
+#define RSU_SNAPSHOT_MAX_RETRY		(1 << 3)
+
+/*
+ * rsu_status_snapshot() - retrieve the status log, DCMF versions, DCMF status
+ *                         and max_retry in one call
+ * @snap: pointer to the snapshot to fill in
+ *
+ * The attribute files are kept open between calls, so this is cheap enough
+ * for periodic health polling. The DCMF and max_retry values are only read
+ * when the status log reports a DCMF version; they are flagged as not valid
+ * when they could not be read.
+ *
+ * Returns: 0 on success, or error code if the status log could not be read
+ */
+int rsu_status_snapshot(struct rsu_status_snapshot *snap);
+
+/*
+ * Bits reported by rsu_status_watch_read() for the rsu_status_info fields
+ * which changed
+ */
+#define RSU_WATCH_VERSION		(1 << 0)
+#define RSU_WATCH_STATE			(1 << 1)
+#define RSU_WATCH_CURRENT_IMAGE		(1 << 2)
+#define RSU_WATCH_FAIL_IMAGE		(1 << 3)
+#define RSU_WATCH_ERROR_LOCATION	(1 << 4)
+#define RSU_WATCH_ERROR_DETAILS		(1 << 5)
+#define RSU_WATCH_RETRY_COUNTER		(1 << 6)
+
+/*
+ * rsu_status_watch() - start watching the status log for changes
+ * @interval_ms: longest time between checks for drivers which do not notify
+ *               attribute changes, in milliseconds
+ *
+ * Returns a file descriptor which becomes readable for poll()/select() when
+ * a status attribute may have changed; rsu_status_watch_read() must then be
+ * called. Attribute change notifications are used where the driver provides
+ * them, and a timer otherwise. The timer backs off while the status does not
+ * change. Only one watch can be active at a time.
+ *
+ * Returns: file descriptor on success, or error code
+ */
+int rsu_status_watch(int interval_ms);
+
+/*
+ * rsu_status_watch_read() - get the status after rsu_status_watch() fd events
+ * @info: pointer to the status to fill in
+ * @changes: set to the RSU_WATCH_* bits of the fields which changed since the
+ *           previous call, or since rsu_status_watch() for the first one
+ *
+ * Returns: 0 on success, or error code
+ */
+int rsu_status_watch_read(struct rsu_status_info *info, __u32 *changes);
+
+/*
+ * rsu_status_watch_close() - stop watching the status log
+ *
+ * Returns nothing
+ */
+void rsu_status_watch_close(void);
+
 /*
  * rsu_save_spt() - save spt to the file
  * @name: file name which SPT will be saved to
@@ -483,6 +1261,24 @@ int rsu_create_empty_cpb(void);
  */
 int rsu_restore_cpb(char *name);
 
+/*
+ * rsu_cpb_compact() - compact the cpb
+ *
+ * This function is used to remove the spent pointers from the CPB, so the
+ * following priority changes do not need to compact it. The CPB is only
+ * compacted if it holds at least the number of spent pointers set with the
+ * cpb-compact-threshold configuration option, 1 by default.
+ *
+ * Compaction erases and rewrites both CPB copies, so it is never run by the
+ * calls which spend pointers when disabling, erasing or reordering slots.
+ * Call this function from maintenance code, outside of latency sensitive
+ * priority changes, so that enabling a slot does not have to compact the CPB
+ * when no erased pointer is left.
+ *
+ * Returns: 0 on success, or error code
+ */
+int rsu_cpb_compact(void);
+
 /*
  * rsu_running_factory() - determine if current running image is factory image
  * @factory: set to non-zero value when running factory image, zero otherwise
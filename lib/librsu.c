@@ -5,12 +5,19 @@
 #include <fcntl.h>
 #include "librsu_cb.h"
 #include "librsu_cfg.h"
+#include "librsu_copy.h"
+#include "librsu_digest.h"
 #include <librsu.h>
 #include "librsu_image.h"
 #include "librsu_ll.h"
 #include "librsu_misc.h"
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #ifndef DEFAULT_CFG_FILENAME
@@ -23,21 +30,247 @@
 #define RSU_NOTIFY_IGNORE_STAGE         (1 << 18)
 #define RSU_NOTIFY_VALUE_MASK           0xFFFF
 
-static struct librsu_ll_intf *ll_intf;
+struct lib_state {
+	struct librsu_ll_intf *ll_intf;
+	int lib_initialized;
+
+	/*
+	 * Priority order staged by rsu_priority_set(), as partition numbers
+	 * with the highest priority first.
+	 */
+	int *staged_parts;
+	int staged_count;
+
+	/* open push programming handle, see rsu_slot_program_begin() */
+	struct rsu_program *push;
+
+	/* status watch, see rsu_status_watch() */
+	int watch_epfd;
+	int watch_timerfd;
+	int watch_interval;
+	int watch_period;
+	struct rsu_status_info watch_last;
+};
+
+#define LIB_STATE_INIT {			\
+	.watch_epfd = -1,			\
+	.watch_timerfd = -1,			\
+}
 
-int librsu_init(char *filename)
+/*
+ * A library context holds the state of every module for one RSU target. The
+ * process default context, set up by librsu_init(), is used by each thread
+ * until it selects another one with rsu_use(). Every library call locks the
+ * context for its duration with API_ENTER(); the lock is recursive so that
+ * library calls can use each other, and callbacks can call the library.
+ * While an asynchronous operation runs, the context belongs to its worker
+ * thread and calls from other threads fail with -ECTXBUSY.
+ */
+struct rsu_ctx {
+	pthread_mutex_t lock;
+	_Atomic int busy;
+	char name[32];
+	struct lib_state lib;
+	void *cfg;
+	void *misc;
+	void *qspi;
+};
+
+/* the module states of the default context are the module defaults */
+static struct rsu_ctx ctx_default = {
+	.lib = LIB_STATE_INIT,
+};
+static pthread_once_t ctx_default_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct lib_state *ls = &ctx_default.lib;
+
+/* context chosen with rsu_use(), NULL for the default one */
+static _Thread_local struct rsu_ctx *ctx_cur;
+
+/* context whose module states are selected, see ctx_select() */
+static _Thread_local struct rsu_ctx *ctx_sel = &ctx_default;
+
+/* asynchronous operation run by the thread, if any */
+static _Thread_local struct rsu_async *async_cur;
+static _Thread_local struct rsu_ctx *ctx_owned;
+
+static int ctx_lock_init(pthread_mutex_t *lock)
+{
+	pthread_mutexattr_t attr;
+	int rtn;
+
+	if (pthread_mutexattr_init(&attr))
+		return -1;
+
+	rtn = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) ||
+	      pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return rtn ? -1 : 0;
+}
+
+static void ctx_default_init(void)
+{
+	if (ctx_lock_init(&ctx_default.lock))
+		fprintf(stderr, "librsu: %s(): error: Unable to init lock\n",
+			__func__);
+}
+
+/**
+ * api_enter() - lock the selected context for a library call
+ * @rtn: set to the error code to return if the context cannot be locked
+ *
+ * The busy flag is checked before locking, so that calls made while an
+ * asynchronous operation holds the lock fail at once, and again after, in
+ * case the operation was started in between.
+ *
+ * Return: locked context, or NULL on error
+ */
+static struct rsu_ctx *api_enter(int *rtn)
+{
+	struct rsu_ctx *ctx = ctx_sel;
+
+	if (ctx == &ctx_default)
+		pthread_once(&ctx_default_once, ctx_default_init);
+
+	if (ctx->busy && ctx != ctx_owned) {
+		*rtn = -ECTXBUSY;
+		return NULL;
+	}
+
+	if (pthread_mutex_lock(&ctx->lock)) {
+		*rtn = -ELIB;
+		return NULL;
+	}
+
+	if (ctx->busy && ctx != ctx_owned) {
+		pthread_mutex_unlock(&ctx->lock);
+		*rtn = -ECTXBUSY;
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static void api_leave(struct rsu_ctx **ctx)
+{
+	if (*ctx)
+		pthread_mutex_unlock(&(*ctx)->lock);
+}
+
+/*
+ * API_ENTER() - lock the selected context until the library call returns,
+ * or return an error code from the call if it cannot be locked.
+ * API_ENTER_VOID() is the same for calls which do not return a value.
+ */
+#define API_LOCK							\
+	int api_rtn __attribute__((__unused__)) = 0;			\
+	struct rsu_ctx *api_ctx __attribute__((__cleanup__(api_leave))) = \
+		api_enter(&api_rtn)
+
+#define API_ENTER()							\
+	API_LOCK;							\
+	if (!api_ctx)							\
+		return api_rtn
+
+#define API_ENTER_VOID()						\
+	API_LOCK;							\
+	if (!api_ctx)							\
+		return
+
+/**
+ * ll_open() - make sure the low level interface is open
+ *
+ * When the library was initialized by librsu_init_lazy(), the flash devices
+ * are opened and the SPT/CPB loaded by the first call which needs them.
+ *
+ * Return: 0 on success, or -1 if the library is not initialized or the low
+ * level interface could not be opened
+ */
+static int ll_open(void)
+{
+	int rtn;
+
+	if (ls->ll_intf)
+		return 0;
+
+	if (!ls->lib_initialized)
+		return -1;
+
+	switch (librsu_cfg_get_roottype()) {
+	case DATAFILE:
+		rtn = librsu_ll_open_datafile(&ls->ll_intf);
+		break;
+	case QSPI:
+		rtn = librsu_ll_open_qspi(&ls->ll_intf);
+		break;
+	default:
+		rtn = -1;
+	}
+
+	if (rtn) {
+		librsu_log(LOW, __func__, "error: Unable to open flash");
+		ls->ll_intf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * push_open() - check for an open push programming handle
+ *
+ * While rsu_slot_program_begin() has a handle open in the context, slots are
+ * not erased or programmed by other calls and the context is not released,
+ * as the handle keeps the low level interface and the progress state.
+ *
+ * Return: 1 if a handle is open, 0 otherwise
+ */
+static int push_open(void)
+{
+	if (!ls->push)
+		return 0;
+
+	librsu_log(LOW, __func__, "error: A push programming handle is open");
+	return 1;
+}
+
+static int init_stream(FILE *cfg_file)
 {
-	FILE *cfg_file;
-	char *cfg_filename;
 	int rtn;
 
-	if (ll_intf) {
+	if (ls->lib_initialized) {
 		fprintf(stderr,
 			"librsu: %s(): error: Library already initialized\n",
 			__func__);
 		return -ELIB;
 	}
 
+	librsu_cfg_reset();
+	rtn = librsu_cfg_parse(cfg_file);
+	if (rtn)
+		return -ECFG;
+
+	switch (librsu_cfg_get_roottype()) {
+	case DATAFILE:
+	case QSPI:
+		break;
+	default:
+		librsu_cfg_reset();
+		return -ECFG;
+	}
+
+	ls->lib_initialized = 1;
+
+	return 0;
+}
+
+static int init_common(char *filename)
+{
+	FILE *cfg_file;
+	char *cfg_filename;
+	int rtn;
+
 	if (!filename || filename[0] == '\0')
 		cfg_filename = DEFAULT_CFG_FILENAME;
 	else
@@ -51,25 +284,22 @@ int librsu_init(char *filename)
 		return -EFILEIO;
 	}
 
-	librsu_cfg_reset();
-	rtn = librsu_cfg_parse(cfg_file);
+	rtn = init_stream(cfg_file);
 	fclose(cfg_file);
 
-	if (rtn)
-		return -ECFG;
+	return rtn;
+}
 
-	switch (librsu_cfg_get_roottype()) {
-	case DATAFILE:
-		rtn = librsu_ll_open_datafile(&ll_intf);
-		break;
-	case QSPI:
-		rtn = librsu_ll_open_qspi(&ll_intf);
-		break;
-	default:
-		rtn = -ECFG;
-	}
+int librsu_init(char *filename)
+{
+	int rtn;
+	API_ENTER();
 
-	if (rtn) {
+	rtn = init_common(filename);
+	if (rtn)
+		return rtn;
+
+	if (ll_open()) {
 		librsu_exit();
 		return -ECFG;
 	}
@@ -77,217 +307,1020 @@ int librsu_init(char *filename)
 	return 0;
 }
 
+int librsu_init_lazy(char *filename)
+{
+	API_ENTER();
+
+	return init_common(filename);
+}
+
 void librsu_exit(void)
 {
-	if (ll_intf && ll_intf->close)
-		ll_intf->close();
+	API_ENTER_VOID();
+
+	if (push_open())
+		return;
 
-	ll_intf = NULL;
+	rsu_priority_abort();
 
+	if (ls->ll_intf && ls->ll_intf->close)
+		ls->ll_intf->close();
+
+	ls->ll_intf = NULL;
+	ls->lib_initialized = 0;
+
+	rsu_status_watch_close();
+	librsu_misc_close_devattrs();
 	librsu_cfg_reset();
 }
 
 /**
- * rsu_cpb_corrupted_info() - corrupted cpb warning message
+ * ctx_select() - select the module states of a context for the calling thread
+ * @ctx: context, or NULL for the default context
  *
- * The function is used to output warning messages to user
+ * Return: the context previously selected
  */
-void rsu_cpb_corrupted_info(void)
+static struct rsu_ctx *ctx_select(struct rsu_ctx *ctx)
 {
-	librsu_log(LOW, __func__, "corrupted CPB --");
-	librsu_log(LOW, __func__, "run rsu_client create-empty-cpb or ");
-	librsu_log(LOW, __func__, "rsu_client restore_cpb <file_name> first\n");
+	struct rsu_ctx *prev = ctx_sel;
+
+	if (!ctx)
+		ctx = &ctx_default;
+
+	ctx_sel = ctx;
+	ls = &ctx->lib;
+	librsu_cfg_state_select(ctx->cfg);
+	librsu_misc_state_select(ctx->misc);
+	librsu_ll_qspi_state_select(ctx->qspi);
+
+	return prev;
 }
 
-/**
- * rsu_spt_corrupted_info() - corrupted spt warning message
- *
- * The function is used to output warning messages to user
- */
-void rsu_spt_corrupted_info(void)
+static void ctx_free(struct rsu_ctx *ctx)
 {
-	librsu_log(LOW, __func__, "corrupted SPT --");
-	librsu_log(LOW, __func__, "run rsu_client restore-spt <file_name> first\n");
+	librsu_cfg_state_free(ctx->cfg);
+	librsu_misc_state_free(ctx->misc);
+	librsu_ll_qspi_state_free(ctx->qspi);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
 }
 
-int rsu_slot_count(void)
+static struct rsu_ctx *ctx_new(void)
 {
-	int partitions;
-	int cnt = 0;
-	int x;
+	struct lib_state init = LIB_STATE_INIT;
+	struct rsu_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (ctx_lock_init(&ctx->lock)) {
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->lib = init;
+	ctx->cfg = librsu_cfg_state_new();
+	ctx->misc = librsu_misc_state_new();
+	ctx->qspi = librsu_ll_qspi_state_new();
+	if (!ctx->cfg || !ctx->misc || !ctx->qspi) {
+		ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+int rsu_open(char *filename, struct rsu_ctx **ctx)
+{
+	struct rsu_ctx *new;
+	struct rsu_ctx *prev;
+	int rtn;
 
-	if (!ll_intf)
+	if (!ctx)
+		return -EARGS;
+
+	new = ctx_new();
+	if (!new)
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
+	prev = ctx_select(new);
+	rtn = librsu_init(filename);
+	ctx_select(prev);
+
+	if (rtn) {
+		ctx_free(new);
+		return rtn;
 	}
 
-	partitions = ll_intf->partition.count();
+	*ctx = new;
+	return 0;
+}
+
+void rsu_close(struct rsu_ctx *ctx)
+{
+	struct rsu_ctx *prev;
+
+	if (!ctx)
+		return;
 
-	for (x = 0; x < partitions; x++) {
-		if (librsu_misc_is_slot(ll_intf, x))
-			cnt++;
+	if (ctx->busy || ctx->lib.push) {
+		fprintf(stderr,
+			"librsu: %s(): error: Context has an operation running\n",
+			__func__);
+		return;
 	}
 
-	return cnt;
+	if (ctx == ctx_cur)
+		rsu_use(NULL);
+
+	prev = ctx_select(ctx);
+	librsu_exit();
+	ctx_select(prev == ctx ? NULL : prev);
+
+	ctx_free(ctx);
 }
 
-int rsu_slot_by_name(char *name)
+void rsu_use(struct rsu_ctx *ctx)
 {
-	int partitions;
-	int x;
-	int cnt = 0;
+	ctx_cur = ctx;
+	ctx_select(ctx);
+}
 
-	if (!ll_intf)
-		return -ELIB;
+char *rsu_ctx_name(struct rsu_ctx *ctx)
+{
+	return ctx ? ctx->name : "";
+}
 
-	if (!name)
+/* options naming files which each target must have its own of */
+static char *target_files[] = {
+	"metadata-cache",
+	"digest-cache",
+	"program-journal",
+};
+
+/**
+ * shared_cfg_check() - check the lines shared by all targets of a cfg file
+ * @file: multi-target cfg file
+ *
+ * Files written by the library cannot be shared by targets, which would
+ * overwrite each other's caches and resume another target's programming.
+ *
+ * Return: 0 on success, or -ECFG if a shared line names such a file
+ */
+static int shared_cfg_check(FILE *file)
+{
+	char linebuf[256];
+	char key[16];
+	unsigned int x;
+	int linenum = 0;
+
+	rewind(file);
+	while (fgets(linebuf, sizeof(linebuf), file)) {
+		linenum++;
+
+		if (sscanf(linebuf, " %15s", key) != 1)
+			continue;
+
+		if (strcmp(key, "target") == 0)
+			break;
+
+		for (x = 0; x < sizeof(target_files) / sizeof(target_files[0]);
+		     x++) {
+			if (strcmp(key, target_files[x]) == 0) {
+				fprintf(stderr,
+					"librsu: %s(): error: '%s' must be set per target @%i\n",
+					__func__, key, linenum);
+				return -ECFG;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * target_cfg() - extract the cfg of one target from a multi-target cfg file
+ * @file: multi-target cfg file
+ * @target: index of the target
+ * @name: set to the name of the target
+ * @len: set to the length of the returned cfg
+ *
+ * The cfg of a target is made of the lines before the first 'target' line,
+ * and the lines of its own section. Other lines are blanked rather than
+ * dropped, so that parse errors report the line numbers of the file.
+ *
+ * Return: allocated cfg text, or NULL if there is no such target
+ */
+static char *target_cfg(FILE *file, int target, char *name, size_t *len)
+{
+	char linebuf[256];
+	char key[16];
+	char *cfg = NULL;
+	FILE *out;
+	int cur = -1;
+
+	out = open_memstream(&cfg, len);
+	if (!out)
+		return NULL;
+
+	rewind(file);
+	while (fgets(linebuf, sizeof(linebuf), file)) {
+		if (sscanf(linebuf, " %15s", key) == 1 &&
+		    strcmp(key, "target") == 0) {
+			cur++;
+			if (cur == target &&
+			    sscanf(linebuf, " %*s %31s", name) != 1)
+				name[0] = '\0';
+			fputs("\n", out);
+		} else if (cur < 0 || cur == target) {
+			fputs(linebuf, out);
+		} else {
+			fputs("\n", out);
+		}
+	}
+
+	fclose(out);
+
+	if (cur < target) {
+		free(cfg);
+		return NULL;
+	}
+
+	return cfg;
+}
+
+int rsu_targets_open(char *filename, struct rsu_ctx **ctxs, int max)
+{
+	struct rsu_ctx *new;
+	struct rsu_ctx *prev;
+	FILE *file;
+	FILE *cfg_file;
+	char *cfg;
+	size_t len;
+	int count;
+	int rtn = 0;
+
+	if (!filename || !ctxs || max <= 0)
 		return -EARGS;
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
+	file = fopen(filename, "r");
+	if (!file)
+		return -EFILEIO;
+
+	rtn = shared_cfg_check(file);
+	if (rtn) {
+		fclose(file);
+		return rtn;
 	}
 
-	partitions = ll_intf->partition.count();
+	for (count = 0; count < max; count++) {
+		new = ctx_new();
+		if (!new) {
+			rtn = -ELIB;
+			break;
+		}
 
-	for (x = 0; x < partitions; x++) {
-		if (librsu_misc_is_slot(ll_intf, x)) {
-			if (!strcmp(name, ll_intf->partition.name(x)))
-				return cnt;
+		cfg = target_cfg(file, count, new->name, &len);
+		if (!cfg) {
+			ctx_free(new);
+			break;
+		}
+
+		if (new->name[0] == '\0') {
+			fprintf(stderr,
+				"librsu: %s(): error: Missing name for target %i\n",
+				__func__, count);
+			rtn = -ECFG;
+		} else {
+			cfg_file = fmemopen(cfg, len, "r");
+			prev = ctx_select(new);
+			rtn = cfg_file ? init_stream(cfg_file) : -ELIB;
+			ctx_select(prev);
+			if (cfg_file)
+				fclose(cfg_file);
+		}
+
+		free(cfg);
 
-			cnt++;
+		if (rtn) {
+			ctx_free(new);
+			break;
 		}
+
+		ctxs[count] = new;
+	}
+
+	fclose(file);
+
+	if (!rtn && count == 0)
+		rtn = -ECFG;
+
+	if (rtn) {
+		while (count--)
+			rsu_close(ctxs[count]);
+		return rtn;
 	}
 
-	return -ENAME;
+	return count;
 }
 
-int rsu_slot_get_info(int slot, struct rsu_slot_info *info)
+struct fanout {
+	struct rsu_ctx *ctx;
+	int index;
+	rsu_target_fn fn;
+	void *arg;
+	int result;
+};
+
+static void *fanout_thread(void *arg)
 {
-	int part_num;
+	struct fanout *job = arg;
 
-	if (!ll_intf)
-		return -ELIB;
+	rsu_use(job->ctx);
+	job->result = job->fn(job->index, job->arg);
+	rsu_use(NULL);
 
-	if (!info)
+	return NULL;
+}
+
+int rsu_targets_run(struct rsu_ctx **ctxs, int count, rsu_target_fn fn,
+		    void *arg, int *results)
+{
+	struct fanout *jobs;
+	pthread_t *threads;
+	int x;
+
+	if (!ctxs || count <= 0 || !fn || !results)
 		return -EARGS;
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
+	jobs = calloc(count, sizeof(*jobs));
+	threads = calloc(count, sizeof(*threads));
+	if (!jobs || !threads) {
+		free(jobs);
+		free(threads);
+		return -ELIB;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
-		rsu_cpb_corrupted_info();
-		return -ECORRUPTED_CPB;
+	for (x = 0; x < count; x++) {
+		jobs[x].ctx = ctxs[x];
+		jobs[x].index = x;
+		jobs[x].fn = fn;
+		jobs[x].arg = arg;
+		jobs[x].result = -ELIB;
+
+		if (pthread_create(&threads[x], NULL, fanout_thread, &jobs[x]))
+			jobs[x].ctx = NULL;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
+	for (x = 0; x < count; x++) {
+		if (jobs[x].ctx)
+			pthread_join(threads[x], NULL);
+		results[x] = jobs[x].result;
+	}
 
-	SAFE_STRCPY(info->name, sizeof(info->name),
-		    ll_intf->partition.name(part_num), sizeof(info->name));
+	free(jobs);
+	free(threads);
+
+	return 0;
+}
+
+/**
+ * rsu_cpb_corrupted_info() - corrupted cpb warning message
+ *
+ * The function is used to output warning messages to user
+ */
+void rsu_cpb_corrupted_info(void)
+{
+	librsu_log(LOW, __func__, "corrupted CPB --");
+	librsu_log(LOW, __func__, "run rsu_client create-empty-cpb or ");
+	librsu_log(LOW, __func__, "rsu_client restore_cpb <file_name> first\n");
+}
+
+/**
+ * rsu_spt_corrupted_info() - corrupted spt warning message
+ *
+ * The function is used to output warning messages to user
+ */
+void rsu_spt_corrupted_info(void)
+{
+	librsu_log(LOW, __func__, "corrupted SPT --");
+	librsu_log(LOW, __func__, "run rsu_client restore-spt <file_name> first\n");
+}
+
+int rsu_slot_count(void)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	return ls->ll_intf->partition.slots();
+}
+
+int rsu_slot_by_name(char *name)
+{
+	int slot;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (!name)
+		return -EARGS;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	slot = ls->ll_intf->partition.part2slot(
+		ls->ll_intf->partition.by_name(name));
+	if (slot < 0)
+		return -ENAME;
+
+	return slot;
+}
+
+int rsu_slot_get_info(int slot, struct rsu_slot_info *info)
+{
+	int part_num;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (!info)
+		return -EARGS;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	SAFE_STRCPY(info->name, sizeof(info->name),
+		    ls->ll_intf->partition.name(part_num), sizeof(info->name));
+
+	info->offset = ls->ll_intf->partition.offset(part_num);
+	info->size = ls->ll_intf->partition.size(part_num);
+	info->priority = ls->ll_intf->priority.get(part_num);
+
+	return 0;
+}
+
+int rsu_slot_size(int slot)
+{
+	int part_num;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	return ls->ll_intf->partition.size(part_num);
+}
+
+int rsu_slot_priority(int slot)
+{
+	int part_num;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	return ls->ll_intf->priority.get(part_num);
+}
+
+int rsu_slot_erase(int slot)
+{
+	int part_num;
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (librsu_cfg_writeprotected(slot)) {
+		librsu_log(HIGH, __func__,
+			   "Trying to erase a write protected slot");
+		return -EWRPROT;
+	}
+
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	if (ls->ll_intf->priority.remove(part_num))
+		return -ELOWLEVEL;
+
+	librsu_digest_forget(ls->ll_intf->partition.offset(part_num));
+
+	librsu_misc_progress_begin(RSU_PROGRESS_ERASE,
+				   ls->ll_intf->partition.size(part_num));
+
+	rtn = ls->ll_intf->data.erase(part_num) ? -ELOWLEVEL : 0;
+
+	librsu_misc_progress_end(rtn);
+
+	return rtn;
+}
+
+int rsu_slot_program_buf(int slot, void *buf, int size)
+{
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (librsu_cb_buf_init(buf, size)) {
+		librsu_log(HIGH, __func__, "Bad buf/size arguments");
+		return -EARGS;
+	}
+
+	rtn = librsu_cb_program_common(ls->ll_intf, slot, librsu_cb_buf, 0);
+
+	librsu_cb_buf_cleanup();
+
+	return rtn;
+}
+
+/*
+ * This API was added to force users to use the updated image handling
+ * algorithm, introduced at the same time, which deals properly with both
+ * regular and factory update images.
+ */
+int rsu_slot_program_factory_update_buf(int slot, void *buf, int size)
+{
+	return rsu_slot_program_buf(slot, buf, size);
+}
+
+int rsu_slot_program_file(int slot, char *filename)
+{
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (librsu_cb_file_init(filename)) {
+		librsu_log(HIGH, __func__, "Unable to open file '%s'",
+			   filename);
+		return -EFILEIO;
+	}
+
+	rtn = librsu_cb_program_common(ls->ll_intf, slot, librsu_cb_file, 0);
+
+	librsu_cb_file_cleanup();
+
+	return rtn;
+}
+
+/*
+ * This API was added to force users to use the updated image handling
+ * algorithm, introduced at the same time, which deals properly with both
+ * regular and factory update images.
+ */
+int rsu_slot_program_factory_update_file(int slot, char *filename)
+{
+	return rsu_slot_program_file(slot, filename);
+}
+
+int rsu_slot_program_file_resume(int slot, char *filename)
+{
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (librsu_cb_file_init(filename)) {
+		librsu_log(HIGH, __func__, "Unable to open file '%s'",
+			   filename);
+		return -EFILEIO;
+	}
+
+	rtn = librsu_cb_program_resume(ls->ll_intf, slot, librsu_cb_file);
+
+	librsu_cb_file_cleanup();
+
+	return rtn;
+}
+
+static int program_begin(int slot, int rawdata, struct rsu_program **prog)
+{
+	int rtn;
+
+	if (!prog)
+		return -EARGS;
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (!rawdata && ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	rtn = librsu_cb_program_begin(ls->ll_intf, slot, rawdata, prog);
+	if (rtn)
+		return rtn;
+
+	(*prog)->ctx = ctx_sel;
+	ls->push = *prog;
+
+	return 0;
+}
+
+int rsu_slot_program_begin(int slot, struct rsu_program **prog)
+{
+	API_ENTER();
+
+	return program_begin(slot, 0, prog);
+}
+
+int rsu_slot_program_begin_raw(int slot, struct rsu_program **prog)
+{
+	API_ENTER();
+
+	return program_begin(slot, 1, prog);
+}
+
+/*
+ * A push programming handle is always used in the context it was opened in,
+ * whichever context the calling thread has selected.
+ */
+static int program_write(struct rsu_program *prog, void *buf, int len)
+{
+	API_ENTER();
+
+	return librsu_cb_program_write(prog, buf, len);
+}
+
+int rsu_slot_program_write(struct rsu_program *prog, void *buf, int len)
+{
+	struct rsu_ctx *prev;
+	int rtn;
+
+	if (!prog || (!buf && len) || len < 0)
+		return -EARGS;
+
+	prev = ctx_select(prog->ctx);
+	rtn = program_write(prog, buf, len);
+	ctx_select(prev);
+
+	return rtn;
+}
+
+static int program_commit(struct rsu_program *prog)
+{
+	API_ENTER();
+
+	ls->push = NULL;
+
+	return librsu_cb_program_commit(prog);
+}
+
+int rsu_slot_program_commit(struct rsu_program *prog)
+{
+	struct rsu_ctx *prev;
+	int rtn;
+
+	if (!prog)
+		return -EARGS;
+
+	prev = ctx_select(prog->ctx);
+	rtn = program_commit(prog);
+	ctx_select(prev);
+
+	return rtn;
+}
+
+static void program_abort(struct rsu_program *prog)
+{
+	API_ENTER_VOID();
+
+	ls->push = NULL;
+
+	librsu_cb_program_abort(prog);
+}
+
+void rsu_slot_program_abort(struct rsu_program *prog)
+{
+	struct rsu_ctx *prev;
+
+	if (!prog)
+		return;
+
+	prev = ctx_select(prog->ctx);
+	program_abort(prog);
+	ctx_select(prev);
+}
+
+void rsu_cancel(struct rsu_ctx *ctx)
+{
+	librsu_misc_cancel(ctx ? ctx->misc : NULL);
+}
+
+int rsu_slot_program_buf_raw(int slot, void *buf, int size)
+{
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (librsu_cb_buf_init(buf, size)) {
+		librsu_log(HIGH, __func__, "Bad buf/size arguments");
+		return -EARGS;
+	}
+
+	rtn = librsu_cb_program_common(ls->ll_intf, slot, librsu_cb_buf, 1);
+
+	librsu_cb_buf_cleanup();
+
+	return rtn;
+}
+
+int rsu_slot_program_file_raw(int slot, char *filename)
+{
+	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (librsu_cb_file_init(filename)) {
+		librsu_log(HIGH, __func__, "Unable to open file '%s'",
+			   filename);
+		return -EFILEIO;
+	}
+
+	rtn = librsu_cb_program_common(ls->ll_intf, slot, librsu_cb_file, 1);
+
+	librsu_cb_file_cleanup();
+
+	return rtn;
+}
+
+static int slot_iov(int slot, const struct iovec *iov, int iovcnt,
+		    int verify, int rawdata)
+{
+	int rtn;
+
+	if (ll_open())
+		return -ELIB;
+
+	if (!verify && push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (!rawdata && ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (librsu_cb_iov_init(iov, iovcnt)) {
+		librsu_log(HIGH, __func__, "Bad iov/iovcnt arguments");
+		return -EARGS;
+	}
+
+	if (verify)
+		rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_iov,
+					      rawdata);
+	else
+		rtn = librsu_cb_program_common(ls->ll_intf, slot,
+					       librsu_cb_iov, rawdata);
+
+	librsu_cb_iov_cleanup();
+
+	return rtn;
+}
 
-	info->offset = ll_intf->partition.offset(part_num);
-	info->size = ll_intf->partition.size(part_num);
-	info->priority = ll_intf->priority.get(part_num);
+int rsu_slot_program_iov(int slot, const struct iovec *iov, int iovcnt)
+{
+	API_ENTER();
 
-	return 0;
+	return slot_iov(slot, iov, iovcnt, 0, 0);
 }
 
-int rsu_slot_size(int slot)
+int rsu_slot_program_iov_raw(int slot, const struct iovec *iov, int iovcnt)
 {
-	int part_num;
+	API_ENTER();
 
-	if (!ll_intf)
-		return -ELIB;
+	return slot_iov(slot, iov, iovcnt, 0, 1);
+}
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
-	}
+int rsu_slot_verify_iov(int slot, const struct iovec *iov, int iovcnt)
+{
+	API_ENTER();
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
+	return slot_iov(slot, iov, iovcnt, 1, 0);
+}
+
+int rsu_slot_verify_iov_raw(int slot, const struct iovec *iov, int iovcnt)
+{
+	API_ENTER();
 
-	return ll_intf->partition.size(part_num);
+	return slot_iov(slot, iov, iovcnt, 1, 1);
 }
 
-int rsu_slot_priority(int slot)
+static int slot_fd(int slot, int fd, int verify, int rawdata)
 {
-	int part_num;
+	int rtn;
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (!verify && push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (!rawdata && ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
+	if (librsu_cb_fd_init(fd)) {
+		librsu_log(HIGH, __func__, "Unable to use file descriptor %i",
+			   fd);
+		return -EFILEIO;
+	}
 
-	return ll_intf->priority.get(part_num);
+	if (verify)
+		rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_file,
+					      rawdata);
+	else
+		rtn = librsu_cb_program_common(ls->ll_intf, slot,
+					       librsu_cb_file, rawdata);
+
+	librsu_cb_file_cleanup();
+
+	return rtn;
 }
 
-int rsu_slot_erase(int slot)
+int rsu_slot_program_fd(int slot, int fd)
 {
-	int part_num;
-
-	if (!ll_intf)
-		return -ELIB;
+	API_ENTER();
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
-	}
+	return slot_fd(slot, fd, 0, 0);
+}
 
-	if (ll_intf->cpb_ops.corrupted()) {
-		rsu_cpb_corrupted_info();
-		return -ECORRUPTED_CPB;
-	}
+int rsu_slot_program_fd_raw(int slot, int fd)
+{
+	API_ENTER();
 
-	if (librsu_cfg_writeprotected(slot)) {
-		librsu_log(HIGH, __func__,
-			   "Trying to erase a write protected slot");
-		return -EWRPROT;
-	}
+	return slot_fd(slot, fd, 0, 1);
+}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
+int rsu_slot_verify_fd(int slot, int fd)
+{
+	API_ENTER();
 
-	if (ll_intf->priority.remove(part_num))
-		return -ELOWLEVEL;
+	return slot_fd(slot, fd, 1, 0);
+}
 
-	if (ll_intf->data.erase(part_num))
-		return -ELOWLEVEL;
+int rsu_slot_verify_fd_raw(int slot, int fd)
+{
+	API_ENTER();
 
-	return 0;
+	return slot_fd(slot, fd, 1, 1);
 }
 
-int rsu_slot_program_buf(int slot, void *buf, int size)
+int rsu_slot_verify_buf(int slot, void *buf, int size)
 {
 	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
@@ -297,33 +1330,27 @@ int rsu_slot_program_buf(int slot, void *buf, int size)
 		return -EARGS;
 	}
 
-	rtn = librsu_cb_program_common(ll_intf, slot, librsu_cb_buf, 0);
+	rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_buf, 0);
 
 	librsu_cb_buf_cleanup();
 
 	return rtn;
 }
 
-/*
- * This API was added to force users to use the updated image handling
- * algorithm, introduced at the same time, which deals properly with both
- * regular and factory update images.
- */
-int rsu_slot_program_factory_update_buf(int slot, void *buf, int size)
-{
-	return rsu_slot_program_buf(slot, buf, size);
-}
-
-int rsu_slot_program_file(int slot, char *filename)
+int rsu_slot_verify_file(int slot, char *filename)
 {
 	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
@@ -334,28 +1361,22 @@ int rsu_slot_program_file(int slot, char *filename)
 		return -EFILEIO;
 	}
 
-	rtn = librsu_cb_program_common(ll_intf, slot, librsu_cb_file, 0);
+	rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_file, 0);
 
 	librsu_cb_file_cleanup();
 
 	return rtn;
 }
 
-/*
- * This API was added to force users to use the updated image handling
- * algorithm, introduced at the same time, which deals properly with both
- * regular and factory update images.
- */
-int rsu_slot_program_factory_update_file(int slot, char *filename)
-{
-	return rsu_slot_program_file(slot, filename);
-}
-
-int rsu_slot_program_buf_raw(int slot, void *buf, int size)
+int rsu_slot_verify_buf_raw(int slot, void *buf, int size)
 {
 	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
@@ -365,18 +1386,22 @@ int rsu_slot_program_buf_raw(int slot, void *buf, int size)
 		return -EARGS;
 	}
 
-	rtn = librsu_cb_program_common(ll_intf, slot, librsu_cb_buf, 1);
+	rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_buf, 1);
 
 	librsu_cb_buf_cleanup();
 
 	return rtn;
 }
 
-int rsu_slot_program_file_raw(int slot, char *filename)
+int rsu_slot_verify_file_raw(int slot, char *filename)
 {
 	int rtn;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
@@ -387,261 +1412,557 @@ int rsu_slot_program_file_raw(int slot, char *filename)
 		return -EFILEIO;
 	}
 
-	rtn = librsu_cb_program_common(ll_intf, slot, librsu_cb_file, 1);
+	rtn = librsu_cb_verify_common(ls->ll_intf, slot, librsu_cb_file, 1);
 
 	librsu_cb_file_cleanup();
 
 	return rtn;
 }
 
-int rsu_slot_verify_buf(int slot, void *buf, int size)
+int rsu_slot_program_callback(int slot, rsu_data_callback callback)
 {
-	int rtn;
+	API_ENTER();
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
-	}
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->cpb_ops.corrupted()) {
-		rsu_cpb_corrupted_info();
-		return -ECORRUPTED_CPB;
-	}
+	if (push_open())
+		return -ECTXBUSY;
 
-	if (librsu_cb_buf_init(buf, size)) {
-		librsu_log(HIGH, __func__, "Bad buf/size arguments");
-		return -EARGS;
-	}
+	return librsu_cb_program_common(ls->ll_intf, slot, callback, 0);
+}
+
+int rsu_slot_program_callback_raw(int slot, rsu_data_callback callback)
+{
+	API_ENTER();
 
-	rtn = librsu_cb_verify_common(ll_intf, slot, librsu_cb_buf, 0);
+	if (ll_open())
+		return -ELIB;
 
-	librsu_cb_buf_cleanup();
+	if (push_open())
+		return -ECTXBUSY;
 
-	return rtn;
+	return librsu_cb_program_common(ls->ll_intf, slot, callback, 1);
 }
 
-int rsu_slot_verify_file(int slot, char *filename)
+int rsu_slot_verify_callback(int slot, rsu_data_callback callback)
 {
-	int rtn;
+	API_ENTER();
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
+	if (ll_open())
+		return -ELIB;
+
+	return librsu_cb_verify_common(ls->ll_intf, slot, callback, 0);
+}
+
+int rsu_slot_verify_callback_raw(int slot, rsu_data_callback callback)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return librsu_cb_verify_common(ls->ll_intf, slot, callback, 1);
+}
+
+int rsu_slot_program_borrow(int slot, rsu_borrow_callback callback)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	return librsu_cb_program_borrowed(ls->ll_intf, slot, callback, 0);
+}
+
+int rsu_slot_program_borrow_raw(int slot, rsu_borrow_callback callback)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	return librsu_cb_program_borrowed(ls->ll_intf, slot, callback, 1);
+}
+
+int rsu_slot_verify_borrow(int slot, rsu_borrow_callback callback)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return librsu_cb_verify_borrowed(ls->ll_intf, slot, callback, 0);
+}
+
+int rsu_slot_verify_borrow_raw(int slot, rsu_borrow_callback callback)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return librsu_cb_verify_borrowed(ls->ll_intf, slot, callback, 1);
+}
+
+int rsu_progress_set(rsu_progress_callback callback, void *arg,
+		     int interval_ms)
+{
+	API_ENTER();
+
+	if (librsu_misc_progress_set(callback, arg, interval_ms))
+		return -EARGS;
+
+	return 0;
+}
+
+enum async_kind {
+	ASYNC_ERASE,
+	ASYNC_PROGRAM_BUF,
+	ASYNC_PROGRAM_FILE,
+	ASYNC_VERIFY_BUF,
+	ASYNC_VERIFY_FILE,
+};
+
+struct rsu_async {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int evfd;
+	rsu_async_callback callback;
+	void *arg;
+	rsu_progress_callback progress;
+	void *progress_arg;
+
+	/* operation being run, and the context it runs with */
+	struct rsu_ctx *ctx;
+	enum async_kind kind;
+	int raw;
+	int slot;
+	void *buf;
+	int size;
+	char *filename;
+
+	int started;
+	int done;
+	int result;
+};
+
+struct rsu_async *rsu_async_new(rsu_async_callback callback, void *arg)
+{
+	struct rsu_async *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (op->evfd < 0) {
+		free(op);
+		return NULL;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
-		rsu_cpb_corrupted_info();
-		return -ECORRUPTED_CPB;
+	if (pthread_mutex_init(&op->lock, NULL)) {
+		close(op->evfd);
+		free(op);
+		return NULL;
 	}
 
-	if (librsu_cb_file_init(filename)) {
-		librsu_log(HIGH, __func__, "Unable to open file '%s'",
-			   filename);
-		return -EFILEIO;
+	op->callback = callback;
+	op->arg = arg;
+
+	return op;
+}
+
+static void async_join(struct rsu_async *op)
+{
+	if (!op->started)
+		return;
+
+	pthread_join(op->thread, NULL);
+	op->started = 0;
+
+	free(op->filename);
+	op->filename = NULL;
+}
+
+void rsu_async_free(struct rsu_async *op)
+{
+	if (!op)
+		return;
+
+	if (op == async_cur) {
+		librsu_log(LOW, __func__,
+			   "error: Cannot free an operation from its callback");
+		return;
 	}
 
-	rtn = librsu_cb_verify_common(ll_intf, slot, librsu_cb_file, 0);
+	async_join(op);
+	pthread_mutex_destroy(&op->lock);
+	close(op->evfd);
+	free(op);
+}
 
-	librsu_cb_file_cleanup();
+int rsu_async_set_progress(struct rsu_async *op,
+			   rsu_progress_callback callback, void *arg)
+{
+	if (!op)
+		return -EARGS;
 
-	return rtn;
+	op->progress = callback;
+	op->progress_arg = arg;
+
+	return 0;
 }
 
-int rsu_slot_verify_buf_raw(int slot, void *buf, int size)
+void rsu_async_cancel(struct rsu_async *op)
+{
+	if (!op)
+		return;
+
+	/* The request must not reach a later operation of the context */
+	pthread_mutex_lock(&op->lock);
+	if (op->started && !op->done)
+		rsu_cancel(op->ctx);
+	pthread_mutex_unlock(&op->lock);
+}
+
+int rsu_async_fd(struct rsu_async *op)
 {
+	return op ? op->evfd : -EARGS;
+}
+
+int rsu_async_result(struct rsu_async *op, int *result)
+{
+	__u64 count;
+	int done;
+
+	if (!op || !result)
+		return -EARGS;
+
+	if (!op->started && !op->done)
+		return -ELIB;
+
+	pthread_mutex_lock(&op->lock);
+	done = op->done;
+	*result = op->result;
+	pthread_mutex_unlock(&op->lock);
+
+	if (!done)
+		return 1;
+
+	if (read(op->evfd, &count, sizeof(count)) < 0)
+		count = 0;
+
+	return 0;
+}
+
+int rsu_async_wait(struct rsu_async *op)
+{
+	int result;
 	int rtn;
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
+	if (!op)
+		return -EARGS;
+
+	/* From the completion callback, the operation is already complete */
+	if (op != async_cur)
+		async_join(op);
+
+	rtn = rsu_async_result(op, &result);
+	if (rtn < 0)
+		return rtn;
+
+	return result;
+}
+
+static void *async_thread(void *arg)
+{
+	struct rsu_async *op = arg;
+	__u64 one = 1;
+	int rtn;
+
+	/* The context belongs to the worker until the operation completes */
+	async_cur = op;
+	ctx_owned = op->ctx;
+	ctx_select(op->ctx);
+	librsu_misc_progress_override(op->progress, op->progress_arg);
+
+	switch (op->kind) {
+	case ASYNC_ERASE:
+		rtn = rsu_slot_erase(op->slot);
+		break;
+	case ASYNC_PROGRAM_BUF:
+		rtn = op->raw ? rsu_slot_program_buf_raw(op->slot, op->buf,
+							 op->size) :
+				rsu_slot_program_buf(op->slot, op->buf,
+						     op->size);
+		break;
+	case ASYNC_PROGRAM_FILE:
+		rtn = op->raw ? rsu_slot_program_file_raw(op->slot,
+							  op->filename) :
+				rsu_slot_program_file(op->slot, op->filename);
+		break;
+	case ASYNC_VERIFY_BUF:
+		rtn = op->raw ? rsu_slot_verify_buf_raw(op->slot, op->buf,
+							op->size) :
+				rsu_slot_verify_buf(op->slot, op->buf,
+						    op->size);
+		break;
+	case ASYNC_VERIFY_FILE:
+		rtn = op->raw ? rsu_slot_verify_file_raw(op->slot,
+							 op->filename) :
+				rsu_slot_verify_file(op->slot, op->filename);
+		break;
+	default:
+		rtn = -EARGS;
 	}
 
-	if (librsu_cb_buf_init(buf, size)) {
-		librsu_log(HIGH, __func__, "Bad buf/size arguments");
+	librsu_misc_progress_override(NULL, NULL);
+
+	ctx_owned = NULL;
+
+	pthread_mutex_lock(&op->lock);
+	librsu_misc_cancel_end();
+	op->ctx->busy = 0;
+	op->result = rtn;
+	op->done = 1;
+	pthread_mutex_unlock(&op->lock);
+
+	if (op->callback)
+		op->callback(op, rtn, op->arg);
+
+	if (write(op->evfd, &one, sizeof(one)) < 0)
+		librsu_log(LOW, __func__, "error: Unable to signal completion");
+
+	return NULL;
+}
+
+static int async_start(struct rsu_async *op, enum async_kind kind, int raw,
+		       int slot, void *buf, int size, char *filename)
+{
+	int done;
+	API_ENTER();
+
+	if (!op || op == async_cur)
 		return -EARGS;
+
+	pthread_mutex_lock(&op->lock);
+	done = op->done;
+	pthread_mutex_unlock(&op->lock);
+
+	if (op->started && !done) {
+		librsu_log(LOW, __func__, "error: Operation already running");
+		return -ELIB;
 	}
 
-	rtn = librsu_cb_verify_common(ll_intf, slot, librsu_cb_buf, 1);
+	async_join(op);
 
-	librsu_cb_buf_cleanup();
+	if (!ls->lib_initialized) {
+		librsu_log(LOW, __func__, "error: Library not initialized");
+		return -ELIB;
+	}
 
-	return rtn;
+	if (filename) {
+		op->filename = strdup(filename);
+		if (!op->filename)
+			return -ELIB;
+	}
+
+	op->ctx = ctx_sel;
+	op->kind = kind;
+	op->raw = raw;
+	op->slot = slot;
+	op->buf = buf;
+	op->size = size;
+	op->done = 0;
+	op->result = 0;
+
+	op->ctx->busy = 1;
+
+	/* The operation can be cancelled from now on, until it completes */
+	librsu_misc_cancel_begin();
+
+	if (pthread_create(&op->thread, NULL, async_thread, op)) {
+		librsu_log(LOW, __func__, "error: Unable to start worker");
+		librsu_misc_cancel_end();
+		op->ctx->busy = 0;
+		free(op->filename);
+		op->filename = NULL;
+		return -ELIB;
+	}
+
+	op->started = 1;
+
+	return 0;
 }
 
-int rsu_slot_verify_file_raw(int slot, char *filename)
+int rsu_async_slot_erase(struct rsu_async *op, int slot)
 {
-	int rtn;
+	return async_start(op, ASYNC_ERASE, 0, slot, NULL, 0, NULL);
+}
 
-	if (ll_intf->spt_ops.corrupted()) {
-		rsu_spt_corrupted_info();
-		return -ECORRUPTED_SPT;
-	}
+int rsu_async_slot_program_buf(struct rsu_async *op, int slot, void *buf,
+			       int size)
+{
+	return async_start(op, ASYNC_PROGRAM_BUF, 0, slot, buf, size, NULL);
+}
 
-	if (librsu_cb_file_init(filename)) {
-		librsu_log(HIGH, __func__, "Unable to open file '%s'",
+int rsu_async_slot_program_file(struct rsu_async *op, int slot,
+				char *filename)
+{
+	return async_start(op, ASYNC_PROGRAM_FILE, 0, slot, NULL, 0,
 			   filename);
-		return -EFILEIO;
-	}
-
-	rtn = librsu_cb_verify_common(ll_intf, slot, librsu_cb_file, 1);
+}
 
-	librsu_cb_file_cleanup();
+int rsu_async_slot_program_buf_raw(struct rsu_async *op, int slot, void *buf,
+				   int size)
+{
+	return async_start(op, ASYNC_PROGRAM_BUF, 1, slot, buf, size, NULL);
+}
 
-	return rtn;
+int rsu_async_slot_program_file_raw(struct rsu_async *op, int slot,
+				    char *filename)
+{
+	return async_start(op, ASYNC_PROGRAM_FILE, 1, slot, NULL, 0,
+			   filename);
 }
 
-int rsu_slot_program_callback(int slot, rsu_data_callback callback)
+int rsu_async_slot_verify_buf(struct rsu_async *op, int slot, void *buf,
+			      int size)
 {
-	return librsu_cb_program_common(ll_intf, slot, callback, 0);
+	return async_start(op, ASYNC_VERIFY_BUF, 0, slot, buf, size, NULL);
 }
 
-int rsu_slot_program_callback_raw(int slot, rsu_data_callback callback)
+int rsu_async_slot_verify_file(struct rsu_async *op, int slot,
+			       char *filename)
 {
-	return librsu_cb_program_common(ll_intf, slot, callback, 1);
+	return async_start(op, ASYNC_VERIFY_FILE, 0, slot, NULL, 0, filename);
 }
 
-int rsu_slot_verify_callback(int slot, rsu_data_callback callback)
+int rsu_async_slot_verify_buf_raw(struct rsu_async *op, int slot, void *buf,
+				  int size)
 {
-	return librsu_cb_verify_common(ll_intf, slot, callback, 0);
+	return async_start(op, ASYNC_VERIFY_BUF, 1, slot, buf, size, NULL);
 }
 
-int rsu_slot_verify_callback_raw(int slot, rsu_data_callback callback)
+int rsu_async_slot_verify_file_raw(struct rsu_async *op, int slot,
+				   char *filename)
 {
-	return librsu_cb_verify_common(ll_intf, slot, callback, 1);
+	return async_start(op, ASYNC_VERIFY_FILE, 1, slot, NULL, 0,
+			   filename);
 }
 
 int rsu_slot_copy_to_file(int slot, char *filename)
 {
-	int part_num;
-	int df;
-	int offset;
-	char buf[0x1000];
-	char fill[0x1000];
-	int last_write;
-	unsigned int x;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (!filename)
-		return -EARGS;
-
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
-
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	if (ll_intf->priority.get(part_num) <= 0) {
-		librsu_log(HIGH, __func__, "Trying to read an erased slot");
-		return -EERASE;
-	}
+	return librsu_copy_to_file(ls->ll_intf, slot, filename);
+}
 
-	df = open(filename, O_WRONLY | O_CREAT, 0600);
-	if (df < 0) {
-		librsu_log(HIGH, __func__,
-			   "Unable to open output file '%s'", filename);
-		return -EFILEIO;
+int rsu_slot_copy(int src_slot, int dst_slot)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
 	}
 
-	if (ftruncate(df, 0)) {
-		librsu_log(HIGH, __func__,
-			   "Unable to truncate file '%s' to length zero",
-			   filename);
-		close(df);
-		return -EFILEIO;
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
 	}
 
-	offset = 0;
-	last_write = 0;
+	return librsu_copy_slot(ls->ll_intf, src_slot, dst_slot);
+}
+
+int rsu_slot_check(int slot)
+{
+	API_ENTER();
 
-	memset(fill, 0xff, sizeof(fill));
+	if (ll_open())
+		return -ELIB;
 
-	/* Read buf sized chunks from slot and write to file */
-	while (offset < ll_intf->partition.size(part_num)) {
-		/* Read a buffer size chunk from slot */
-		if (ll_intf->data.read(part_num, offset, sizeof(buf), buf)) {
-			librsu_log(HIGH, __func__,
-				   "Unable to rd slot %i, offs 0x%08x, cnt %i",
-				   slot, offset, sizeof(buf));
-			close(df);
-			return -ELOWLEVEL;
-		}
-		/* Scan buffer to see if we have all 0xff's. Don't write to
-		 * file if we do.  If we skipped some chunks because they
-		 * were all 0xff's and then find one that is not, we fill
-		 * the file with 0xff chunks up to the current position.
-		 */
-		for (x = 0; x < sizeof(buf); x++) {
-			if (buf[x] != (char)0xFF)
-				break;
-		}
-		if (x < sizeof(buf)) {
-			while (last_write < offset) {
-				if (write(df, fill, sizeof(fill)) !=
-				    sizeof(fill)) {
-					librsu_log(HIGH, __func__,
-						   "Unable to wr to '%s'",
-						   filename);
-					close(df);
-					return -EFILEIO;
-				}
-				last_write += sizeof(fill);
-			}
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
 
-			if (write(df, buf, sizeof(buf)) != sizeof(buf)) {
-				librsu_log(HIGH, __func__,
-					   "Unable to wr to file '%s'",
-					   filename);
-				close(df);
-				return -EFILEIO;
-			}
+	return librsu_copy_check(ls->ll_intf, slot);
+}
 
-			last_write += sizeof(buf);
-		}
+int rsu_slot_digest(int slot, int algo, __u8 *out)
+{
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-		offset += sizeof(buf);
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
 	}
 
-	close(df);
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
 
-	return 0;
+	return librsu_digest_slot(ls->ll_intf, slot, algo, out);
 }
 
 int rsu_slot_disable(int slot)
 {
 	int part_num;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	if (ll_intf->priority.remove(part_num))
+	if (ls->ll_intf->priority.remove(part_num))
 		return -ELOWLEVEL;
 
 	return 0;
@@ -650,64 +1971,189 @@ int rsu_slot_disable(int slot)
 int rsu_slot_enable(int slot)
 {
 	int part_num;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	if (ll_intf->priority.remove(part_num))
+	if (ls->ll_intf->priority.remove(part_num))
 		return -ELOWLEVEL;
 
-	if (ll_intf->priority.add(part_num))
+	if (ls->ll_intf->priority.add(part_num))
 		return -ELOWLEVEL;
 
 	return 0;
 }
 
+int rsu_priority_begin(void)
+{
+	int partitions;
+	int priority;
+	int x, y;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	if (ls->staged_parts)
+		return -EARGS;
+
+	partitions = ls->ll_intf->partition.count();
+
+	ls->staged_parts = (int *)malloc(sizeof(int) * (partitions + 1));
+	if (!ls->staged_parts)
+		return -ELIB;
+
+	/* Insert partitions in the CPB sorted by their current priority */
+	ls->staged_count = 0;
+	for (x = 0; x < partitions; x++) {
+		priority = ls->ll_intf->priority.get(x);
+		if (priority <= 0)
+			continue;
+
+		for (y = ls->staged_count; y > 0; y--) {
+			if (ls->ll_intf->priority.get(ls->staged_parts[y - 1]) <
+			    priority)
+				break;
+			ls->staged_parts[y] = ls->staged_parts[y - 1];
+		}
+
+		ls->staged_parts[y] = x;
+		ls->staged_count++;
+	}
+
+	return 0;
+}
+
+int rsu_priority_set(int slot, int priority)
+{
+	int part_num;
+	int x;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (!ls->staged_parts || priority < 0)
+		return -EARGS;
+
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	for (x = 0; x < ls->staged_count; x++) {
+		if (ls->staged_parts[x] == part_num) {
+			memmove(&ls->staged_parts[x], &ls->staged_parts[x + 1],
+				sizeof(int) * (ls->staged_count - x - 1));
+			ls->staged_count--;
+			break;
+		}
+	}
+
+	if (!priority)
+		return 0;
+
+	x = priority - 1;
+	if (x > ls->staged_count)
+		x = ls->staged_count;
+
+	memmove(&ls->staged_parts[x + 1], &ls->staged_parts[x],
+		sizeof(int) * (ls->staged_count - x));
+	ls->staged_parts[x] = part_num;
+	ls->staged_count++;
+
+	return 0;
+}
+
+int rsu_priority_commit(void)
+{
+	int rtn = 0;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (!ls->staged_parts)
+		return -EARGS;
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		rtn = -ECORRUPTED_CPB;
+	} else if (ls->ll_intf->priority.set_order(ls->staged_parts,
+						   ls->staged_count)) {
+		rtn = -ELOWLEVEL;
+	}
+
+	rsu_priority_abort();
+
+	return rtn;
+}
+
+void rsu_priority_abort(void)
+{
+	API_ENTER_VOID();
+
+	free(ls->staged_parts);
+	ls->staged_parts = NULL;
+	ls->staged_count = 0;
+}
+
 int rsu_slot_load_after_reboot(int slot)
 {
 	int part_num;
 	__u64 offset;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	offset = ll_intf->partition.offset(part_num);
+	offset = ls->ll_intf->partition.offset(part_num);
 
 	if (librsu_misc_put_devattr("reboot_image", offset))
 		return -EFILEIO;
@@ -718,31 +2164,25 @@ int rsu_slot_load_after_reboot(int slot)
 int rsu_slot_load_factory_after_reboot(void)
 {
 	int part_num;
-	int partitions;
 	__u64 offset;
 	char name[] = "FACTORY_IMAGE";
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	partitions = ll_intf->partition.count();
-
-	for (part_num = 0; part_num < partitions; part_num++) {
-		if (!strcmp(name, ll_intf->partition.name(part_num)))
-			break;
-	}
-
-	if (part_num >= partitions) {
+	part_num = ls->ll_intf->partition.by_name(name);
+	if (part_num < 0) {
 		librsu_log(MED, __func__, "No FACTORY_IMAGE partition defined");
 		return -EFORMAT;
 	}
 
-	offset = ll_intf->partition.offset(part_num);
+	offset = ls->ll_intf->partition.offset(part_num);
 
 	if (librsu_misc_put_devattr("reboot_image", offset))
 		return -EFILEIO;
@@ -753,19 +2193,20 @@ int rsu_slot_load_factory_after_reboot(void)
 int rsu_slot_rename(int slot, char *name)
 {
 	int part_num;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
 	if (!name)
 		return -EARGS;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
@@ -775,7 +2216,7 @@ int rsu_slot_rename(int slot, char *name)
 		return -ENAME;
 	}
 
-	if (ll_intf->partition.rename(part_num, name))
+	if (ls->ll_intf->partition.rename(part_num, name))
 		return -ENAME;
 
 	return 0;
@@ -790,16 +2231,20 @@ int rsu_slot_rename(int slot, char *name)
 int rsu_slot_delete(int slot)
 {
 	int part_num;
+	API_ENTER();
 
-	if (!ll_intf)
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (push_open())
+		return -ECTXBUSY;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	if (ll_intf->cpb_ops.corrupted()) {
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
@@ -810,17 +2255,17 @@ int rsu_slot_delete(int slot)
 		return -EWRPROT;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
+	part_num = librsu_misc_slot2part(ls->ll_intf, slot);
 	if (part_num < 0)
 		return -ESLOTNUM;
 
-	if (ll_intf->priority.remove(part_num))
+	if (ls->ll_intf->priority.remove(part_num))
 		return -ELOWLEVEL;
 
-	if (ll_intf->data.erase(part_num))
+	if (ls->ll_intf->data.erase(part_num))
 		return -ELOWLEVEL;
 
-	if (ll_intf->partition.delete(part_num))
+	if (ls->ll_intf->partition.delete(part_num))
 		return -ELOWLEVEL;
 
 	return 0;
@@ -836,10 +2281,12 @@ int rsu_slot_delete(int slot)
  */
 int rsu_slot_create(char *name, __u64 address, unsigned int size)
 {
-	if (!ll_intf)
+	API_ENTER();
+
+	if (ll_open())
 		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
@@ -850,7 +2297,7 @@ int rsu_slot_create(char *name, __u64 address, unsigned int size)
 		return -ENAME;
 	}
 
-	if (ll_intf->partition.create(name, address, size))
+	if (ls->ll_intf->partition.create(name, address, size))
 		return -ELOWLEVEL;
 
 	return 0;
@@ -858,7 +2305,9 @@ int rsu_slot_create(char *name, __u64 address, unsigned int size)
 
 int rsu_status_log(struct rsu_status_info *info)
 {
-	if (!ll_intf)
+	API_ENTER();
+
+	if (!ls->lib_initialized)
 		return -ELIB;
 
 	if (!info)
@@ -900,6 +2349,7 @@ int rsu_status_log(struct rsu_status_info *info)
 int rsu_notify(int value)
 {
 	__u64 notify_value;
+	API_ENTER();
 
 	notify_value = value & RSU_NOTIFY_VALUE_MASK;
 
@@ -913,6 +2363,7 @@ int rsu_clear_error_status(void)
 {
 	struct rsu_status_info info;
 	__u64 notify_value;
+	API_ENTER();
 
 	if (rsu_status_log(&info))
 		return -EFILEIO;
@@ -933,6 +2384,7 @@ int rsu_reset_retry_counter(void)
 {
 	struct rsu_status_info info;
 	__u64 notify_value;
+	API_ENTER();
 
 	if (rsu_status_log(&info))
 		return -EFILEIO;
@@ -963,6 +2415,7 @@ int rsu_dcmf_version(__u32 *versions)
 	__u64 version;
 	int i;
 	char dcmf_str[6] = {'d', 'c', 'm', 'f', '0', '\0'};
+	API_ENTER();
 
 	for (i = 0; i < 4; i++) {
 		if (librsu_misc_get_devattr(dcmf_str, &version))
@@ -986,6 +2439,7 @@ int rsu_dcmf_version(__u32 *versions)
 int rsu_max_retry(__u8 *value)
 {
 	__u64 max_retry;
+	API_ENTER();
 
 	if (librsu_misc_get_devattr("max_retry", &max_retry))
 		return -EFILEIO;
@@ -1012,6 +2466,7 @@ int rsu_dcmf_status(int *status)
 	int i;
 	char dcmf_str[13] = {'d', 'c', 'm', 'f', '0', '_', 's', 't', 'a', 't',
 			     'u', 's', '\0'};
+	API_ENTER();
 
 	for (i = 0; i < 4; i++) {
 		if (librsu_misc_get_devattr(dcmf_str, &attr_status))
@@ -1030,19 +2485,236 @@ int rsu_dcmf_status(int *status)
 	return 0;
 }
 
+int rsu_status_snapshot(struct rsu_status_snapshot *snap)
+{
+	int rtn;
+	API_ENTER();
+
+	if (!snap)
+		return -EARGS;
+
+	memset(snap, 0, sizeof(*snap));
+
+	rtn = rsu_status_log(&snap->status);
+	if (rtn)
+		return rtn;
+
+	snap->valid = RSU_SNAPSHOT_STATUS;
+
+	if (!RSU_VERSION_DCMF_VERSION(snap->status.version))
+		return 0;
+
+	if (rsu_dcmf_version(snap->dcmf_version) == 0)
+		snap->valid |= RSU_SNAPSHOT_DCMF_VERSION;
+
+	if (rsu_dcmf_status(snap->dcmf_status) == 0)
+		snap->valid |= RSU_SNAPSHOT_DCMF_STATUS;
+
+	if (rsu_max_retry(&snap->max_retry) == 0)
+		snap->valid |= RSU_SNAPSHOT_MAX_RETRY;
+
+	return 0;
+}
+
+/*
+ * Status watching. The status attributes are added to an epoll set, for
+ * drivers which call sysfs_notify() when they change, along with a timer
+ * which catches changes on drivers which do not. The timer period doubles
+ * each time it expires without a change, up to RSU_WATCH_BACKOFF times the
+ * requested interval, and drops back to the interval on a change.
+ */
+#define RSU_WATCH_BACKOFF	8
+
+static char *watch_attrs[] = {
+	"version",
+	"state",
+	"current_image",
+	"fail_image",
+	"error_location",
+	"error_details",
+	"retry_counter",
+};
+
+static int watch_set_timer(int period_ms)
+{
+	struct itimerspec spec;
+
+	spec.it_interval.tv_sec = period_ms / 1000;
+	spec.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+
+	if (timerfd_settime(ls->watch_timerfd, 0, &spec, NULL))
+		return -1;
+
+	ls->watch_period = period_ms;
+	return 0;
+}
+
+static __u32 watch_changes(struct rsu_status_info *old,
+			   struct rsu_status_info *new)
+{
+	__u32 changes = 0;
+
+	if (old->version != new->version)
+		changes |= RSU_WATCH_VERSION;
+	if (old->state != new->state)
+		changes |= RSU_WATCH_STATE;
+	if (old->current_image != new->current_image)
+		changes |= RSU_WATCH_CURRENT_IMAGE;
+	if (old->fail_image != new->fail_image)
+		changes |= RSU_WATCH_FAIL_IMAGE;
+	if (old->error_location != new->error_location)
+		changes |= RSU_WATCH_ERROR_LOCATION;
+	if (old->error_details != new->error_details)
+		changes |= RSU_WATCH_ERROR_DETAILS;
+	if (old->retry_counter != new->retry_counter)
+		changes |= RSU_WATCH_RETRY_COUNTER;
+
+	return changes;
+}
+
+int rsu_status_watch(int interval_ms)
+{
+	struct epoll_event ev;
+	unsigned int x;
+	int fd;
+	int rtn;
+	API_ENTER();
+
+	if (!ls->lib_initialized || ls->watch_epfd >= 0)
+		return -ELIB;
+
+	if (interval_ms <= 0)
+		return -EARGS;
+
+	rtn = rsu_status_log(&ls->watch_last);
+	if (rtn)
+		return rtn;
+
+	ls->watch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	ls->watch_timerfd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	ls->watch_interval = interval_ms;
+
+	if (ls->watch_epfd < 0 || ls->watch_timerfd < 0 ||
+	    watch_set_timer(interval_ms)) {
+		rsu_status_watch_close();
+		return -EFILEIO;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = ls->watch_timerfd;
+	if (epoll_ctl(ls->watch_epfd, EPOLL_CTL_ADD, ls->watch_timerfd, &ev)) {
+		rsu_status_watch_close();
+		return -EFILEIO;
+	}
+
+	/* attributes which cannot be polled are covered by the timer */
+	for (x = 0; x < sizeof(watch_attrs) / sizeof(watch_attrs[0]); x++) {
+		fd = librsu_misc_devattr_fd(watch_attrs[x]);
+		if (fd < 0)
+			continue;
+
+		ev.events = EPOLLPRI;
+		ev.data.fd = fd;
+		if (epoll_ctl(ls->watch_epfd, EPOLL_CTL_ADD, fd, &ev))
+			librsu_log(HIGH, __func__, "%s cannot be polled",
+				   watch_attrs[x]);
+	}
+
+	return ls->watch_epfd;
+}
+
+int rsu_status_watch_read(struct rsu_status_info *info, __u32 *changes)
+{
+	struct epoll_event ev[8];
+	__u64 expirations;
+	char buf[64];
+	int expired = 0;
+	int cnt;
+	int x;
+	int rtn;
+	API_ENTER();
+
+	if (ls->watch_epfd < 0)
+		return -ELIB;
+
+	if (!info || !changes)
+		return -EARGS;
+
+	cnt = epoll_wait(ls->watch_epfd, ev, sizeof(ev) / sizeof(ev[0]), 0);
+	for (x = 0; x < cnt; x++) {
+		if (ev[x].data.fd == ls->watch_timerfd) {
+			if (read(ls->watch_timerfd, &expirations,
+				 sizeof(expirations)) > 0)
+				expired = 1;
+			continue;
+		}
+
+		/*
+		 * Reading a notified attribute re-arms its notification. This
+		 * is done here as rsu_status_log() does not read them all,
+		 * and an attribute which cannot be read is no longer polled,
+		 * so that the epoll fd does not stay readable.
+		 */
+		if (pread(ev[x].data.fd, buf, sizeof(buf), 0) < 0)
+			epoll_ctl(ls->watch_epfd, EPOLL_CTL_DEL,
+				  ev[x].data.fd, NULL);
+	}
+
+	rtn = rsu_status_log(info);
+	if (rtn)
+		return rtn;
+
+	*changes = watch_changes(&ls->watch_last, info);
+	ls->watch_last = *info;
+
+	if (*changes && ls->watch_period != ls->watch_interval)
+		rtn = watch_set_timer(ls->watch_interval);
+	else if (!*changes && expired &&
+		 ls->watch_period < ls->watch_interval * RSU_WATCH_BACKOFF)
+		rtn = watch_set_timer(ls->watch_period * 2);
+
+	return rtn ? -EFILEIO : 0;
+}
+
+void rsu_status_watch_close(void)
+{
+	API_ENTER_VOID();
+
+	if (ls->watch_epfd >= 0)
+		close(ls->watch_epfd);
+
+	if (ls->watch_timerfd >= 0)
+		close(ls->watch_timerfd);
+
+	ls->watch_epfd = -1;
+	ls->watch_timerfd = -1;
+}
+
 int rsu_restore_spt(char *filename)
 {
-	return ll_intf->spt_ops.restore(filename);
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return ls->ll_intf->spt_ops.restore(filename);
 }
 
 int rsu_save_spt(char *filename)
 {
-	if (ll_intf->spt_ops.corrupted()) {
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	return ll_intf->spt_ops.save(filename);
+	return ls->ll_intf->spt_ops.save(filename);
 }
 
 /**
@@ -1054,7 +2726,37 @@ int rsu_save_spt(char *filename)
  */
 int rsu_create_empty_cpb(void)
 {
-	return ll_intf->cpb_ops.empty();
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return ls->ll_intf->cpb_ops.empty();
+}
+
+int rsu_cpb_compact(void)
+{
+	int threshold;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->spt_ops.corrupted()) {
+		rsu_spt_corrupted_info();
+		return -ECORRUPTED_SPT;
+	}
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
+		rsu_cpb_corrupted_info();
+		return -ECORRUPTED_CPB;
+	}
+
+	threshold = librsu_cfg_cpb_compact_threshold();
+	if (ls->ll_intf->cpb_ops.compact(threshold ? threshold : 1))
+		return -ELOWLEVEL;
+
+	return 0;
 }
 
 /**
@@ -1067,7 +2769,12 @@ int rsu_create_empty_cpb(void)
  */
 int rsu_restore_cpb(char *filename)
 {
-	return ll_intf->cpb_ops.restore(filename);
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	return ls->ll_intf->cpb_ops.restore(filename);
 }
 
 /**
@@ -1080,12 +2787,17 @@ int rsu_restore_cpb(char *filename)
  */
 int rsu_save_cpb(char *filename)
 {
-	if (ll_intf->cpb_ops.corrupted()) {
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
+
+	if (ls->ll_intf->cpb_ops.corrupted()) {
 		rsu_cpb_corrupted_info();
 		return -ECORRUPTED_CPB;
 	}
 
-	return ll_intf->cpb_ops.save(filename);
+	return ls->ll_intf->cpb_ops.save(filename);
 }
 
 /**
@@ -1098,13 +2810,17 @@ int rsu_running_factory(int *factory)
 {
 	__s64 factory_offset;
 	__u64 current_image;
+	API_ENTER();
+
+	if (ll_open())
+		return -ELIB;
 
-	if (ll_intf->spt_ops.corrupted()) {
+	if (ls->ll_intf->spt_ops.corrupted()) {
 		rsu_spt_corrupted_info();
 		return -ECORRUPTED_SPT;
 	}
 
-	factory_offset = ll_intf->partition.factory_offset();
+	factory_offset = ls->ll_intf->partition.factory_offset();
 	if (factory_offset < 0)
 		return -ELOWLEVEL;
 
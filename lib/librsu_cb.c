@@ -2,16 +2,27 @@
 
 /* Intel Copyright 2018 */
 
+#include <errno.h>
 #include <fcntl.h>
 #include "librsu_cb.h"
 #include "librsu_cfg.h"
+#include "librsu_digest.h"
 #include "librsu_image.h"
 #include "librsu_ll.h"
 #include "librsu_misc.h"
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
-static int cb_datafile = -1;
+/*
+ * The data source of the operation in progress, kept per thread so that
+ * threads using different library contexts can program at the same time.
+ */
+static _Thread_local int cb_datafile = -1;
+static _Thread_local off_t cb_datafile_start;
 
 int librsu_cb_file_init(char *filename)
 {
@@ -26,6 +37,38 @@ int librsu_cb_file_init(char *filename)
 	if (cb_datafile < 0)
 		return -1;
 
+	cb_datafile_start = 0;
+	posix_fadvise(cb_datafile, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+}
+
+/*
+ * The data is read from the current offset of the caller's file descriptor,
+ * through a duplicate so that cleaning up does not close the caller's one.
+ * Pipes and sockets can not be rewound, so they are streamed without the
+ * image being checked first.
+ */
+int librsu_cb_fd_init(int fd)
+{
+	if (cb_datafile >= 0)
+		close(cb_datafile);
+
+	cb_datafile = -1;
+
+	if (fd < 0)
+		return -1;
+
+	cb_datafile = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+	if (cb_datafile < 0)
+		return -1;
+
+	cb_datafile_start = lseek(cb_datafile, 0, SEEK_CUR);
+	if (cb_datafile_start >= 0)
+		posix_fadvise(cb_datafile, cb_datafile_start, 0,
+			      POSIX_FADV_SEQUENTIAL);
+
 	return 0;
 }
 
@@ -39,14 +82,22 @@ void librsu_cb_file_cleanup(void)
 
 int librsu_cb_file(void *buf, int len)
 {
+	int rtn;
+
 	if (cb_datafile < 0)
 		return -1;
 
-	return read(cb_datafile, buf, len);
+	do {
+		rtn = read(cb_datafile, buf, len);
+	} while (rtn < 0 && errno == EINTR);
+
+	return rtn;
 }
 
-static char *cb_buffer;
-static int cb_buffer_togo;
+static _Thread_local char *cb_buffer;
+static _Thread_local int cb_buffer_togo;
+static _Thread_local char *cb_buffer_start;
+static _Thread_local int cb_buffer_size;
 
 int librsu_cb_buf_init(void *buf, int size)
 {
@@ -55,6 +106,8 @@ int librsu_cb_buf_init(void *buf, int size)
 
 	cb_buffer = (char *)buf;
 	cb_buffer_togo = size;
+	cb_buffer_start = cb_buffer;
+	cb_buffer_size = size;
 
 	return 0;
 }
@@ -63,6 +116,8 @@ void librsu_cb_buf_cleanup(void)
 {
 	cb_buffer = NULL;
 	cb_buffer_togo = -1;
+	cb_buffer_start = NULL;
+	cb_buffer_size = 0;
 }
 
 int librsu_cb_buf(void *buf, int len)
@@ -91,51 +146,173 @@ int librsu_cb_buf(void *buf, int len)
 	return read_len;
 }
 
-int librsu_cb_program_common(struct librsu_ll_intf *ll_intf, int slot,
-			     rsu_data_callback callback, int rawdata)
+static _Thread_local const struct iovec *cb_iov;
+static _Thread_local int cb_iov_cnt;
+static _Thread_local int cb_iov_index;
+static _Thread_local size_t cb_iov_offset;
+
+int librsu_cb_iov_init(const struct iovec *iov, int iovcnt)
 {
-	int part_num;
-	int offset;
-	unsigned char buf[IMAGE_BLOCK_SZ];
-	unsigned char vbuf[IMAGE_BLOCK_SZ];
-	int cnt, c, done;
 	int x;
-	struct rsu_slot_info info;
-	struct rsu_image_state state;
 
-	if (!ll_intf)
-		return -ELIB;
+	if (!iov || iovcnt <= 0)
+		return -1;
 
-	if (librsu_cfg_writeprotected(slot)) {
-		librsu_log(HIGH, __func__,
-			   "Trying to program a write protected slot");
-		return -EWRPROT;
+	for (x = 0; x < iovcnt; x++)
+		if (!iov[x].iov_base && iov[x].iov_len)
+			return -1;
+
+	cb_iov = iov;
+	cb_iov_cnt = iovcnt;
+	cb_iov_index = 0;
+	cb_iov_offset = 0;
+
+	return 0;
+}
+
+void librsu_cb_iov_cleanup(void)
+{
+	cb_iov = NULL;
+	cb_iov_cnt = 0;
+	cb_iov_index = 0;
+	cb_iov_offset = 0;
+}
+
+/*
+ * Copies straight from the caller buffers into the image block being
+ * assembled, moving on to the next buffer when one is used up.
+ */
+int librsu_cb_iov(void *buf, int len)
+{
+	char *out = buf;
+	size_t cnt;
+	int done = 0;
+
+	if (!cb_iov || !buf || len < 0)
+		return -1;
+
+	while (done < len && cb_iov_index < cb_iov_cnt) {
+		cnt = cb_iov[cb_iov_index].iov_len - cb_iov_offset;
+		if (cnt > (size_t)(len - done))
+			cnt = len - done;
+
+		memcpy(out + done,
+		       (char *)cb_iov[cb_iov_index].iov_base + cb_iov_offset,
+		       cnt);
+		done += cnt;
+		cb_iov_offset += cnt;
+
+		if (cb_iov_offset == cb_iov[cb_iov_index].iov_len) {
+			cb_iov_index++;
+			cb_iov_offset = 0;
+		}
 	}
 
-	if (rsu_slot_get_info(slot, &info)) {
-		librsu_log(HIGH, __func__, "Unable to read slot info");
-		return -ESLOTNUM;
+	return done;
+}
+
+/**
+ * cb_rewind() - restart a data source from the beginning
+ * @callback: data source
+ *
+ * Only the file and buffer sources provided by the library can be restarted,
+ * and only if the file is seekable.
+ *
+ * Return: zero value if the source was restarted, or negative value otherwise
+ */
+static int cb_rewind(rsu_data_callback callback)
+{
+	if (callback == librsu_cb_file) {
+		if (cb_datafile < 0 || cb_datafile_start < 0 ||
+		    lseek(cb_datafile, cb_datafile_start, SEEK_SET) !=
+		    cb_datafile_start)
+			return -1;
+		return 0;
 	}
 
-	part_num = librsu_misc_slot2part(ll_intf, slot);
-	if (part_num < 0)
-		return -ESLOTNUM;
+	if (callback == librsu_cb_buf) {
+		if (!cb_buffer_start)
+			return -1;
+		cb_buffer = cb_buffer_start;
+		cb_buffer_togo = cb_buffer_size;
+		return 0;
+	}
 
-	if (ll_intf->priority.get(part_num) > 0) {
-		librsu_log(HIGH, __func__,
-			   "Trying to program a slot already in use");
-		return -EPROGRAM;
+	if (callback == librsu_cb_iov) {
+		if (!cb_iov)
+			return -1;
+		cb_iov_index = 0;
+		cb_iov_offset = 0;
+		return 0;
 	}
 
-	if (!callback)
-		return -EARGS;
+	return -1;
+}
 
-	offset = 0;
-	done = 0;
+/**
+ * cb_size() - get the size of a data source
+ * @callback: data source
+ *
+ * Return: size of the file or buffer sources provided by the library, or 0
+ * if not known
+ */
+static __u64 cb_size(rsu_data_callback callback)
+{
+	struct stat st;
+	__u64 size = 0;
+	int x;
+
+	if (callback == librsu_cb_file) {
+		if (cb_datafile < 0 || fstat(cb_datafile, &st) ||
+		    !S_ISREG(st.st_mode) || cb_datafile_start < 0 ||
+		    st.st_size < cb_datafile_start)
+			return 0;
+		return st.st_size - cb_datafile_start;
+	}
+
+	if (callback == librsu_cb_buf)
+		return cb_buffer_size;
+
+	if (callback == librsu_cb_iov) {
+		for (x = 0; x < cb_iov_cnt; x++)
+			size += cb_iov[x].iov_len;
+		return size;
+	}
+
+	return 0;
+}
+
+/**
+ * prescan() - validate a whole image before any of it is written to flash
+ * @ll_intf: low level interface
+ * @part_num: partition the image is going to be written to
+ * @callback: data source, already restarted
+ * @info: slot the image is going to be written to
+ * @rawdata: image is raw data, so only its size is checked
+ * @sha: if not NULL, set to the SHA-256 digest of the input data
+ * @size: if not NULL, set to the size of the input data
+ *
+ * The image is processed exactly as for programming, with the adjusted
+ * blocks discarded, so that an image which does not fit the slot or has a
+ * bad signature block is rejected while the slot is still untouched.
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int prescan(struct librsu_ll_intf *ll_intf, int part_num,
+		   rsu_data_callback callback, struct rsu_slot_info *info,
+		   int rawdata, __u8 *sha, int *size)
+{
+	struct librsu_sha256 sha_state;
+	unsigned char buf[IMAGE_BLOCK_SZ];
+	struct rsu_image_state state;
+	int offset = 0;
+	int cnt, c, done = 0;
 
 	if (librsu_image_block_init(&state))
 		return -ELIB;
 
+	librsu_sha256_init(&sha_state);
+
 	while (!done) {
 		cnt = 0;
 		while (cnt < IMAGE_BLOCK_SZ) {
@@ -153,10 +330,16 @@ int librsu_cb_program_common(struct librsu_ll_intf *ll_intf, int slot,
 		if (cnt == 0)
 			break;
 
+		if (sha)
+			librsu_sha256_update(&sha_state, buf, cnt);
+
 		if (!rawdata)
 			if (librsu_image_block_process(&state, buf, NULL,
-				&info))
+				info)) {
+				librsu_log(HIGH, __func__,
+					   "Bad image block @0x%08x", offset);
 				return -EPROGRAM;
+			}
 
 		if ((offset + cnt) > ll_intf->partition.size(part_num)) {
 			librsu_log(HIGH, __func__,
@@ -164,37 +347,506 @@ int librsu_cb_program_common(struct librsu_ll_intf *ll_intf, int slot,
 			return -ESIZE;
 		}
 
-		if (ll_intf->data.write(part_num, offset, cnt, buf))
-			return -ELOWLEVEL;
+		offset += cnt;
+	}
 
-		if (ll_intf->data.read(part_num, offset, cnt, vbuf))
-			return -ELOWLEVEL;
+	if (sha)
+		librsu_sha256_final(&sha_state, sha);
 
-		for (x = 0; x < cnt; x++)
-			if (vbuf[x] != buf[x]) {
-				librsu_log(HIGH, __func__,
-					   "Expect %02X, got %02X @ 0x%08X",
-					   buf[x], vbuf[x], offset + x);
-				return -ECMP;
-			}
+	if (size)
+		*size = offset;
 
-		offset += cnt;
+	return 0;
+}
+
+/*
+ * Programming journal, recording how far the programming of an image file
+ * got, so that it can be resumed after an interruption. The offset is only
+ * recorded at journal block boundaries, which are also erase block
+ * boundaries, so that the rest of the slot can be erased again on resume.
+ */
+#define JOURNAL_MAGIC		0x4a555352
+#define JOURNAL_BLOCK_SZ	(64 * 1024)
+
+/**
+ * struct program_journal - programming journal file contents
+ * @magic: JOURNAL_MAGIC
+ * @crc: CRC32 of the fields after this one
+ * @slot_offset: flash offset of the slot being programmed
+ * @rawdata: image is programmed as raw data
+ * @size: size of the image file
+ * @offset: bytes programmed and verified, from the start of the image
+ * @sha256: SHA-256 digest of the image file
+ */
+struct program_journal {
+	__u32 magic;
+	__u32 crc;
+	__u64 slot_offset;
+	__u32 rawdata;
+	__u32 size;
+	__u32 offset;
+	__u8 sha256[RSU_DIGEST_SHA256_SZ];
+};
+
+static __u32 journal_crc(struct program_journal *jr)
+{
+	return crc32(0, (unsigned char *)&jr->slot_offset,
+		     sizeof(*jr) - offsetof(struct program_journal,
+					    slot_offset));
+}
+
+static int journal_read(char *path, struct program_journal *jr)
+{
+	int fd;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, jr, sizeof(*jr));
+	close(fd);
+
+	if (len != sizeof(*jr) || jr->magic != JOURNAL_MAGIC ||
+	    jr->crc != journal_crc(jr))
+		return -1;
+
+	return 0;
+}
+
+static int journal_write(char *path, struct program_journal *jr)
+{
+	int fd;
+	int rtn = 0;
+
+	jr->magic = JOURNAL_MAGIC;
+	jr->crc = journal_crc(jr);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		librsu_log(LOW, __func__,
+			   "error: Unable to open journal '%s' (errno=%i)",
+			   path, errno);
+		return -1;
+	}
+
+	if (pwrite(fd, jr, sizeof(*jr), 0) != sizeof(*jr) || fdatasync(fd)) {
+		librsu_log(LOW, __func__,
+			   "error: Unable to write journal '%s'", path);
+		rtn = -1;
+	}
+
+	close(fd);
+
+	return rtn;
+}
+
+/**
+ * journal_block() - get the granularity of the journal offsets
+ * @ll_intf: low level interface
+ *
+ * Return: JOURNAL_BLOCK_SZ, rounded up to the largest flash erase block
+ */
+static int journal_block(struct librsu_ll_intf *ll_intf)
+{
+	__u32 block = JOURNAL_BLOCK_SZ;
+	int x;
+
+	for (x = 0; x < ll_intf->flash_list.flash_count; x++)
+		if (ll_intf->flash_list.dev_info[x].erasesize > block)
+			block = ll_intf->flash_list.dev_info[x].erasesize;
+
+	return block;
+}
+
+/**
+ * journal_setup() - start or check the journal for programming an image
+ * @ll_intf: low level interface
+ * @part_num: partition the image is programmed to
+ * @jr: journal; on resume, as read from the journal file
+ * @sha: SHA-256 digest of the image file
+ * @size: size of the image file
+ * @resume: resume the programming recorded in @jr
+ *
+ * On resume, the journal must match the slot and image, and the part of the
+ * slot which was not recorded as programmed is erased again.
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int journal_setup(struct librsu_ll_intf *ll_intf, int part_num,
+			 struct program_journal *jr, __u8 *sha, int size,
+			 int resume)
+{
+	char *path = librsu_cfg_get_program_journal();
+	int block;
+	int end;
+
+	if (!resume) {
+		jr->slot_offset = ll_intf->partition.offset(part_num);
+		jr->size = size;
+		jr->offset = 0;
+		memcpy(jr->sha256, sha, sizeof(jr->sha256));
+
+		return journal_write(path, jr) ? -EFILEIO : 0;
 	}
 
-	if (!rawdata && ll_intf->priority.add(part_num))
+	if (jr->slot_offset != (__u64)ll_intf->partition.offset(part_num) ||
+	    jr->size != (__u32)size ||
+	    memcmp(jr->sha256, sha, sizeof(jr->sha256))) {
+		librsu_log(HIGH, __func__,
+			   "Journal is for another slot or image");
+		return -EARGS;
+	}
+
+	block = journal_block(ll_intf);
+	end = (size + block - 1) / block * block;
+	if (end > ll_intf->partition.size(part_num))
+		end = ll_intf->partition.size(part_num);
+
+	if (jr->offset % block || (int)jr->offset > end)
+		return -EARGS;
+
+	librsu_log(HIGH, __func__, "Resuming at 0x%08x", jr->offset);
+
+	if (ll_intf->data.erase_range(part_num, jr->offset, end - jr->offset))
 		return -ELOWLEVEL;
 
 	return 0;
 }
 
-int librsu_cb_verify_common(struct librsu_ll_intf *ll_intf, int slot,
-			    rsu_data_callback callback, int rawdata)
+/**
+ * struct cb_source - data source of a program or verify operation
+ * @callback: source copying the data into library buffers, or NULL
+ * @borrow: source lending caller buffers, used when @callback is NULL
+ * @data: part of the buffer lent by @borrow not used yet
+ * @len: bytes at @data
+ * @done: end of the data was reached
+ */
+struct cb_source {
+	rsu_data_callback callback;
+	rsu_borrow_callback borrow;
+	char *data;
+	int len;
+	int done;
+};
+
+/**
+ * source_block() - get the next image block from a data source
+ * @src: data source
+ * @buf: buffer the block is assembled in
+ * @block: set to the block, either @buf or a whole block lent by the source
+ *
+ * Lent blocks are only valid until the next call, and must not be modified.
+ *
+ * Return: size of the block, only the last one may be shorter than
+ * IMAGE_BLOCK_SZ, 0 at the end of the data, or Error Code
+ */
+static int source_block(struct cb_source *src, unsigned char *buf,
+			unsigned char **block)
+{
+	int cnt = 0;
+	int c;
+
+	*block = buf;
+
+	while (cnt < IMAGE_BLOCK_SZ && !src->done) {
+		if (src->callback) {
+			c = src->callback(buf + cnt, IMAGE_BLOCK_SZ - cnt);
+			if (c < 0)
+				return -ECALLBACK;
+
+			src->done = c == 0;
+			cnt += c;
+			continue;
+		}
+
+		if (!src->len) {
+			c = src->borrow((void **)&src->data);
+			if (c < 0 || (c && !src->data))
+				return -ECALLBACK;
+
+			src->done = c == 0;
+			src->len = c;
+			continue;
+		}
+
+		if (!cnt && src->len >= IMAGE_BLOCK_SZ) {
+			*block = (unsigned char *)src->data;
+			src->data += IMAGE_BLOCK_SZ;
+			src->len -= IMAGE_BLOCK_SZ;
+			return IMAGE_BLOCK_SZ;
+		}
+
+		c = IMAGE_BLOCK_SZ - cnt;
+		if (c > src->len)
+			c = src->len;
+
+		memcpy(buf + cnt, src->data, c);
+		src->data += c;
+		src->len -= c;
+		cnt += c;
+	}
+
+	return cnt;
+}
+
+/**
+ * source_writable() - make an image block safe to process
+ * @state: image processing state
+ * @rawdata: image is raw data
+ * @buf: library buffer
+ * @block: block from source_block()
+ * @cnt: size of the block
+ *
+ * Blocks lent by the caller are copied to the library buffer only when the
+ * image processing is going to modify them, that is for signature blocks.
+ *
+ * Return: block to process
+ */
+static unsigned char *source_writable(struct rsu_image_state *state,
+				      int rawdata, unsigned char *buf,
+				      unsigned char *block, int cnt)
+{
+	if (block == buf || rawdata ||
+	    !librsu_image_next_block_modified(state))
+		return block;
+
+	memcpy(buf, block, cnt);
+
+	return buf;
+}
+
+/**
+ * program_start() - set up the programming of a slot
+ * @prog: programming state
+ * @ll_intf: low level interface
+ * @slot: slot number
+ * @rawdata: image is raw data
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int program_start(struct rsu_program *prog,
+			 struct librsu_ll_intf *ll_intf, int slot, int rawdata)
+{
+	if (!ll_intf)
+		return -ELIB;
+
+	if (librsu_cfg_writeprotected(slot)) {
+		librsu_log(HIGH, __func__,
+			   "Trying to program a write protected slot");
+		return -EWRPROT;
+	}
+
+	if (rsu_slot_get_info(slot, &prog->info)) {
+		librsu_log(HIGH, __func__, "Unable to read slot info");
+		return -ESLOTNUM;
+	}
+
+	prog->part_num = librsu_misc_slot2part(ll_intf, slot);
+	if (prog->part_num < 0)
+		return -ESLOTNUM;
+
+	if (ll_intf->priority.get(prog->part_num) > 0) {
+		librsu_log(HIGH, __func__,
+			   "Trying to program a slot already in use");
+		return -EPROGRAM;
+	}
+
+	prog->ll_intf = ll_intf;
+	prog->rawdata = rawdata;
+	prog->offset = 0;
+	prog->skip = 0;
+	prog->fill = 0;
+	prog->error = 0;
+
+	if (librsu_image_block_init(&prog->state))
+		return -ELIB;
+
+	/* Record the digest of the image as it is programmed */
+	prog->digesting = !rawdata && librsu_cfg_get_digest_cache() &&
+			  !librsu_digest_init(&prog->digest, &prog->info);
+
+	return 0;
+}
+
+/**
+ * program_block() - program the next image block
+ * @prog: programming state
+ * @buf: image block, adjusted in place for the slot
+ * @cnt: size of the block, only the last one may be shorter than
+ *       IMAGE_BLOCK_SZ
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int program_block(struct rsu_program *prog, unsigned char *buf,
+			 int cnt)
+{
+	struct librsu_ll_intf *ll_intf = prog->ll_intf;
+	unsigned char vbuf[IMAGE_BLOCK_SZ];
+	int x;
+
+	if (!prog->rawdata)
+		if (librsu_image_block_process(&prog->state, buf, NULL,
+					       &prog->info))
+			return -EPROGRAM;
+
+	if ((prog->offset + cnt) > ll_intf->partition.size(prog->part_num)) {
+		librsu_log(HIGH, __func__,
+			   "Trying to program too much data into slot");
+		return -ESIZE;
+	}
+
+	/* Blocks already programmed before a resume are only checked */
+	if (prog->offset >= prog->skip &&
+	    ll_intf->data.write(prog->part_num, prog->offset, cnt, buf))
+		return -ELOWLEVEL;
+
+	if (ll_intf->data.read(prog->part_num, prog->offset, cnt, vbuf))
+		return -ELOWLEVEL;
+
+	for (x = 0; x < cnt; x++)
+		if (vbuf[x] != buf[x]) {
+			librsu_log(HIGH, __func__,
+				   "Expect %02X, got %02X @ 0x%08X",
+				   buf[x], vbuf[x], prog->offset + x);
+			return -ECMP;
+		}
+
+	if (prog->digesting &&
+	    librsu_digest_block(&prog->digest, buf, cnt))
+		prog->digesting = 0;
+
+	prog->offset += cnt;
+	librsu_misc_progress(prog->offset);
+
+	return 0;
+}
+
+/**
+ * program_finish() - complete the programming of a slot
+ * @prog: programming state, after all the image blocks were programmed
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int program_finish(struct rsu_program *prog)
+{
+	if (!prog->rawdata && prog->ll_intf->priority.add(prog->part_num))
+		return -ELOWLEVEL;
+
+	if (prog->digesting)
+		librsu_digest_store(&prog->digest);
+
+	return 0;
+}
+
+/**
+ * program_common() - program an image into a slot
+ * @ll_intf: low level interface
+ * @slot: slot number
+ * @src: data source
+ * @rawdata: image is raw data
+ * @jr: programming journal, or NULL if none is kept
+ * @resume: resume the programming recorded in @jr
+ *
+ * When resuming, the part of the image already programmed is checked
+ * against the slot contents instead of being written again.
+ *
+ * Return: zero value for success, or Error Code
+ */
+static int program_common(struct librsu_ll_intf *ll_intf, int slot,
+			  struct cb_source *src, int rawdata,
+			  struct program_journal *jr, int resume)
+{
+	struct rsu_program prog;
+	unsigned char buf[IMAGE_BLOCK_SZ];
+	unsigned char *block;
+	__u8 sha[RSU_DIGEST_SHA256_SZ];
+	int cnt;
+	int rtn;
+	int size = 0;
+	int jr_block = 0;
+
+	rtn = program_start(&prog, ll_intf, slot, rawdata);
+	if (rtn)
+		return rtn;
+
+	if (!src->callback && !src->borrow)
+		return -EARGS;
+
+	/*
+	 * Validate the whole image first when the data source can be read
+	 * twice, so a bad image never leaves a partially programmed slot.
+	 */
+	if (!cb_rewind(src->callback)) {
+		rtn = prescan(ll_intf, prog.part_num, src->callback,
+			      &prog.info, rawdata, sha, &size);
+		if (rtn)
+			return rtn;
+
+		if (cb_rewind(src->callback))
+			return -ECALLBACK;
+	} else if (resume) {
+		return -ECALLBACK;
+	} else {
+		jr = NULL;
+	}
+
+	if (jr) {
+		rtn = journal_setup(ll_intf, prog.part_num, jr, sha, size,
+				    resume);
+		if (rtn)
+			return rtn;
+
+		jr_block = journal_block(ll_intf);
+		prog.skip = jr->offset;
+	}
+
+	for (;;) {
+		if (librsu_misc_cancelled()) {
+			librsu_log(HIGH, __func__, "Cancelled @ 0x%08x",
+				   prog.offset);
+			return -ECANCEL;
+		}
+
+		cnt = source_block(src, buf, &block);
+		if (cnt < 0)
+			return cnt;
+
+		if (cnt == 0)
+			break;
+
+		block = source_writable(&prog.state, rawdata, buf, block, cnt);
+
+		rtn = program_block(&prog, block, cnt);
+		if (rtn)
+			return rtn;
+
+		if (jr && prog.offset > prog.skip && prog.offset % jr_block == 0) {
+			jr->offset = prog.offset;
+			if (journal_write(librsu_cfg_get_program_journal(), jr))
+				return -EFILEIO;
+		}
+	}
+
+	rtn = program_finish(&prog);
+	if (rtn)
+		return rtn;
+
+	if (jr)
+		unlink(librsu_cfg_get_program_journal());
+
+	return 0;
+}
+
+static int verify_common(struct librsu_ll_intf *ll_intf, int slot,
+			 struct cb_source *src, int rawdata)
 {
 	int part_num;
 	int offset;
 	unsigned char buf[IMAGE_BLOCK_SZ];
 	unsigned char vbuf[IMAGE_BLOCK_SZ];
-	int cnt, c, done;
+	unsigned char *block;
+	int cnt;
 	int x;
 	struct rsu_slot_info info;
 	struct rsu_image_state state;
@@ -217,28 +869,21 @@ int librsu_cb_verify_common(struct librsu_ll_intf *ll_intf, int slot,
 		return -EERASE;
 	}
 
-	if (!callback)
+	if (!src->callback && !src->borrow)
 		return -EARGS;
 
 	offset = 0;
-	done = 0;
 
 	if (librsu_image_block_init(&state))
 		return -ELIB;
 
-	while (!done) {
-		cnt = 0;
-		while (cnt < IMAGE_BLOCK_SZ) {
-			c = callback(buf + cnt, IMAGE_BLOCK_SZ - cnt);
-			if (c == 0) {
-				done = 1;
-				break;
-			} else if (c < 0) {
-				return -ECALLBACK;
-			}
+	for (;;) {
+		if (librsu_misc_cancelled())
+			return -ECANCEL;
 
-			cnt += c;
-		}
+		cnt = source_block(src, buf, &block);
+		if (cnt < 0)
+			return cnt;
 
 		if (cnt == 0)
 			break;
@@ -246,24 +891,217 @@ int librsu_cb_verify_common(struct librsu_ll_intf *ll_intf, int slot,
 		if (ll_intf->data.read(part_num, offset, cnt, vbuf))
 			return -ELOWLEVEL;
 
+		/*
+		 * Image blocks are compared whole, so the end of a short last
+		 * block, which is always in the library buffer, is made equal.
+		 */
+		if (cnt < IMAGE_BLOCK_SZ) {
+			memset(buf + cnt, 0xff, IMAGE_BLOCK_SZ - cnt);
+			memset(vbuf + cnt, 0xff, IMAGE_BLOCK_SZ - cnt);
+		}
+
 		if (!rawdata) {
-			if (librsu_image_block_process(&state, buf, vbuf,
+			block = source_writable(&state, rawdata, buf, block,
+						cnt);
+			if (librsu_image_block_process(&state, block, vbuf,
 			    &info))
 				return -ECMP;
 			offset += cnt;
+			librsu_misc_progress(offset);
 			continue;
 		}
 
 		for (x = 0; x < cnt; x++)
-			if (vbuf[x] != buf[x]) {
+			if (vbuf[x] != block[x]) {
 				librsu_log(HIGH, __func__,
 					   "Expect %02X, got %02X @ 0x%08X",
-					   buf[x], vbuf[x], offset + x);
+					   block[x], vbuf[x], offset + x);
 				return -ECMP;
 			}
 
 		offset += cnt;
+		librsu_misc_progress(offset);
+	}
+
+	return 0;
+}
+
+int librsu_cb_program_common(struct librsu_ll_intf *ll_intf, int slot,
+			     rsu_data_callback callback, int rawdata)
+{
+	struct cb_source src = { .callback = callback };
+	struct program_journal jr;
+	int journal;
+	int rtn;
+
+	memset(&jr, 0, sizeof(jr));
+	jr.rawdata = rawdata;
+
+	/* Only the programming of image files can be resumed */
+	journal = callback == librsu_cb_file &&
+		  librsu_cfg_get_program_journal();
+
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_PROGRAM, cb_size(callback));
+	rtn = program_common(ll_intf, slot, &src, rawdata,
+			     journal ? &jr : NULL, 0);
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+
+	return rtn;
+}
+
+int librsu_cb_program_resume(struct librsu_ll_intf *ll_intf, int slot,
+			     rsu_data_callback callback)
+{
+	struct cb_source src = { .callback = callback };
+	struct program_journal jr;
+	char *path;
+	int rtn;
+
+	path = librsu_cfg_get_program_journal();
+	if (!path) {
+		librsu_log(HIGH, __func__, "No program-journal configured");
+		return -ECFG;
+	}
+
+	if (journal_read(path, &jr)) {
+		librsu_log(HIGH, __func__, "No valid journal in '%s'", path);
+		return -EFILEIO;
+	}
+
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_PROGRAM, cb_size(callback));
+	rtn = program_common(ll_intf, slot, &src, jr.rawdata, &jr, 1);
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+
+	return rtn;
+}
+
+int librsu_cb_verify_common(struct librsu_ll_intf *ll_intf, int slot,
+			    rsu_data_callback callback, int rawdata)
+{
+	struct cb_source src = { .callback = callback };
+	int rtn;
+
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_VERIFY, cb_size(callback));
+	rtn = verify_common(ll_intf, slot, &src, rawdata);
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+
+	return rtn;
+}
+
+int librsu_cb_program_borrowed(struct librsu_ll_intf *ll_intf, int slot,
+			       rsu_borrow_callback callback, int rawdata)
+{
+	struct cb_source src = { .borrow = callback };
+	int rtn;
+
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_PROGRAM, 0);
+	rtn = program_common(ll_intf, slot, &src, rawdata, NULL, 0);
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+
+	return rtn;
+}
+
+int librsu_cb_verify_borrowed(struct librsu_ll_intf *ll_intf, int slot,
+			      rsu_borrow_callback callback, int rawdata)
+{
+	struct cb_source src = { .borrow = callback };
+	int rtn;
+
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_VERIFY, 0);
+	rtn = verify_common(ll_intf, slot, &src, rawdata);
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+
+	return rtn;
+}
+
+int librsu_cb_program_begin(struct librsu_ll_intf *ll_intf, int slot,
+			    int rawdata, struct rsu_program **prog)
+{
+	struct rsu_program *new;
+	int rtn;
+
+	new = malloc(sizeof(*new));
+	if (!new)
+		return -ELIB;
+
+	rtn = program_start(new, ll_intf, slot, rawdata);
+	if (rtn) {
+		free(new);
+		return rtn;
 	}
 
+	librsu_misc_cancel_begin();
+	librsu_misc_progress_begin(RSU_PROGRESS_PROGRAM, 0);
+
+	*prog = new;
 	return 0;
 }
+
+/*
+ * Data is assembled into whole image blocks, which are programmed as soon as
+ * they are complete. Errors are kept, so that they are reported again by the
+ * following writes and by the commit.
+ */
+int librsu_cb_program_write(struct rsu_program *prog, void *buf, int len)
+{
+	char *data = buf;
+	int cnt;
+
+	while (!prog->error && len > 0) {
+		if (librsu_misc_cancelled()) {
+			prog->error = -ECANCEL;
+			break;
+		}
+
+		cnt = IMAGE_BLOCK_SZ - prog->fill;
+		if (cnt > len)
+			cnt = len;
+
+		memcpy(prog->buf + prog->fill, data, cnt);
+		prog->fill += cnt;
+		data += cnt;
+		len -= cnt;
+
+		if (prog->fill < IMAGE_BLOCK_SZ)
+			break;
+
+		prog->error = program_block(prog, prog->buf, prog->fill);
+		prog->fill = 0;
+	}
+
+	return prog->error;
+}
+
+int librsu_cb_program_commit(struct rsu_program *prog)
+{
+	int rtn = prog->error;
+
+	if (!rtn && prog->fill)
+		rtn = program_block(prog, prog->buf, prog->fill);
+
+	if (!rtn)
+		rtn = program_finish(prog);
+
+	librsu_misc_progress_end(rtn);
+	librsu_misc_cancel_end();
+	free(prog);
+
+	return rtn;
+}
+
+void librsu_cb_program_abort(struct rsu_program *prog)
+{
+	librsu_misc_progress_end(-ECANCEL);
+	librsu_misc_cancel_end();
+	free(prog);
+}
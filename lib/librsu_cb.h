@@ -5,10 +5,44 @@
 #ifndef __LIBRSU_CB_H__
 #define __LIBRSU_CB_H__
 
+#include "librsu_digest.h"
+#include "librsu_image.h"
 #include "librsu_ll.h"
 #include <librsu.h>
 
+/**
+ * struct rsu_program - state of the programming of a slot
+ * @ll_intf: low level interface
+ * @part_num: partition being programmed
+ * @rawdata: image is raw data
+ * @offset: bytes programmed so far
+ * @skip: bytes already programmed before a resume, only checked
+ * @info: slot being programmed
+ * @state: image processing state
+ * @digesting: digest of the image is being recorded
+ * @digest: digest state
+ * @buf: image block being assembled, for rsu_slot_program_write()
+ * @fill: bytes in @buf
+ * @error: first error of rsu_slot_program_write()
+ */
+struct rsu_program {
+	struct rsu_ctx *ctx;
+	struct librsu_ll_intf *ll_intf;
+	int part_num;
+	int rawdata;
+	int offset;
+	int skip;
+	struct rsu_slot_info info;
+	struct rsu_image_state state;
+	int digesting;
+	struct librsu_digest digest;
+	unsigned char buf[IMAGE_BLOCK_SZ];
+	int fill;
+	int error;
+};
+
 int librsu_cb_file_init(char *filename);
+int librsu_cb_fd_init(int fd);
 void librsu_cb_file_cleanup(void);
 int librsu_cb_file(void *buf, int len);
 
@@ -16,9 +50,27 @@ int librsu_cb_buf_init(void *buf, int size);
 void librsu_cb_buf_cleanup(void);
 int librsu_cb_buf(void *buf, int len);
 
+int librsu_cb_iov_init(const struct iovec *iov, int iovcnt);
+void librsu_cb_iov_cleanup(void);
+int librsu_cb_iov(void *buf, int len);
+
 int librsu_cb_program_common(struct librsu_ll_intf *ll_intf, int slot,
 			     rsu_data_callback callback, int rawdata);
 
+int librsu_cb_program_resume(struct librsu_ll_intf *ll_intf, int slot,
+			     rsu_data_callback callback);
+
+int librsu_cb_program_begin(struct librsu_ll_intf *ll_intf, int slot,
+			    int rawdata, struct rsu_program **prog);
+int librsu_cb_program_write(struct rsu_program *prog, void *buf, int len);
+int librsu_cb_program_commit(struct rsu_program *prog);
+void librsu_cb_program_abort(struct rsu_program *prog);
+
+int librsu_cb_program_borrowed(struct librsu_ll_intf *ll_intf, int slot,
+			       rsu_borrow_callback callback, int rawdata);
+int librsu_cb_verify_borrowed(struct librsu_ll_intf *ll_intf, int slot,
+			      rsu_borrow_callback callback, int rawdata);
+
 int librsu_cb_verify_common(struct librsu_ll_intf *ll_intf, int slot,
 			    rsu_data_callback callback, int rawdata);
 
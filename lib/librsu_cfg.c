@@ -11,17 +11,61 @@
 #define DEFAULT_RSU_DEV "/sys/devices/platform/stratix10-rsu.0"
 #endif
 
-static enum RSU_LOG_TYPE { STDERR = 0, LOGFILE } logtype = STDERR;
-static enum RSU_LOG_LEVEL loglevel = LOW;
-static FILE *logfile;
-
-static enum RSU_LL_TYPE roottype = INVALID;
-static char *parsed_rootpath[QSPI_MAX_DEVICE];
-static char rootpath[128];
-static char rsu_dev[128] = DEFAULT_RSU_DEV;
-static int writeprotect;
-static int spt_checksum_enabled;
-static int total_num_flash_devices = 0;
+enum RSU_LOG_TYPE { STDERR = 0, LOGFILE };
+
+/*
+ * Parsed configuration. Each library context has its own, selected for the
+ * calling thread by librsu_cfg_state_select().
+ */
+struct cfg_state {
+	enum RSU_LOG_TYPE logtype;
+	enum RSU_LOG_LEVEL loglevel;
+	FILE *logfile;
+
+	enum RSU_LL_TYPE roottype;
+	char *parsed_rootpath[QSPI_MAX_DEVICE];
+	char rootpath[128];
+	char rsu_dev[128];
+	int writeprotect;
+	int spt_checksum_enabled;
+	char digest_cache[128];
+	char metadata_cache[128];
+	char program_journal[128];
+	int cpb_compact_threshold;
+	int total_num_flash_devices;
+};
+
+#define CFG_STATE_INIT {			\
+	.logtype = STDERR,			\
+	.loglevel = LOW,			\
+	.roottype = INVALID,			\
+	.rsu_dev = DEFAULT_RSU_DEV,		\
+}
+
+static struct cfg_state cfg_default = CFG_STATE_INIT;
+static _Thread_local struct cfg_state *cs = &cfg_default;
+
+void *librsu_cfg_state_new(void)
+{
+	struct cfg_state init = CFG_STATE_INIT;
+	struct cfg_state *state;
+
+	state = malloc(sizeof(*state));
+	if (state)
+		*state = init;
+
+	return state;
+}
+
+void librsu_cfg_state_free(void *state)
+{
+	free(state);
+}
+
+void librsu_cfg_state_select(void *state)
+{
+	cs = state ? state : &cfg_default;
+}
 
 void SAFE_STRCPY(char *dst, int dsz, char *src, int ssz)
 {
@@ -51,24 +95,30 @@ void SAFE_STRCPY(char *dst, int dsz, char *src, int ssz)
 
 void librsu_cfg_reset(void)
 {
-	if (logfile)
-		fclose(logfile);
+	if (cs->logfile)
+		fclose(cs->logfile);
 
-	logtype = STDERR;
-	loglevel = LOW;
-	logfile = NULL;
+	cs->logtype = STDERR;
+	cs->loglevel = LOW;
+	cs->logfile = NULL;
 
-	roottype = INVALID;
-	rootpath[0] = '\0';
-	SAFE_STRCPY(rsu_dev, sizeof(rsu_dev), DEFAULT_RSU_DEV,
+	cs->roottype = INVALID;
+	cs->rootpath[0] = '\0';
+	SAFE_STRCPY(cs->rsu_dev, sizeof(cs->rsu_dev), DEFAULT_RSU_DEV,
 		    sizeof(DEFAULT_RSU_DEV));
-	writeprotect = 0;
-	spt_checksum_enabled = 0;
+	cs->writeprotect = 0;
+	cs->spt_checksum_enabled = 0;
+	cs->digest_cache[0] = '\0';
+	cs->metadata_cache[0] = '\0';
+	cs->program_journal[0] = '\0';
+	cs->cpb_compact_threshold = 0;
 
 	/* free the memory for rsu multiflash rootpath */
 	for (int i = 0; i < QSPI_MAX_DEVICE; i++) {
-		free(parsed_rootpath[i]);
+		free(cs->parsed_rootpath[i]);
+		cs->parsed_rootpath[i] = NULL;
 	}
+	cs->total_num_flash_devices = 0;
 }
 
 /*
@@ -137,7 +187,7 @@ int librsu_cfg_parse(FILE *input)
 				return -1;
 			}
 
-			if (roottype != INVALID) {
+			if (cs->roottype != INVALID) {
 				librsu_log(LOW, __func__,
 					   "error: Redefinition of root @%i",
 					   linenum);
@@ -145,17 +195,19 @@ int librsu_cfg_parse(FILE *input)
 			}
 
 			if (strcmp(argv[1], "datafile") == 0) {
-				roottype = DATAFILE;
+				cs->roottype = DATAFILE;
 			} else if (strcmp(argv[1], "qspi") == 0) {
-				roottype = QSPI;
+				cs->roottype = QSPI;
 			} else {
-				roottype = INVALID;
+				cs->roottype = INVALID;
 				librsu_log(LOW, __func__,
 					   "error: Invalid parameter '%s' for '%s' @%i",
 					   argv[1], argv[0], linenum);
 				return -1;
 			}
 
+			SAFE_STRCPY(cs->rootpath, sizeof(cs->rootpath), argv[2],
+				    sizeof(cs->rootpath));
 			librsu_cfg_parse_rootpath(argv[2]);
 		} else if (strcmp(argv[0], "rsu-dev") == 0) {
 			if (argc != 2) {
@@ -165,8 +217,8 @@ int librsu_cfg_parse(FILE *input)
 				return -1;
 			}
 
-			SAFE_STRCPY(rsu_dev, sizeof(rsu_dev), argv[1],
-				    sizeof(rsu_dev));
+			SAFE_STRCPY(cs->rsu_dev, sizeof(cs->rsu_dev), argv[1],
+				    sizeof(cs->rsu_dev));
 		} else if (strcmp(argv[0], "log") == 0) {
 			if (argc < 2) {
 				librsu_log(LOW, __func__,
@@ -175,23 +227,23 @@ int librsu_cfg_parse(FILE *input)
 				return -1;
 			}
 
-			if (logfile) {
+			if (cs->logfile) {
 				librsu_log(LOW, __func__,
 					   "Logfile already open - closing @%i",
 					   linenum);
-				fclose(logfile);
-				logfile = NULL;
+				fclose(cs->logfile);
+				cs->logfile = NULL;
 			}
 
 			if (strcmp(argv[1], "off") == 0) {
-				loglevel = OFF;
+				cs->loglevel = OFF;
 				continue;
 			} else if (strcmp(argv[1], "low") == 0) {
-				loglevel = LOW;
+				cs->loglevel = LOW;
 			} else if (strcmp(argv[1], "med") == 0) {
-				loglevel = MED;
+				cs->loglevel = MED;
 			} else if (strcmp(argv[1], "high") == 0) {
-				loglevel = HIGH;
+				cs->loglevel = HIGH;
 			} else {
 				librsu_log(LOW, __func__,
 					   "error: Invalid parameter '%s' for '%s' @%i",
@@ -200,17 +252,17 @@ int librsu_cfg_parse(FILE *input)
 			}
 
 			if (argc < 3 || strcmp(argv[2], "stderr") == 0) {
-				logtype = STDERR;
+				cs->logtype = STDERR;
 			} else {
-				logtype = LOGFILE;
-				logfile = fopen(argv[2], "a");
-				if (!logfile) {
+				cs->logtype = LOGFILE;
+				cs->logfile = fopen(argv[2], "a");
+				if (!cs->logfile) {
 					librsu_log(LOW, __func__,
 						   "Unable to open logfile '%s' @%i",
 						   argv[2], linenum);
 					continue;
 				} else {
-					fprintf(logfile,
+					fprintf(cs->logfile,
 						"\n---- START SESSION ----\n");
 				}
 			}
@@ -229,7 +281,7 @@ int librsu_cfg_parse(FILE *input)
 					   linenum);
 				return -1;
 			}
-			writeprotect |= (1 << x);
+			cs->writeprotect |= (1 << x);
 		} else if (strcmp(argv[0], "rsu-spt-checksum") == 0) {
 			if (argc != 2) {
 				librsu_log(LOW, __func__,
@@ -238,7 +290,55 @@ int librsu_cfg_parse(FILE *input)
 				return -1;
 			}
 
-			spt_checksum_enabled = strtol(argv[1], NULL, 10);
+			cs->spt_checksum_enabled = strtol(argv[1], NULL, 10);
+		} else if (strcmp(argv[0], "cpb-compact-threshold") == 0) {
+			if (argc != 2) {
+				librsu_log(LOW, __func__,
+					   "error: Wrong number of param for '%s' @%i",
+					   argv[0], linenum);
+				return -1;
+			}
+
+			x = strtol(argv[1], NULL, 10);
+			if (x < 1) {
+				librsu_log(LOW, __func__,
+					   "error: Invalid parameter '%s' for '%s' @%i",
+					   argv[1], argv[0], linenum);
+				return -1;
+			}
+			cs->cpb_compact_threshold = x;
+		} else if (strcmp(argv[0], "digest-cache") == 0) {
+			if (argc != 2) {
+				librsu_log(LOW, __func__,
+					   "error: Wrong number of param for '%s' @%i",
+					   argv[0], linenum);
+				return -1;
+			}
+
+			SAFE_STRCPY(cs->digest_cache, sizeof(cs->digest_cache),
+				    argv[1], sizeof(cs->digest_cache));
+		} else if (strcmp(argv[0], "metadata-cache") == 0) {
+			if (argc != 2) {
+				librsu_log(LOW, __func__,
+					   "error: Wrong number of param for '%s' @%i",
+					   argv[0], linenum);
+				return -1;
+			}
+
+			SAFE_STRCPY(cs->metadata_cache,
+				    sizeof(cs->metadata_cache), argv[1],
+				    sizeof(cs->metadata_cache));
+		} else if (strcmp(argv[0], "program-journal") == 0) {
+			if (argc != 2) {
+				librsu_log(LOW, __func__,
+					   "error: Wrong number of param for '%s' @%i",
+					   argv[0], linenum);
+				return -1;
+			}
+
+			SAFE_STRCPY(cs->program_journal,
+				    sizeof(cs->program_journal), argv[1],
+				    sizeof(cs->program_journal));
 		} else {
 			librsu_log(LOW, __func__,
 				   "error: Invalid cfg file option '%s' @%i",
@@ -247,7 +347,7 @@ int librsu_cfg_parse(FILE *input)
 		}
 	}
 
-	if (roottype == 0) {
+	if (cs->roottype == 0) {
 		librsu_log(LOW, __func__,
 			   "error: Missing 'root' spec in configuration file");
 		return -1;
@@ -262,7 +362,7 @@ void librsu_log(enum RSU_LOG_LEVEL level, const char *func, const char *format,
 	va_list arg;
 	char *level_name;
 
-	if (loglevel == OFF || loglevel < level)
+	if (cs->loglevel == OFF || cs->loglevel < level)
 		return;
 
 	if (level == LOW)
@@ -274,7 +374,7 @@ void librsu_log(enum RSU_LOG_LEVEL level, const char *func, const char *format,
 	else
 		level_name = "???";
 
-	if (logtype == STDERR) {
+	if (cs->logtype == STDERR) {
 		fprintf(stderr, "librsu: %s(): ", func);
 
 		va_start(arg, format);
@@ -283,29 +383,30 @@ void librsu_log(enum RSU_LOG_LEVEL level, const char *func, const char *format,
 
 		fprintf(stderr, " [%s]\n", level_name);
 		fflush(stderr);
-	} else if (logtype == LOGFILE) {
-		if (!logfile)
+	} else if (cs->logtype == LOGFILE) {
+		if (!cs->logfile)
 			return;
 
-		fprintf(logfile, "%s(): ", func);
+		fprintf(cs->logfile, "%s(): ", func);
 
 		va_start(arg, format);
-		vfprintf(logfile, format, arg);
+		vfprintf(cs->logfile, format, arg);
 		va_end(arg);
 
-		fprintf(logfile, " [%s]\n", level_name);
-		fflush(logfile);
+		fprintf(cs->logfile, " [%s]\n", level_name);
+		fflush(cs->logfile);
 	}
 }
 
 enum RSU_LL_TYPE librsu_cfg_get_roottype(void)
 {
-	return roottype;
+	return cs->roottype;
 }
 
 void librsu_cfg_parse_rootpath(char *rootpath)
 {
 	char *token;
+	char *saveptr;
 	char *delimiter = ",";
 
 	if (!rootpath) {
@@ -317,20 +418,22 @@ void librsu_cfg_parse_rootpath(char *rootpath)
 	char *tmp = strdup(rootpath);
 
 	/* get first mtd token */
-	token = strtok(tmp, delimiter);
+	token = strtok_r(tmp, delimiter, &saveptr);
 
 	/* parse other mtds */
-	while(token != NULL && total_num_flash_devices < QSPI_MAX_DEVICE) {
-		parsed_rootpath[total_num_flash_devices] = strdup(token);
-		if (!parsed_rootpath[total_num_flash_devices]) {
+	while(token != NULL && cs->total_num_flash_devices < QSPI_MAX_DEVICE) {
+		int n = cs->total_num_flash_devices;
+
+		cs->parsed_rootpath[n] = strdup(token);
+		if (!cs->parsed_rootpath[n]) {
 			/* free tmp string */
 			free(tmp);
 			librsu_log(LOW, __func__, "error: token is NULL. Exiting.");
 			return;
 		}
 
-		token = strtok(NULL, delimiter);
-		total_num_flash_devices++;
+		token = strtok_r(NULL, delimiter, &saveptr);
+		cs->total_num_flash_devices++;
 	}
 
 	/* free tmp string */
@@ -340,21 +443,26 @@ void librsu_cfg_parse_rootpath(char *rootpath)
 int librsu_cfg_get_rootpath(struct spi_flash_info *flash_info)
 {
 	/* retrieve the rootpath from parsed mtd */
-	for (int i = 0; i < total_num_flash_devices; i++) {
-		flash_info->root_path[i] = strdup(parsed_rootpath[i]);
+	for (int i = 0; i < cs->total_num_flash_devices; i++) {
+		flash_info->root_path[i] = strdup(cs->parsed_rootpath[i]);
 		flash_info->flash_index[i] = i;
 	}
 
 	/* return the num of flash */
-	if (roottype != 0)
-		return total_num_flash_devices;
+	if (cs->roottype != 0)
+		return cs->total_num_flash_devices;
 	else
 		return 0;
 }
 
+char *librsu_cfg_get_root(void)
+{
+	return cs->rootpath;
+}
+
 char *librsu_cfg_get_rsu_dev(void)
 {
-	return rsu_dev;
+	return cs->rsu_dev;
 }
 
 int librsu_cfg_writeprotected(int slot)
@@ -365,7 +473,7 @@ int librsu_cfg_writeprotected(int slot)
 	if (slot > 31)
 		return 0;
 
-	if (writeprotect & (1 << slot))
+	if (cs->writeprotect & (1 << slot))
 		return 1;
 
 	return 0;
@@ -373,8 +481,37 @@ int librsu_cfg_writeprotected(int slot)
 
 int librsu_cfg_spt_checksum_enabled(void)
 {
-	if (spt_checksum_enabled)
+	if (cs->spt_checksum_enabled)
 		return 1;
 
 	return 0;
 }
+
+char *librsu_cfg_get_digest_cache(void)
+{
+	if (cs->digest_cache[0] == '\0')
+		return NULL;
+
+	return cs->digest_cache;
+}
+
+char *librsu_cfg_get_metadata_cache(void)
+{
+	if (cs->metadata_cache[0] == '\0')
+		return NULL;
+
+	return cs->metadata_cache;
+}
+
+int librsu_cfg_cpb_compact_threshold(void)
+{
+	return cs->cpb_compact_threshold;
+}
+
+char *librsu_cfg_get_program_journal(void)
+{
+	if (cs->program_journal[0] == '\0')
+		return NULL;
+
+	return cs->program_journal;
+}
@@ -27,9 +27,20 @@ int librsu_cfg_get_rootpath(struct spi_flash_info *flash_info);
 
 void librsu_cfg_parse_rootpath(char *rootpath);
 
+char *librsu_cfg_get_root(void);
+
 char *librsu_cfg_get_rsu_dev(void);
 
 int librsu_cfg_writeprotected(int slot);
 
 int librsu_cfg_spt_checksum_enabled(void);
+char *librsu_cfg_get_digest_cache(void);
+char *librsu_cfg_get_metadata_cache(void);
+char *librsu_cfg_get_program_journal(void);
+int librsu_cfg_cpb_compact_threshold(void);
+
+void *librsu_cfg_state_new(void);
+void librsu_cfg_state_free(void *state);
+void librsu_cfg_state_select(void *state);
+
 #endif
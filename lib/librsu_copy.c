@@ -0,0 +1,628 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* Intel Copyright 2018 */
+
+#include <fcntl.h>
+#include "librsu_cfg.h"
+#include "librsu_copy.h"
+#include "librsu_image.h"
+#include "librsu_misc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The slot is read in large chunks into a small ring of buffers, which a
+ * writer thread drains to the output file, so that flash reads overlap with
+ * output writes.
+ */
+#define COPY_CHUNK_SZ	0x40000
+#define COPY_BUFFERS	4
+
+/**
+ * struct copy_chunk - chunk of slot data waiting to be written
+ * @data: chunk buffer
+ * @offset: slot offset of the chunk
+ * @len: number of bytes to write, with trailing blank blocks excluded
+ */
+struct copy_chunk {
+	char *data;
+	int offset;
+	int len;
+};
+
+/**
+ * struct copy_ring - state shared between the reader and the writer thread
+ * @lock: protects the ring indexes and flags
+ * @cond: signalled whenever a chunk is filled or written
+ * @chunk: ring of chunk buffers
+ * @head: next chunk to be filled by the reader
+ * @tail: next chunk to be written by the writer
+ * @count: number of chunks filled and not yet written
+ * @done: reader has no more chunks to provide
+ * @error: writer failed to write to the output file
+ * @fill: chunk sized buffer of 0xFF bytes, used to fill skipped areas
+ * @df: output file descriptor
+ * @filename: output file name
+ */
+struct copy_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_chunk chunk[COPY_BUFFERS];
+	int head;
+	int tail;
+	int count;
+	int done;
+	int error;
+	char *fill;
+	int df;
+	char *filename;
+};
+
+/**
+ * write_all() - write a whole buffer, retrying on short writes
+ * @df: output file descriptor
+ * @buf: data to write
+ * @len: number of bytes to write
+ *
+ * Return: zero value for success, or negative value on error
+ */
+static int write_all(int df, char *buf, int len)
+{
+	int rtn;
+
+	while (len > 0) {
+		rtn = write(df, buf, len);
+		if (rtn <= 0)
+			return -1;
+
+		buf += rtn;
+		len -= rtn;
+	}
+
+	return 0;
+}
+
+/**
+ * write_chunk() - write a chunk to the output file
+ * @ring: copy state
+ * @chunk: chunk to be written
+ * @last_write: end of the data already written to the output file
+ *
+ * Blank chunks are not written. When data is found after some skipped blank
+ * chunks, the output file is filled with 0xFF up to the chunk offset.
+ *
+ * Return: zero value for success, or negative value on error
+ */
+static int write_chunk(struct copy_ring *ring, struct copy_chunk *chunk,
+		       int *last_write)
+{
+	int len;
+
+	if (!chunk->len)
+		return 0;
+
+	while (*last_write < chunk->offset) {
+		len = chunk->offset - *last_write;
+		if (len > COPY_CHUNK_SZ)
+			len = COPY_CHUNK_SZ;
+
+		if (write_all(ring->df, ring->fill, len))
+			return -1;
+
+		*last_write += len;
+	}
+
+	if (write_all(ring->df, chunk->data, chunk->len))
+		return -1;
+
+	*last_write = chunk->offset + chunk->len;
+
+	return 0;
+}
+
+static void *copy_writer(void *arg)
+{
+	struct copy_ring *ring = (struct copy_ring *)arg;
+	int last_write = 0;
+	int rtn;
+
+	pthread_mutex_lock(&ring->lock);
+
+	for (;;) {
+		while (!ring->count && !ring->done)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+
+		if (!ring->count)
+			break;
+
+		pthread_mutex_unlock(&ring->lock);
+		rtn = write_chunk(ring, &ring->chunk[ring->tail], &last_write);
+		pthread_mutex_lock(&ring->lock);
+
+		if (rtn) {
+			librsu_log(HIGH, __func__, "Unable to wr to file '%s'",
+				   ring->filename);
+			ring->error = 1;
+			pthread_cond_broadcast(&ring->cond);
+			break;
+		}
+
+		ring->tail = (ring->tail + 1) % COPY_BUFFERS;
+		ring->count--;
+		pthread_cond_broadcast(&ring->cond);
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+/**
+ * block_blank() - check if an image block is erased
+ * @block: block to check
+ * @len: number of bytes in the block
+ *
+ * Comparing the block against itself shifted by one byte lets memcmp() do
+ * the scan, which libc implements with vector instructions.
+ *
+ * Return: 1 if all bytes are 0xFF, 0 otherwise
+ */
+static int block_blank(char *block, int len)
+{
+	if (block[0] != (char)0xFF)
+		return 0;
+
+	return memcmp(block, block + 1, len - 1) == 0;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int librsu_copy_to_file(struct librsu_ll_intf *ll_intf, int slot,
+			char *filename)
+{
+	int part_num;
+	int size;
+	int offset;
+	int len;
+	int x;
+	int blk;
+	int rtn = 0;
+	long ms;
+	__u64 rate;
+	pthread_t writer;
+	struct copy_ring ring;
+	struct copy_chunk *chunk;
+	struct timespec start;
+
+	if (!ll_intf)
+		return -ELIB;
+
+	if (!filename)
+		return -EARGS;
+
+	part_num = librsu_misc_slot2part(ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	if (ll_intf->priority.get(part_num) <= 0) {
+		librsu_log(HIGH, __func__, "Trying to read an erased slot");
+		return -EERASE;
+	}
+
+	/*
+	 * Nothing in the image gives the size of its last section, so the end
+	 * of the image cannot be told from erased flash inside it, and the
+	 * whole slot is read. Trailing erased blocks are not written.
+	 */
+	memset(&ring, 0, sizeof(ring));
+	ring.filename = filename;
+
+	if (posix_memalign((void **)&ring.fill, IMAGE_BLOCK_SZ,
+			   COPY_CHUNK_SZ)) {
+		librsu_log(LOW, __func__, "error: failed to alloc buf");
+		return -ELIB;
+	}
+	memset(ring.fill, 0xff, COPY_CHUNK_SZ);
+
+	for (x = 0; x < COPY_BUFFERS; x++) {
+		if (posix_memalign((void **)&ring.chunk[x].data,
+				   IMAGE_BLOCK_SZ, COPY_CHUNK_SZ)) {
+			librsu_log(LOW, __func__, "error: failed to alloc buf");
+			rtn = -ELIB;
+			goto free_bufs;
+		}
+	}
+
+	ring.df = open(filename, O_WRONLY | O_CREAT, 0600);
+	if (ring.df < 0) {
+		librsu_log(HIGH, __func__,
+			   "Unable to open output file '%s'", filename);
+		rtn = -EFILEIO;
+		goto free_bufs;
+	}
+
+	if (ftruncate(ring.df, 0)) {
+		librsu_log(HIGH, __func__,
+			   "Unable to truncate file '%s' to length zero",
+			   filename);
+		rtn = -EFILEIO;
+		goto close_file;
+	}
+
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	if (pthread_create(&writer, NULL, copy_writer, &ring)) {
+		librsu_log(LOW, __func__, "error: failed to start writer");
+		rtn = -ELIB;
+		goto destroy_ring;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size = ll_intf->partition.size(part_num);
+	offset = 0;
+
+	librsu_misc_progress_begin(RSU_PROGRESS_COPY, size);
+
+	while (offset < size) {
+		pthread_mutex_lock(&ring.lock);
+		while (ring.count == COPY_BUFFERS && !ring.error)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		if (ring.error)
+			rtn = -EFILEIO;
+		pthread_mutex_unlock(&ring.lock);
+
+		if (rtn)
+			break;
+
+		chunk = &ring.chunk[ring.head];
+
+		len = size - offset;
+		if (len > COPY_CHUNK_SZ)
+			len = COPY_CHUNK_SZ;
+
+		if (ll_intf->data.read(part_num, offset, len, chunk->data)) {
+			librsu_log(HIGH, __func__,
+				   "Unable to rd slot %i, offs 0x%08x, cnt %i",
+				   slot, offset, len);
+			rtn = -ELOWLEVEL;
+			break;
+		}
+
+		chunk->offset = offset;
+		chunk->len = 0;
+
+		for (x = 0; x < len; x += IMAGE_BLOCK_SZ) {
+			blk = len - x;
+			if (blk > IMAGE_BLOCK_SZ)
+				blk = IMAGE_BLOCK_SZ;
+
+			if (!block_blank(chunk->data + x, blk))
+				chunk->len = x + blk;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		ring.head = (ring.head + 1) % COPY_BUFFERS;
+		ring.count++;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+
+		offset += len;
+		librsu_misc_progress(offset);
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+
+	pthread_join(writer, NULL);
+
+	if (!rtn && ring.error)
+		rtn = -EFILEIO;
+
+	librsu_misc_progress_end(rtn);
+
+	if (!rtn) {
+		ms = elapsed_ms(&start);
+		if (ms <= 0)
+			ms = 1;
+
+		/* Rate in hundredths of MB/s */
+		rate = (__u64)offset * 1000 * 100 / ((__u64)ms * 1024 * 1024);
+
+		librsu_log(MED, __func__,
+			   "Read %i bytes from slot %i in %li ms (%llu.%02llu MB/s)",
+			   offset, slot, ms, rate / 100, rate % 100);
+	}
+
+destroy_ring:
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+
+close_file:
+	close(ring.df);
+
+free_bufs:
+	for (x = 0; x < COPY_BUFFERS; x++)
+		free(ring.chunk[x].data);
+	free(ring.fill);
+
+	return rtn;
+}
+
+int librsu_copy_slot(struct librsu_ll_intf *ll_intf, int src_slot,
+		     int dst_slot)
+{
+	int src_part;
+	int dst_part;
+	int offset;
+	int len;
+	int used;
+	int x;
+	int rtn = 0;
+	char *buf = NULL;
+	char *vbuf = NULL;
+	struct rsu_slot_info src;
+	struct rsu_slot_info dst;
+	struct rsu_image_state state;
+
+	if (!ll_intf)
+		return -ELIB;
+
+	if (src_slot == dst_slot)
+		return -EARGS;
+
+	if (librsu_cfg_writeprotected(dst_slot)) {
+		librsu_log(HIGH, __func__,
+			   "Trying to program a write protected slot");
+		return -EWRPROT;
+	}
+
+	if (rsu_slot_get_info(src_slot, &src) ||
+	    rsu_slot_get_info(dst_slot, &dst)) {
+		librsu_log(HIGH, __func__, "Unable to read slot info");
+		return -ESLOTNUM;
+	}
+
+	src_part = librsu_misc_slot2part(ll_intf, src_slot);
+	dst_part = librsu_misc_slot2part(ll_intf, dst_slot);
+	if (src_part < 0 || dst_part < 0)
+		return -ESLOTNUM;
+
+	if (src.priority <= 0) {
+		librsu_log(HIGH, __func__, "Trying to copy an erased slot");
+		return -EERASE;
+	}
+
+	if (dst.priority > 0) {
+		librsu_log(HIGH, __func__,
+			   "Trying to program a slot already in use");
+		return -EPROGRAM;
+	}
+
+	if (posix_memalign((void **)&buf, IMAGE_BLOCK_SZ, COPY_CHUNK_SZ) ||
+	    posix_memalign((void **)&vbuf, IMAGE_BLOCK_SZ, COPY_CHUNK_SZ)) {
+		librsu_log(LOW, __func__, "error: failed to alloc buf");
+		rtn = -ELIB;
+		goto free_bufs;
+	}
+
+	if (librsu_image_block_init(&state)) {
+		rtn = -ELIB;
+		goto free_bufs;
+	}
+
+	/*
+	 * The end of the image cannot be proven, so the whole source slot is
+	 * copied. Erased blocks are not written, but the destination is read
+	 * back and compared through the end of the source slot, so it must
+	 * match the source there, erased areas included. Source data past the
+	 * end of a smaller destination slot must be erased.
+	 */
+	offset = 0;
+
+	librsu_misc_progress_begin(RSU_PROGRESS_COPY, src.size);
+
+	while (offset < src.size) {
+		len = src.size - offset;
+		if (len > COPY_CHUNK_SZ)
+			len = COPY_CHUNK_SZ;
+
+		if (ll_intf->data.read(src_part, offset, len, buf)) {
+			rtn = -ELOWLEVEL;
+			break;
+		}
+
+		used = 0;
+
+		for (x = 0; x + IMAGE_BLOCK_SZ <= len; x += IMAGE_BLOCK_SZ) {
+			if (librsu_image_block_relocate(&state, buf + x, &src,
+							&dst)) {
+				librsu_log(HIGH, __func__,
+					   "Bad image in slot %i @0x%08x",
+					   src_slot, offset + x);
+				rtn = -EFORMAT;
+				break;
+			}
+
+			/* Only CMF images can be relocated */
+			if (offset + x == 0 &&
+			    state.block_type != SIGNATURE_BLOCK) {
+				librsu_log(HIGH, __func__,
+					   "Slot %i does not hold a CMF image",
+					   src_slot);
+				rtn = -EFORMAT;
+				break;
+			}
+
+			if (!block_blank(buf + x, IMAGE_BLOCK_SZ))
+				used = x + IMAGE_BLOCK_SZ;
+		}
+
+		if (rtn)
+			break;
+
+		if (offset + used > dst.size) {
+			librsu_log(HIGH, __func__,
+				   "Trying to program too much data into slot");
+			rtn = -ESIZE;
+			break;
+		}
+
+		if (offset >= dst.size) {
+			offset += len;
+			librsu_misc_progress(offset);
+			continue;
+		}
+
+		if (offset + len > dst.size)
+			len = dst.size - offset;
+
+		if (used && ll_intf->data.write(dst_part, offset, used, buf)) {
+			rtn = -ELOWLEVEL;
+			break;
+		}
+
+		if (ll_intf->data.read(dst_part, offset, len, vbuf)) {
+			rtn = -ELOWLEVEL;
+			break;
+		}
+
+		if (memcmp(buf, vbuf, len)) {
+			librsu_log(HIGH, __func__,
+				   "Verify failed in chunk @ 0x%08X", offset);
+			rtn = -ECMP;
+			break;
+		}
+
+		offset += len;
+		librsu_misc_progress(offset);
+	}
+
+	if (!rtn && ll_intf->priority.add(dst_part))
+		rtn = -ELOWLEVEL;
+
+	librsu_misc_progress_end(rtn);
+
+	if (!rtn)
+		librsu_log(MED, __func__, "Copied %i bytes from slot %i to %i",
+			   offset, src_slot, dst_slot);
+
+free_bufs:
+	free(vbuf);
+	free(buf);
+
+	return rtn;
+}
+
+int librsu_copy_check(struct librsu_ll_intf *ll_intf, int slot)
+{
+	int part_num;
+	int offset;
+	int len;
+	int x;
+	int rtn = 0;
+	char *buf = NULL;
+	struct rsu_slot_info info;
+	struct rsu_image_state state;
+
+	if (!ll_intf)
+		return -ELIB;
+
+	if (rsu_slot_get_info(slot, &info)) {
+		librsu_log(HIGH, __func__, "Unable to read slot info");
+		return -ESLOTNUM;
+	}
+
+	part_num = librsu_misc_slot2part(ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	if (posix_memalign((void **)&buf, IMAGE_BLOCK_SZ, COPY_CHUNK_SZ)) {
+		librsu_log(LOW, __func__, "error: failed to alloc buf");
+		return -ELIB;
+	}
+
+	if (librsu_image_block_init(&state)) {
+		rtn = -ELIB;
+		goto free_buf;
+	}
+
+	/*
+	 * The whole slot is checked: the end of the image cannot be told
+	 * from a block which only looks erased.
+	 */
+	for (offset = 0; offset < info.size; offset += len) {
+		len = info.size - offset;
+		if (len > COPY_CHUNK_SZ)
+			len = COPY_CHUNK_SZ;
+
+		if (ll_intf->data.read(part_num, offset, len, buf)) {
+			rtn = -ELOWLEVEL;
+			break;
+		}
+
+		for (x = 0; x + IMAGE_BLOCK_SZ <= len; x += IMAGE_BLOCK_SZ) {
+			if (offset + x == 0 &&
+			    block_blank(buf, IMAGE_BLOCK_SZ)) {
+				librsu_log(HIGH, __func__, "Slot %i is erased",
+					   slot);
+				rtn = -EERASE;
+				break;
+			}
+
+			if (librsu_image_block_scan(&state, buf + x, &info)) {
+				librsu_log(HIGH, __func__,
+					   "Bad signature block in slot %i @0x%08x",
+					   slot, offset + x);
+				rtn = -EFORMAT;
+				break;
+			}
+
+			if (offset + x == 0 &&
+			    state.block_type != SIGNATURE_BLOCK) {
+				librsu_log(HIGH, __func__,
+					   "Slot %i does not hold a CMF image",
+					   slot);
+				rtn = -EFORMAT;
+				break;
+			}
+
+			if (!block_blank(buf + x, IMAGE_BLOCK_SZ))
+				continue;
+
+			/* Sections must not point to erased flash */
+			if (librsu_image_is_section(&state, offset + x)) {
+				librsu_log(HIGH, __func__,
+					   "Section in slot %i @0x%08x is erased",
+					   slot, offset + x);
+				rtn = -EFORMAT;
+				break;
+			}
+		}
+
+		if (rtn)
+			break;
+	}
+
+	if (!rtn)
+		librsu_log(MED, __func__, "Slot %i image is consistent", slot);
+
+free_buf:
+	free(buf);
+
+	return rtn;
+}
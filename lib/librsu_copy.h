@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Intel Copyright 2018 */
+
+#ifndef __LIBRSU_COPY_H__
+#define __LIBRSU_COPY_H__
+
+#include "librsu_ll.h"
+#include <librsu.h>
+
+int librsu_copy_to_file(struct librsu_ll_intf *ll_intf, int slot,
+			char *filename);
+
+int librsu_copy_slot(struct librsu_ll_intf *ll_intf, int src_slot,
+		     int dst_slot);
+
+int librsu_copy_check(struct librsu_ll_intf *ll_intf, int slot);
+
+#endif
@@ -0,0 +1,616 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* Intel Copyright 2018 */
+
+#include "librsu_cfg.h"
+#include "librsu_digest.h"
+#include "librsu_misc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * The digest of a slot covers the image as it would be in a file generated
+ * for slot offset zero: the pointers in signature blocks are moved back by
+ * the slot offset, and trailing 0xFF bytes are not included. The digest of a
+ * relocatable image file therefore matches the digest of the slot it was
+ * programmed into.
+ *
+ * When a digest cache file is configured, the digests of images programmed
+ * through the library are recorded there, together with a CRC32 of the first
+ * two blocks as stored in flash. The main descriptor in the first block holds
+ * the hash of the section, so if the fingerprint still matches the slot
+ * contents the recorded digest can be used without reading the whole image.
+ * Records are keyed by the flash and RSU device of the target as well as the
+ * slot offset, since several targets may share one cache file.
+ */
+
+#define DIGEST_CHUNK_SZ		0x40000
+#define DIGEST_RECORD_MAGIC	0x48445353
+#define DIGEST_MAX_RECORDS	64
+
+/**
+ * struct digest_record - recorded digest of a slot, as stored in cache file
+ * @magic: DIGEST_RECORD_MAGIC
+ * @fingerprint: CRC32 of the first two image blocks, as stored in flash
+ * @offset: slot offset
+ * @size: slot size
+ * @length: number of bytes covered by the digest
+ * @target: CRC32 of the root and rsu-dev paths of the target
+ * @crc32: CRC32 digest
+ * @sha256: SHA-256 digest
+ */
+struct digest_record {
+	__u32 magic;
+	__u32 fingerprint;
+	__u64 offset;
+	__u32 size;
+	__u32 length;
+	__u32 target;
+	__u8 crc32[RSU_DIGEST_CRC32_SZ];
+	__u8 sha256[RSU_DIGEST_SHA256_SZ];
+};
+
+static const __u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * sha256_transform() - process one 64 byte input block
+ * @sha: SHA-256 state
+ * @data: input block
+ */
+static void sha256_transform(struct librsu_sha256 *sha, const __u8 *data)
+{
+	__u32 w[64];
+	__u32 a, b, c, d, e, f, g, h;
+	__u32 t1, t2;
+	int x;
+
+	for (x = 0; x < 16; x++)
+		w[x] = (__u32)data[x * 4] << 24 |
+		       (__u32)data[x * 4 + 1] << 16 |
+		       (__u32)data[x * 4 + 2] << 8 |
+		       (__u32)data[x * 4 + 3];
+
+	for (x = 16; x < 64; x++)
+		w[x] = w[x - 16] + w[x - 7] +
+		       (ROR32(w[x - 15], 7) ^ ROR32(w[x - 15], 18) ^
+			(w[x - 15] >> 3)) +
+		       (ROR32(w[x - 2], 17) ^ ROR32(w[x - 2], 19) ^
+			(w[x - 2] >> 10));
+
+	a = sha->h[0];
+	b = sha->h[1];
+	c = sha->h[2];
+	d = sha->h[3];
+	e = sha->h[4];
+	f = sha->h[5];
+	g = sha->h[6];
+	h = sha->h[7];
+
+	for (x = 0; x < 64; x++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[x] + w[x];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	sha->h[0] += a;
+	sha->h[1] += b;
+	sha->h[2] += c;
+	sha->h[3] += d;
+	sha->h[4] += e;
+	sha->h[5] += f;
+	sha->h[6] += g;
+	sha->h[7] += h;
+}
+
+void librsu_sha256_init(struct librsu_sha256 *sha)
+{
+	sha->h[0] = 0x6a09e667;
+	sha->h[1] = 0xbb67ae85;
+	sha->h[2] = 0x3c6ef372;
+	sha->h[3] = 0xa54ff53a;
+	sha->h[4] = 0x510e527f;
+	sha->h[5] = 0x9b05688c;
+	sha->h[6] = 0x1f83d9ab;
+	sha->h[7] = 0x5be0cd19;
+	sha->len = 0;
+	sha->fill = 0;
+}
+
+void librsu_sha256_update(struct librsu_sha256 *sha, const __u8 *data,
+			  int len)
+{
+	int cnt;
+
+	sha->len += len;
+
+	while (len > 0) {
+		if (!sha->fill && len >= 64) {
+			sha256_transform(sha, data);
+			data += 64;
+			len -= 64;
+			continue;
+		}
+
+		cnt = 64 - sha->fill;
+		if (cnt > len)
+			cnt = len;
+
+		memcpy(sha->buf + sha->fill, data, cnt);
+		sha->fill += cnt;
+		data += cnt;
+		len -= cnt;
+
+		if (sha->fill == 64) {
+			sha256_transform(sha, sha->buf);
+			sha->fill = 0;
+		}
+	}
+}
+
+void librsu_sha256_final(struct librsu_sha256 *sha, __u8 *out)
+{
+	__u64 bits = sha->len * 8;
+	int x;
+
+	sha->buf[sha->fill++] = 0x80;
+
+	if (sha->fill > 56) {
+		memset(sha->buf + sha->fill, 0, 64 - sha->fill);
+		sha256_transform(sha, sha->buf);
+		sha->fill = 0;
+	}
+
+	memset(sha->buf + sha->fill, 0, 56 - sha->fill);
+	for (x = 0; x < 8; x++)
+		sha->buf[63 - x] = (__u8)(bits >> (x * 8));
+	sha256_transform(sha, sha->buf);
+
+	for (x = 0; x < 32; x++)
+		out[x] = (__u8)(sha->h[x / 4] >> (24 - (x % 4) * 8));
+}
+
+/**
+ * digest_add() - add image data to both digests
+ * @dg: digest state
+ * @data: image data
+ * @len: number of bytes
+ */
+static void digest_add(struct librsu_digest *dg, const __u8 *data, int len)
+{
+	librsu_sha256_update(&dg->sha, data, len);
+	dg->crc = crc32(dg->crc, data, len);
+	dg->length += len;
+}
+
+/**
+ * digest_flush() - add the held back 0xFF bytes to both digests
+ * @dg: digest state
+ *
+ * The 0xFF bytes are only part of the image if more data follows them.
+ */
+static void digest_flush(struct librsu_digest *dg)
+{
+	__u8 fill[256];
+	int cnt;
+
+	memset(fill, 0xFF, sizeof(fill));
+
+	while (dg->pending > 0) {
+		cnt = dg->pending;
+		if (cnt > (int)sizeof(fill))
+			cnt = sizeof(fill);
+
+		digest_add(dg, fill, cnt);
+		dg->pending -= cnt;
+	}
+}
+
+/**
+ * last_used() - find the last byte of a block which is not erased
+ * @block: block to check
+ * @len: number of bytes in the block
+ *
+ * Return: index of the last byte which is not 0xFF, or -1 if none
+ */
+static int last_used(const __u8 *block, int len)
+{
+	while (len > 0 && block[len - 1] == 0xFF)
+		len--;
+
+	return len - 1;
+}
+
+int librsu_digest_init(struct librsu_digest *dg, struct rsu_slot_info *info)
+{
+	if (librsu_image_block_init(&dg->state))
+		return -1;
+
+	dg->src = *info;
+	dg->dst = *info;
+	dg->dst.offset = 0;
+
+	librsu_sha256_init(&dg->sha);
+	dg->crc = crc32(0, NULL, 0);
+	dg->fingerprint = crc32(0, NULL, 0);
+	dg->pending = 0;
+	dg->length = 0;
+
+	return 0;
+}
+
+int librsu_digest_block(struct librsu_digest *dg, void *block, int len)
+{
+	__u8 *data = (__u8 *)dg->block;
+	int last;
+
+	memcpy(data, block, len);
+	memset(data + len, 0xFF, IMAGE_BLOCK_SZ - len);
+
+	if (dg->state.offset + IMAGE_BLOCK_SZ < 2 * IMAGE_BLOCK_SZ)
+		dg->fingerprint = crc32(dg->fingerprint, data, IMAGE_BLOCK_SZ);
+
+	if (librsu_image_block_relocate(&dg->state, data, &dg->src, &dg->dst))
+		return -1;
+
+	last = last_used(data, IMAGE_BLOCK_SZ);
+	if (last < 0) {
+		dg->pending += IMAGE_BLOCK_SZ;
+		return 0;
+	}
+
+	digest_flush(dg);
+	digest_add(dg, data, last + 1);
+	dg->pending = IMAGE_BLOCK_SZ - 1 - last;
+
+	return 0;
+}
+
+/**
+ * target_id() - identify the flash and RSU device the digests are about
+ *
+ * Return: CRC32 of the configured root and rsu-dev paths
+ */
+static __u32 target_id(void)
+{
+	char *root = librsu_cfg_get_root();
+	char *dev = librsu_cfg_get_rsu_dev();
+	__u32 crc = crc32(0, NULL, 0);
+
+	crc = crc32(crc, (void *)root, strlen(root) + 1);
+	return crc32(crc, (void *)dev, strlen(dev) + 1);
+}
+
+/**
+ * digest_final() - complete a digest computation
+ * @dg: digest state
+ * @rec: record to fill in
+ */
+static void digest_final(struct librsu_digest *dg, struct digest_record *rec)
+{
+	int x;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->magic = DIGEST_RECORD_MAGIC;
+	rec->fingerprint = dg->fingerprint;
+	rec->offset = dg->src.offset;
+	rec->size = dg->src.size;
+	rec->length = dg->length;
+	rec->target = target_id();
+
+	for (x = 0; x < RSU_DIGEST_CRC32_SZ; x++)
+		rec->crc32[x] = (__u8)(dg->crc >> (24 - x * 8));
+
+	librsu_sha256_final(&dg->sha, rec->sha256);
+}
+
+/**
+ * cache_load() - read all records from the digest cache file
+ * @path: digest cache file
+ * @recs: array of DIGEST_MAX_RECORDS records
+ *
+ * Return: number of valid records read
+ */
+static int cache_load(char *path, struct digest_record *recs)
+{
+	FILE *file;
+	int cnt = 0;
+
+	file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	while (cnt < DIGEST_MAX_RECORDS &&
+	       fread(&recs[cnt], sizeof(*recs), 1, file) == 1) {
+		if (recs[cnt].magic == DIGEST_RECORD_MAGIC)
+			cnt++;
+	}
+
+	fclose(file);
+
+	return cnt;
+}
+
+/**
+ * cache_save() - replace the digest cache file with a set of records
+ * @path: digest cache file
+ * @recs: records to save
+ * @cnt: number of records
+ *
+ * The records are written to a temporary file which is then renamed, so the
+ * cache file is never seen partially written. The caller holds the cache lock.
+ */
+static void cache_save(char *path, struct digest_record *recs, int cnt)
+{
+	char tmp_path[140];
+	FILE *file;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	file = fopen(tmp_path, "wb");
+	if (!file) {
+		librsu_log(LOW, __func__, "error: Unable to open '%s'",
+			   tmp_path);
+		return;
+	}
+
+	if (cnt && fwrite(recs, sizeof(*recs), cnt, file) != (size_t)cnt) {
+		librsu_log(LOW, __func__, "error: Unable to write '%s'",
+			   tmp_path);
+		fclose(file);
+		remove(tmp_path);
+		return;
+	}
+
+	fclose(file);
+
+	if (rename(tmp_path, path))
+		librsu_log(LOW, __func__, "error: Unable to update '%s'", path);
+}
+
+/**
+ * cache_update() - add, replace or remove the record for a slot
+ * @offset: slot offset
+ * @rec: new record for the slot, or NULL to remove it
+ */
+static void cache_update(__u64 offset, struct digest_record *rec)
+{
+	struct digest_record recs[DIGEST_MAX_RECORDS];
+	char *path = librsu_cfg_get_digest_cache();
+	__u32 target = target_id();
+	int lock;
+	int cnt;
+	int x;
+
+	if (!path)
+		return;
+
+	lock = librsu_misc_lock_file(path);
+	if (lock < 0)
+		return;
+
+	cnt = cache_load(path, recs);
+
+	for (x = 0; x < cnt; x++)
+		if (recs[x].offset == offset && recs[x].target == target)
+			break;
+
+	if (x == cnt && !rec) {
+		close(lock);
+		return;
+	}
+
+	if (rec) {
+		if (x == DIGEST_MAX_RECORDS)
+			x = 0;
+		else if (x == cnt)
+			cnt++;
+		recs[x] = *rec;
+	} else {
+		recs[x] = recs[--cnt];
+	}
+
+	cache_save(path, recs, cnt);
+
+	close(lock);
+}
+
+void librsu_digest_store(struct librsu_digest *dg)
+{
+	struct digest_record rec;
+
+	if (!librsu_cfg_get_digest_cache())
+		return;
+
+	digest_final(dg, &rec);
+
+	librsu_log(HIGH, __func__, "Recording digest for slot @0x%08llx",
+		   dg->src.offset);
+
+	cache_update(rec.offset, &rec);
+}
+
+void librsu_digest_forget(__u64 offset)
+{
+	cache_update(offset, NULL);
+}
+
+/**
+ * digest_copy() - copy the requested digest from a record
+ * @rec: record holding the digests
+ * @algo: requested digest algorithm
+ * @out: output buffer
+ */
+static void digest_copy(struct digest_record *rec, int algo, __u8 *out)
+{
+	if (algo == RSU_DIGEST_CRC32)
+		memcpy(out, rec->crc32, RSU_DIGEST_CRC32_SZ);
+	else
+		memcpy(out, rec->sha256, RSU_DIGEST_SHA256_SZ);
+}
+
+/**
+ * cache_lookup() - find a recorded digest which still matches a slot
+ * @info: slot
+ * @fingerprint: CRC32 of the first two blocks currently in the slot
+ * @rec: filled in with the matching record
+ *
+ * Return: 1 if a matching record was found, 0 otherwise
+ */
+static int cache_lookup(struct rsu_slot_info *info, __u32 fingerprint,
+			struct digest_record *rec)
+{
+	struct digest_record recs[DIGEST_MAX_RECORDS];
+	char *path = librsu_cfg_get_digest_cache();
+	__u32 target = target_id();
+	int cnt;
+	int x;
+
+	if (!path)
+		return 0;
+
+	cnt = cache_load(path, recs);
+
+	for (x = 0; x < cnt; x++) {
+		if (recs[x].target != target ||
+		    recs[x].offset != info->offset ||
+		    recs[x].size != (__u32)info->size ||
+		    recs[x].fingerprint != fingerprint)
+			continue;
+
+		*rec = recs[x];
+		return 1;
+	}
+
+	return 0;
+}
+
+int librsu_digest_slot(struct librsu_ll_intf *ll_intf, int slot, int algo,
+		       __u8 *out)
+{
+	int part_num;
+	int offset;
+	int len;
+	int x;
+	int rtn = 0;
+	char *buf = NULL;
+	struct rsu_slot_info info;
+	struct librsu_digest *dg = NULL;
+	struct digest_record rec;
+
+	if (!ll_intf)
+		return -ELIB;
+
+	if (!out || (algo != RSU_DIGEST_CRC32 && algo != RSU_DIGEST_SHA256))
+		return -EARGS;
+
+	if (rsu_slot_get_info(slot, &info)) {
+		librsu_log(HIGH, __func__, "Unable to read slot info");
+		return -ESLOTNUM;
+	}
+
+	part_num = librsu_misc_slot2part(ll_intf, slot);
+	if (part_num < 0)
+		return -ESLOTNUM;
+
+	buf = malloc(DIGEST_CHUNK_SZ);
+	dg = malloc(sizeof(*dg));
+	if (!buf || !dg) {
+		librsu_log(LOW, __func__, "error: failed to alloc buf");
+		rtn = -ELIB;
+		goto free_bufs;
+	}
+
+	if (librsu_cfg_get_digest_cache()) {
+		if (ll_intf->data.read(part_num, 0, 2 * IMAGE_BLOCK_SZ, buf)) {
+			rtn = -ELOWLEVEL;
+			goto free_bufs;
+		}
+
+		if (cache_lookup(&info, crc32(0, (void *)buf,
+					      2 * IMAGE_BLOCK_SZ), &rec)) {
+			librsu_log(MED, __func__,
+				   "Using recorded digest for slot %i", slot);
+			digest_copy(&rec, algo, out);
+			goto free_bufs;
+		}
+	}
+
+	if (librsu_digest_init(dg, &info)) {
+		rtn = -ELIB;
+		goto free_bufs;
+	}
+
+	/*
+	 * The whole slot is read: a block which looks erased may still be
+	 * part of the image. Trailing 0xFF bytes are not added to the digest.
+	 */
+	for (offset = 0; offset < info.size; offset += len) {
+		len = info.size - offset;
+		if (len > DIGEST_CHUNK_SZ)
+			len = DIGEST_CHUNK_SZ;
+
+		if (ll_intf->data.read(part_num, offset, len, buf)) {
+			rtn = -ELOWLEVEL;
+			goto free_bufs;
+		}
+
+		for (x = 0; x + IMAGE_BLOCK_SZ <= len; x += IMAGE_BLOCK_SZ) {
+			if (librsu_digest_block(dg, buf + x, IMAGE_BLOCK_SZ)) {
+				librsu_log(HIGH, __func__,
+					   "Bad image in slot %i @0x%08x",
+					   slot, offset + x);
+				rtn = -EFORMAT;
+				goto free_bufs;
+			}
+
+			if (offset + x == 0 &&
+			    dg->state.block_type != SIGNATURE_BLOCK) {
+				librsu_log(HIGH, __func__,
+					   "Slot %i does not hold a CMF image",
+					   slot);
+				rtn = -EFORMAT;
+				goto free_bufs;
+			}
+		}
+	}
+
+	digest_final(dg, &rec);
+	digest_copy(&rec, algo, out);
+
+	librsu_log(MED, __func__, "Computed digest over %i bytes of slot %i",
+		   rec.length, slot);
+
+	if (librsu_cfg_get_digest_cache())
+		cache_update(rec.offset, &rec);
+
+free_bufs:
+	free(dg);
+	free(buf);
+
+	return rtn;
+}
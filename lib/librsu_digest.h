@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Intel Copyright 2018 */
+
+#ifndef __LIBRSU_DIGEST_H__
+#define __LIBRSU_DIGEST_H__
+
+#include "librsu_image.h"
+#include "librsu_ll.h"
+#include <librsu.h>
+
+/**
+ * struct librsu_sha256 - SHA-256 computation state
+ * @h: intermediate hash value
+ * @len: number of bytes hashed so far
+ * @buf: partial input block
+ * @fill: number of bytes in the partial input block
+ */
+struct librsu_sha256 {
+	__u32 h[8];
+	__u64 len;
+	__u8 buf[64];
+	int fill;
+};
+
+/*
+ * librsu_sha256_init() - start a SHA-256 computation
+ * @sha: SHA-256 state
+ */
+void librsu_sha256_init(struct librsu_sha256 *sha);
+
+/*
+ * librsu_sha256_update() - add data to a SHA-256 computation
+ * @sha: SHA-256 state
+ * @data: data to add
+ * @len: number of bytes
+ */
+void librsu_sha256_update(struct librsu_sha256 *sha, const __u8 *data,
+			  int len);
+
+/*
+ * librsu_sha256_final() - complete a SHA-256 computation
+ * @sha: SHA-256 state
+ * @out: buffer for the RSU_DIGEST_SHA256_SZ bytes of the digest
+ */
+void librsu_sha256_final(struct librsu_sha256 *sha, __u8 *out);
+
+/**
+ * struct librsu_digest - state of a slot digest computation
+ * @state: image parsing state, used to normalize the pointers
+ * @src: slot the image is stored in
+ * @dst: slot starting at offset zero, which pointers are normalized to
+ * @sha: SHA-256 state
+ * @crc: CRC32 state
+ * @fingerprint: CRC32 of the first two image blocks, as stored in flash
+ * @pending: number of 0xFF bytes seen but not yet added to the digest
+ * @length: number of bytes added to the digest
+ * @block: copy of the current block, as normalized
+ */
+struct librsu_digest {
+	struct rsu_image_state state;
+	struct rsu_slot_info src;
+	struct rsu_slot_info dst;
+	struct librsu_sha256 sha;
+	__u32 crc;
+	__u32 fingerprint;
+	int pending;
+	int length;
+	char block[IMAGE_BLOCK_SZ];
+};
+
+/*
+ * librsu_digest_init() - start a digest computation for an image in a slot
+ * @dg: digest state
+ * @info: slot the image is stored in
+ *
+ * Returns 0 on success, or -1 on error
+ */
+int librsu_digest_init(struct librsu_digest *dg, struct rsu_slot_info *info);
+
+/*
+ * librsu_digest_block() - add an image block to a digest
+ * @dg: digest state
+ * @block: image block, as stored in flash
+ * @len: number of valid bytes in the block, the rest is treated as erased
+ *
+ * Returns 0 on success, or -1 if the block can not be parsed
+ */
+int librsu_digest_block(struct librsu_digest *dg, void *block, int len);
+
+/*
+ * librsu_digest_store() - record the digest of an image just programmed
+ * @dg: digest state, after all the image blocks were added
+ *
+ * Does nothing unless a digest cache file is configured.
+ */
+void librsu_digest_store(struct librsu_digest *dg);
+
+/*
+ * librsu_digest_forget() - drop the recorded digest for a slot
+ * @offset: offset of the slot which is being erased
+ */
+void librsu_digest_forget(__u64 offset);
+
+/*
+ * librsu_digest_slot() - get the digest of the image stored in a slot
+ * @ll_intf: low level interface
+ * @slot: slot number
+ * @algo: RSU_DIGEST_CRC32 or RSU_DIGEST_SHA256
+ * @out: buffer for the digest
+ *
+ * The recorded digest is used when it matches the slot contents, otherwise
+ * the image is read back and the digest recorded for next time.
+ *
+ * Returns 0 on success, or Error Code
+ */
+int librsu_digest_slot(struct librsu_ll_intf *ll_intf, int slot, int algo,
+		       __u8 *out);
+
+#endif
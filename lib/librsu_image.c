@@ -107,7 +107,7 @@ static int sig_block_process(struct rsu_image_state *state,	void *block,
 	/* Determine if absolute image - only done for 2nd block in an image
 	 * which is always a signature block
 	 */
-	if (state->offset == IMAGE_BLOCK_SZ)
+	if (state->offset == IMAGE_BLOCK_SZ && !state->absolute)
 		for (x = 0; x < 4; x++)
 			if (ptr_blk->ptrs[x] > (__u64)info->size) {
 				state->absolute = 1;
@@ -130,19 +130,18 @@ static int sig_block_process(struct rsu_image_state *state,	void *block,
 }
 
 /**
- * sig_block_adjust() - adjust signature block pointers before writing to flash
+ * sig_block_check() - check signature block CRC and pointers
  * @state: current state machine state
  * @block: signature block
- * @info: slot where the data will be written
+ * @info: slot where the data will be written, or was read from
  *
- * This function checks that the section pointers are consistent, and for non-
- * absolute images it updates them to match the destination slot, also re-
- * computing the CRC.
+ * This function checks the CRC of the signature block, and that all the
+ * section pointers are within the slot.
  *
  * Return: zero value for success, or negative value on error
  */
-static int sig_block_adjust(struct rsu_image_state *state, void *block,
-			    struct rsu_slot_info *info)
+static int sig_block_check(struct rsu_image_state *state, void *block,
+			   struct rsu_slot_info *info)
 {
 	__u32 calc_crc;
 	int x;
@@ -161,6 +160,7 @@ static int sig_block_adjust(struct rsu_image_state *state, void *block,
 		librsu_log(LOW, __func__,
 			   "Error: Bad CRC32. Calc = %08X / From Block = %08x",
 			   calc_crc, swap_endian32(ptr_blk->crc));
+		swap_bits(block, IMAGE_BLOCK_SZ);
 		return -1;
 	}
 	swap_bits(block, IMAGE_BLOCK_SZ);
@@ -175,23 +175,35 @@ static int sig_block_adjust(struct rsu_image_state *state, void *block,
 		if (state->absolute)
 			ptr -= info->offset;
 
-		if (ptr > info->size) {
+		if (ptr < 0 || ptr > info->size) {
 			librsu_log(LOW, __func__,
 				   "Error: A pointer not within the slot");
 			return -1;
 		}
 	}
 
-	/* Absolute images do not require pointer updates */
-	if (state->absolute)
-		return 0;
+	return 0;
+}
+
+/**
+ * sig_block_update() - move signature block pointers and update the CRC
+ * @block: signature block
+ * @delta: value to be added to all the non-zero pointers
+ */
+static void sig_block_update(void *block, __s64 delta)
+{
+	__u32 calc_crc;
+	int x;
+	char *data = (char *)block;
+	struct pointer_block *ptr_blk = (struct pointer_block *)(data
+					+ SIG_BLOCK_PTR_OFFS);
 
 	/* Update pointers */
 	for (x = 0; x < 4; x++) {
 		if (ptr_blk->ptrs[x]) {
 			__u64 old =  ptr_blk->ptrs[x];
 
-			ptr_blk->ptrs[x] += info->offset;
+			ptr_blk->ptrs[x] += delta;
 			librsu_log(HIGH, __func__,
 				   "Adjusting pointer 0x%llx -> 0x%llx.",
 				   old, ptr_blk->ptrs[x]);
@@ -203,6 +215,31 @@ static int sig_block_adjust(struct rsu_image_state *state, void *block,
 	calc_crc = crc32(0, block, SIG_BLOCK_CRC_OFFS);
 	ptr_blk->crc = swap_endian32(calc_crc);
 	swap_bits(block, IMAGE_BLOCK_SZ);
+}
+
+/**
+ * sig_block_adjust() - adjust signature block pointers before writing to flash
+ * @state: current state machine state
+ * @block: signature block
+ * @info: slot where the data will be written
+ *
+ * This function checks that the section pointers are consistent, and for non-
+ * absolute images it updates them to match the destination slot, also re-
+ * computing the CRC.
+ *
+ * Return: zero value for success, or negative value on error
+ */
+static int sig_block_adjust(struct rsu_image_state *state, void *block,
+			    struct rsu_slot_info *info)
+{
+	if (sig_block_check(state, block, info))
+		return -1;
+
+	/* Absolute images do not require pointer updates */
+	if (state->absolute)
+		return 0;
+
+	sig_block_update(block, info->offset);
 
 	return 0;
 }
@@ -249,11 +286,7 @@ static int block_compare(struct rsu_image_state *state, void *block,
 static int sig_block_compare(struct rsu_image_state *state, void *ublock,
 			     void *vblock, struct rsu_slot_info *info)
 {
-	__u32 calc_crc;
-	int x;
 	char block[IMAGE_BLOCK_SZ];
-	struct pointer_block *ptr_blk = (struct pointer_block *)(block +
-		SIG_BLOCK_PTR_OFFS);
 
 	librsu_log(HIGH, __func__, "Comparing signature block @0x%08x",
 		   state->offset);
@@ -262,19 +295,8 @@ static int sig_block_compare(struct rsu_image_state *state, void *ublock,
 	memcpy(block, ublock, IMAGE_BLOCK_SZ);
 
 	/* Update signature block to match what we expect in flash */
-	if (!state->absolute) {
-
-		/* Update pointers */
-		for (x = 0; x < 4; x++)
-			if (ptr_blk->ptrs[x])
-				ptr_blk->ptrs[x] += info->offset;
-
-		/* Update CRC in block */
-		swap_bits(block, IMAGE_BLOCK_SZ);
-		calc_crc = crc32(0, (unsigned char *)block, SIG_BLOCK_CRC_OFFS);
-		ptr_blk->crc = swap_endian32(calc_crc);
-		swap_bits(block, IMAGE_BLOCK_SZ);
-	}
+	if (!state->absolute)
+		sig_block_update(block, info->offset);
 
 	return block_compare(state, block, vblock);
 }
@@ -345,3 +367,121 @@ int librsu_image_block_process(struct rsu_image_state *state, void *block,
 
 	return 0;
 }
+
+int librsu_image_next_block_modified(struct rsu_image_state *state)
+{
+	if (find_section(state, state->offset + IMAGE_BLOCK_SZ))
+		return 0;
+
+	return state->block_type == SIGNATURE_BLOCK;
+}
+
+/**
+ * block_scan() - process an image block read back from a slot
+ * @state: current state machine state
+ * @block: image block, as stored in flash
+ * @info: slot the block was read from
+ * @type: set to the type of the processed block
+ *
+ * Return: zero value for success, or negative value on error
+ */
+static int block_scan(struct rsu_image_state *state, void *block,
+		      struct rsu_slot_info *info, enum rsu_block_type *type)
+{
+	/* Pointers stored in flash always include the slot offset */
+	state->absolute = 1;
+	state->offset += IMAGE_BLOCK_SZ;
+
+	if (find_section(state, state->offset))
+		state->block_type = SECTION_BLOCK;
+
+	*type = state->block_type;
+
+	switch (state->block_type) {
+
+	case SECTION_BLOCK:
+		if (*(__u32 *)block == CMF_MAGIC) {
+			librsu_log(HIGH, __func__, "Found CMF section @0x%08x.",
+				   state->offset);
+			state->block_type = SIGNATURE_BLOCK;
+		} else {
+			state->block_type = REGULAR_BLOCK;
+		}
+		break;
+
+	case SIGNATURE_BLOCK:
+		librsu_log(HIGH, __func__, "Found signature block @0x%08x.",
+			   state->offset);
+
+		state->block_type = REGULAR_BLOCK;
+
+		if (sig_block_check(state, block, info))
+			return -1;
+
+		if (sig_block_process(state, block, info))
+			return -1;
+		break;
+
+	case REGULAR_BLOCK:
+		break;
+	}
+
+	return 0;
+}
+
+int librsu_image_block_scan(struct rsu_image_state *state, void *block,
+			    struct rsu_slot_info *info)
+{
+	enum rsu_block_type type;
+
+	return block_scan(state, block, info, &type);
+}
+
+int librsu_image_block_relocate(struct rsu_image_state *state, void *block,
+				struct rsu_slot_info *src,
+				struct rsu_slot_info *dst)
+{
+	enum rsu_block_type type;
+	char *data = (char *)block;
+	struct pointer_block *ptr_blk = (struct pointer_block *)(data
+					+ SIG_BLOCK_PTR_OFFS);
+	int x;
+
+	if (block_scan(state, block, src, &type))
+		return -1;
+
+	if (type != SIGNATURE_BLOCK)
+		return 0;
+
+	for (x = 0; x < 4; x++) {
+		if (!ptr_blk->ptrs[x])
+			continue;
+
+		if (ptr_blk->ptrs[x] - src->offset > (__u64)dst->size) {
+			librsu_log(LOW, __func__,
+				   "Error: A pointer not within the slot");
+			return -1;
+		}
+	}
+
+	sig_block_update(block, dst->offset - src->offset);
+
+	return 0;
+}
+
+int librsu_image_is_section(struct rsu_image_state *state, __u64 offset)
+{
+	return find_section(state, offset);
+}
+
+__u64 librsu_image_last_section(struct rsu_image_state *state)
+{
+	__u64 last = 0;
+	int x;
+
+	for (x = 0; x < state->no_sections; x++)
+		if (state->sections[x] > last)
+			last = state->sections[x];
+
+	return last;
+}
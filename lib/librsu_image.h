@@ -92,4 +92,74 @@ int librsu_image_block_init(struct rsu_image_state *state);
 int librsu_image_block_process(struct rsu_image_state *state, void *block,
 			       void *vblock, struct rsu_slot_info *info);
 
+/*
+ * librsu_image_block_scan() - process image blocks read back from a slot
+ *
+ * @state: current state machine state
+ * @block: pointer to current 4KB image block, as stored in flash
+ * @info: rsu_slot_info structure for the slot the block was read from
+ *
+ * Image blocks are parsed without being modified, to identify the sections of
+ * the image already stored in the slot. Signature blocks are checked for CRC
+ * and pointer consistency as they are found.
+ *
+ * Returns 0 on success and -1 on error
+ */
+int librsu_image_block_scan(struct rsu_image_state *state, void *block,
+			    struct rsu_slot_info *info);
+
+/*
+ * librsu_image_block_relocate() - relocate image blocks from one slot to another
+ *
+ * @state: current state machine state
+ * @block: pointer to current 4KB image block, as stored in the source slot
+ * @src: rsu_slot_info structure for the slot the block was read from
+ * @dst: rsu_slot_info structure for the slot the block will be written to
+ *
+ * Image blocks are parsed as for librsu_image_block_scan(). The pointers in
+ * signature blocks are moved from the source slot to the destination slot,
+ * and the signature block CRC is re-computed.
+ *
+ * Returns 0 on success and -1 on error
+ */
+int librsu_image_block_relocate(struct rsu_image_state *state, void *block,
+				struct rsu_slot_info *src,
+				struct rsu_slot_info *dst);
+
+/*
+ * librsu_image_next_block_modified() - check if the next block is changed by
+ *                                      librsu_image_block_process()
+ *
+ * @state: current state machine state
+ *
+ * Only signature blocks have their pointers adjusted, and are temporarily
+ * modified while being checked; other blocks are only read.
+ *
+ * Returns 1 if the next block may be modified, 0 otherwise
+ */
+int librsu_image_next_block_modified(struct rsu_image_state *state);
+
+/*
+ * librsu_image_is_section() - check if an offset starts an identified section
+ *
+ * @state: current state machine state
+ * @offset: offset in the image
+ *
+ * Returns 1 if a section starts at the offset, 0 otherwise
+ */
+int librsu_image_is_section(struct rsu_image_state *state, __u64 offset);
+
+/*
+ * librsu_image_last_section() - get offset of the last identified section
+ *
+ * @state: current state machine state
+ *
+ * Once the state machine has processed the block at this offset, no further
+ * sections are expected, so the first blank block after it marks the end of
+ * the image.
+ *
+ * Returns the highest section offset identified so far
+ */
+__u64 librsu_image_last_section(struct rsu_image_state *state);
+
 #endif
@@ -28,6 +28,10 @@ struct librsu_ll_intf {
 
 	struct {
 		int (*count)(void);
+		int (*slots)(void);
+		int (*slot2part)(int slot);
+		int (*part2slot)(int part_num);
+		int (*by_name)(char *name);
 		char *(*name)(int part_num);
 		__s64 (*offset)(int part_num);
 		__s64 (*factory_offset)(void);
@@ -43,12 +47,14 @@ struct librsu_ll_intf {
 		int (*get)(int part_num);
 		int (*add)(int part_num);
 		int (*remove)(int part_num);
+		int (*set_order)(int *parts, int count);
 	} priority;
 
 	struct {
 		int (*read)(int part_num, int offset, int bytes, void *buf);
 		int (*write)(int part_num, int offset, int bytes, void *buf);
 		int (*erase)(int part_num);
+		int (*erase_range)(int part_num, int offset, int bytes);
 	} data;
 
 	struct {
@@ -59,6 +65,7 @@ struct librsu_ll_intf {
 
 	struct {
 		int (*empty)(void);
+		int (*compact)(int threshold);
 		int (*restore)(char *name);
 		int (*save)(char *name);
 		int (*corrupted)(void);
@@ -71,4 +78,8 @@ struct librsu_ll_intf {
 int librsu_ll_open_datafile(struct librsu_ll_intf **intf);
 int librsu_ll_open_qspi(struct librsu_ll_intf **intf);
 
+void *librsu_ll_qspi_state_new(void);
+void librsu_ll_qspi_state_free(void *state);
+void librsu_ll_qspi_state_select(void *state);
+
 #endif
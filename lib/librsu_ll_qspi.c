@@ -14,6 +14,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -26,39 +27,139 @@
 #define CPB_IMAGE_PTR_NSLOTS	508
 
 #define FACTORY_IMAGE_NAME	"FACTORY_IMAGE"
+
+#define NAME_HASH_SZ	256
+
 /*
- * Offsets within MTD device node for SPTx tables. By definition,
- * SPT0 it at the start of the MTD device node.
+ * Persistent copy of the SPT and CPB, kept in the file named by the
+ * metadata-cache option so that short lived processes do not have to read
+ * and check both copies of each table from flash. It is only saved when both
+ * copies of each table were found good and identical, and it is only trusted
+ * for the same boot, flash configuration and RSU state, and while SPT0 and
+ * CPB0 still read back the same from flash. Every SPT or CPB update made
+ * through this library removes the file. Saving and removing the file are
+ * serialized between processes with a lock on a companion '.lock' file.
  */
-static __u32	spt0_offset;
-static __u32	spt1_offset = 32 * 1024;
-static __u64 spt0_address;
-static __u64 spt1_address;
+#define METADATA_CACHE_MAGIC	0x43445352
+#define METADATA_SPT_HEAD	offsetof(struct SUB_PARTITION_TABLE, partition)
+
+struct metadata_key {
+	char boot_id[40];
+	__u64 state;
+	__u32 root_crc;
+	__u32 spt0_offset;
+	__u32 spt1_offset;
+	__u32 flash_count;
+	struct mtd_info_user dev_info[QSPI_MAX_DEVICE];
+};
 
-/* data struct ptr for multiflash */
-static struct spi_flash_list *flash_list;
-static struct spi_flash_info *flash_info;
+struct metadata_cache {
+	__u32 magic;
+	__u32 crc;
+	struct metadata_key key;
+	char spt_data[SPT_SIZE];
+	char cpb_data[CPB_SIZE];
+};
 
 /*
- * set to cpb_corrupted flag to true in below case:
- * 1). reported by firmware
- * 2). both CPBs are not same
+ * All the state of an open QSPI or datafile root. Each library context has
+ * its own, selected for the calling thread by librsu_ll_qspi_state_select().
  */
-static bool cpb_corrupted;
-static bool cpb_fixed;
+struct qspi_state {
+	/* shared ops, along with the flash data of this context */
+	struct librsu_ll_intf intf;
+
+	/*
+	 * Offsets within MTD device node for SPTx tables. By definition,
+	 * SPT0 it at the start of the MTD device node.
+	 */
+	__u32 spt0_offset;
+	__u32 spt1_offset;
+	__u64 spt0_address;
+	__u64 spt1_address;
+
+	/* data struct ptr for multiflash */
+	struct spi_flash_list *flash_list;
+	struct spi_flash_info *flash_info;
+
+	/*
+	 * set to cpb_corrupted flag to true in below case:
+	 * 1). reported by firmware
+	 * 2). both CPBs are not same
+	 */
+	bool cpb_corrupted;
+	bool cpb_fixed;
+
+	struct SUB_PARTITION_TABLE spt;
+	__u64 mtd_part_offset;
+	bool spt_corrupted;
+
+	/*
+	 * Slot numbering and partition name lookup tables, derived from the
+	 * SPT on first use and dropped whenever the SPT changes. The name hash
+	 * uses open addressing and stores partition numbers plus one, with
+	 * zero for unused.
+	 */
+	int slot_part[SPT_MAX_PARTITIONS];
+	int part_slot[SPT_MAX_PARTITIONS];
+	int slot_cnt;
+	int name_hash[NAME_HASH_SZ];
+	bool slot_index_valid;
+
+	/*
+	 * Both SPT copies as read from flash by load_spt(), so they are only
+	 * read once, and compared before check_spt() edits the names in the
+	 * working copy.
+	 */
+	char spt0_data[SPT_SIZE];
+	char spt1_data[SPT_SIZE];
+	bool spt_pair_good;
+
+	union CMF_POINTER_BLOCK cpb __attribute__((__aligned__(8)));
+	CMF_POINTER *cpb_slots;
+	int cpb0_part;
+	int cpb1_part;
+
+	/*
+	 * Priority of each partition, derived from the CPB on first use and
+	 * dropped whenever the CPB or the SPT changes, so priority queries do
+	 * not scan all the CPB pointers. part_by_offset holds the partition
+	 * numbers sorted by offset, to map CPB pointers back to partitions.
+	 */
+	int part_priority[SPT_MAX_PARTITIONS];
+	int part_by_offset[SPT_MAX_PARTITIONS];
+	bool priority_index_valid;
+
+	/* Both CPB copies as read from flash by load_cpb(), read only once */
+	char cpb0_data[CPB_SIZE];
+	char cpb1_data[CPB_SIZE];
+	bool cpb_pair_good;
+
+	struct metadata_cache metadata;
+};
 
+static struct qspi_state qspi_default = {
+	.spt1_offset = 32 * 1024,
+	.cpb0_part = -1,
+	.cpb1_part = -1,
+};
+
+static _Thread_local struct qspi_state *qs = &qspi_default;
 static int load_cpb(void);
+static void metadata_cache_drop(void);
+static void priority_index_reset(void);
+static void spt_index_reset(void);
 
 static int get_current_flash_offset(off_t offset, int *current_flash, int *current_offset)
 {
 	if (!current_flash || !current_offset)
 		return -1;
 
-	if (offset >= flash_list->dev_info[0].size) {
+	if (offset >= qs->flash_list->dev_info[0].size) {
 		/* get current flash offset to perform ops */
-		*current_offset = ((offset + spt0_address) % (flash_list->dev_info[0].size + spt0_address));
+		*current_offset = ((offset + qs->spt0_address) % (qs->flash_list->dev_info[0].size + qs->spt0_address));
 		/* get current flash to perform ops */
-		*current_flash = (offset + spt0_address) / (flash_list->dev_info[0].size + spt0_address);
+		*current_flash = (offset + qs->spt0_address) / (qs->flash_list->dev_info[0].size + qs->spt0_address);
 	}
 	else
 	{
@@ -85,9 +186,9 @@ static int read_dev(off_t offset, void *buf, int len)
 	if (rtn)
 		return rtn;
 
-	for (int i = current_flash; i < flash_list->flash_count; i++) {
+	for (int i = current_flash; i < qs->flash_list->flash_count; i++) {
 		cnt = 0;
-		flash_size = flash_list->dev_info[i].size;
+		flash_size = qs->flash_list->dev_info[i].size;
 
 		/* all data has completed */
 		if (count == len)
@@ -101,10 +202,10 @@ static int read_dev(off_t offset, void *buf, int len)
 			current_len = len - count;
 		}
 
-		if (flash_list->dev_file[i] < 0)
+		if (qs->flash_list->dev_file[i] < 0)
 			return -1;
 
-		file_ptr = flash_list->dev_file[i];
+		file_ptr = qs->flash_list->dev_file[i];
 		if (lseek(file_ptr, current_offset, SEEK_SET) != current_offset)
 			return -1;
 
@@ -153,9 +254,9 @@ static int write_dev(off_t offset, void *buf, int len)
 	if (rtn)
 		return rtn;
 
-	for (int i = current_flash; i < flash_list->flash_count; i++) {
+	for (int i = current_flash; i < qs->flash_list->flash_count; i++) {
 		cnt = 0;
-		flash_size = flash_list->dev_info[i].size;
+		flash_size = qs->flash_list->dev_info[i].size;
 
 		/* all data has completed */
 		if (count == len)
@@ -169,10 +270,10 @@ static int write_dev(off_t offset, void *buf, int len)
 			current_len = len - count;
 		}
 
-		if (flash_list->dev_file[i] < 0)
+		if (qs->flash_list->dev_file[i] < 0)
 			return -1;
 
-		file_ptr = flash_list->dev_file[i];
+		file_ptr = qs->flash_list->dev_file[i];
 		if (lseek(file_ptr, current_offset, SEEK_SET) != current_offset)
 			return -1;
 
@@ -208,11 +309,15 @@ static int write_dev(off_t offset, void *buf, int len)
 /*
  * Simulate a flash erase on a datafile by overwriting area with fill data.
  * This is not performed on an MTD device. It is called when erasesize == 0.
+ * @done is the count of bytes already erased, for progress reporting when
+ * @report is set.
  */
-static int erase_with_fill(off_t offset, int len, int dev_file_ptr)
+static int erase_with_fill(off_t offset, int len, int dev_file_ptr, int done,
+			   int report)
 {
 	char fill[4 * 1024];
 	int cnt;
+	int end;
 
 	if (lseek(dev_file_ptr, offset, SEEK_SET) != offset)
 		return -1;
@@ -222,12 +327,27 @@ static int erase_with_fill(off_t offset, int len, int dev_file_ptr)
 	for (cnt = 0; cnt < len; cnt += sizeof(fill)) {
 		if (write_dev(offset + cnt, fill, sizeof(fill)))
 			return -1;
+
+		/* the last piece may go past the end of the erase */
+		end = cnt + (int)sizeof(fill);
+		if (report)
+			librsu_misc_progress(done + (end < len ? end : len));
 	}
 
 	return 0;
 }
 
-static int erase_dev(off_t offset, int len)
+/*
+ * Erase requests are split so that the progress of long erases can be
+ * reported; each piece is still a whole number of erase blocks.
+ */
+#define ERASE_CHUNK_SZ	(1024 * 1024)
+
+/*
+ * The progress of slot erases is reported when @report is set, but not the
+ * one of the SPT/CPB erases, which can happen within other operations.
+ */
+static int erase_dev(off_t offset, int len, int report)
 {
 	struct erase_info_user erase;
 	int rtn;
@@ -237,13 +357,15 @@ static int erase_dev(off_t offset, int len)
 	int count = 0;
 	int file_ptr = 0;
 	int flash_size = 0;
+	__u32 chunk;
+	int pos;
 
 	rtn = get_current_flash_offset(offset, &current_flash, &current_offset);
 	if (rtn)
 		return rtn;
 
-	for (int i = current_flash; i < flash_list->flash_count; i++) {
-		flash_size = flash_list->dev_info[i].size;
+	for (int i = current_flash; i < qs->flash_list->flash_count; i++) {
+		flash_size = qs->flash_list->dev_info[i].size;
 
 		/* all data has completed */
 		if (count == len)
@@ -257,37 +379,53 @@ static int erase_dev(off_t offset, int len)
 			current_len = len - count;
 		}
 
-		if (flash_list->dev_file[i] < 0)
+		if (qs->flash_list->dev_file[i] < 0)
 			return -1;
 
-		file_ptr = flash_list->dev_file[i];
+		file_ptr = qs->flash_list->dev_file[i];
 
-		if (flash_list->dev_info[i].erasesize == 0)
-			return erase_with_fill(current_offset, current_len, file_ptr);
+		if (qs->flash_list->dev_info[i].erasesize == 0)
+			return erase_with_fill(current_offset, current_len,
+					       file_ptr, count, report);
 
-		if (current_offset % flash_list->dev_info[i].erasesize) {
+		if (current_offset % qs->flash_list->dev_info[i].erasesize) {
 			librsu_log(LOW, __func__,
 			   "error: Erase offset 0x08%x not erase block aligned",
 			   current_offset);
 			return -1;
 		}
 
-		if (current_len % flash_list->dev_info[i].erasesize) {
+		if (current_len % qs->flash_list->dev_info[i].erasesize) {
 			librsu_log(LOW, __func__,
 				   "error: Erase length %i not erase block aligned",
 				   current_len);
 			return -1;
 		}
 
-		erase.start = current_offset;
-		erase.length = current_len;
+		chunk = ERASE_CHUNK_SZ - ERASE_CHUNK_SZ %
+			qs->flash_list->dev_info[i].erasesize;
+		if (!chunk)
+			chunk = qs->flash_list->dev_info[i].erasesize;
+
+		for (pos = 0; pos < current_len; pos += erase.length) {
+			erase.start = current_offset + pos;
+			erase.length = current_len - pos;
+			if (erase.length > chunk)
+				erase.length = chunk;
 
-		rtn = ioctl(flash_list->dev_file[i], MEMERASE, &erase);
+			rtn = ioctl(qs->flash_list->dev_file[i], MEMERASE,
+				    &erase);
 
-		if (rtn < 0) {
-			librsu_log(LOW, __func__, "error: Erase error (errno=%i)",
+			if (rtn < 0) {
+				librsu_log(LOW, __func__,
+					   "error: Erase error (errno=%i)",
 					   errno);
-			return -1;
+				return -1;
+			}
+
+			if (report)
+				librsu_misc_progress(count + pos +
+						     erase.length);
 		}
 
 		/* set to 0 for new flash and add the current data count */
@@ -297,9 +435,61 @@ static int erase_dev(off_t offset, int len)
 	return 0;
 }
 
-static struct SUB_PARTITION_TABLE spt;
-static __u64 mtd_part_offset;
-static bool spt_corrupted;
+static void spt_index_reset(void)
+{
+	qs->slot_index_valid = false;
+	priority_index_reset();
+}
+
+static unsigned int name_hash_key(char *name)
+{
+	unsigned int hash = 2166136261u;
+	int x;
+
+	for (x = 0; x < (int)sizeof(qs->spt.partition[0].name) && name[x];
+	     x++) {
+		hash ^= (unsigned char)name[x];
+		hash *= 16777619u;
+	}
+
+	return hash & (NAME_HASH_SZ - 1);
+}
+
+/**
+ * slot_index_build() - compute the slot numbering and the name hash
+ *
+ * Slots are the partitions which are neither reserved nor readonly, and do
+ * not use a reserved name, numbered in SPT order.
+ */
+static void slot_index_build(void)
+{
+	unsigned int key;
+	int x;
+
+	qs->slot_cnt = 0;
+	memset(qs->name_hash, 0, sizeof(qs->name_hash));
+
+	for (x = 0; x < qs->spt.partitions; x++) {
+		qs->part_slot[x] = -1;
+
+		key = name_hash_key(qs->spt.partition[x].name);
+		while (qs->name_hash[key])
+			key = (key + 1) & (NAME_HASH_SZ - 1);
+		qs->name_hash[key] = x + 1;
+
+		if (qs->spt.partition[x].flags &
+		    (SPT_FLAG_RESERVED | SPT_FLAG_READONLY))
+			continue;
+
+		if (librsu_misc_is_rsvd_name(qs->spt.partition[x].name))
+			continue;
+
+		qs->part_slot[x] = qs->slot_cnt;
+		qs->slot_part[qs->slot_cnt++] = x;
+	}
+
+	qs->slot_index_valid = true;
+}
 
 static int save_spt_to_file(char *name)
 {
@@ -323,7 +513,7 @@ static int save_spt_to_file(char *name)
 		return -1;
 	}
 
-	ret = read_dev(spt0_offset, spt_data, SPT_SIZE);
+	ret = read_dev(qs->spt0_offset, spt_data, SPT_SIZE);
 	if (ret) {
 		librsu_log(LOW, __func__, "failed to read SPT data");
 		goto ops_error;
@@ -354,7 +544,7 @@ ops_error:
 
 static int corrupted_spt(void)
 {
-	return spt_corrupted;
+	return qs->spt_corrupted;
 }
 
 /**
@@ -366,13 +556,15 @@ static int corrupted_spt(void)
  */
 static int get_part_offset(int part_num, off_t *offset)
 {
-	if (part_num < 0 || part_num >= spt.partitions || mtd_part_offset == 0)
+	if (part_num < 0 || part_num >= qs->spt.partitions ||
+	    qs->mtd_part_offset == 0)
 		return -1;
 
-	if (spt.partition[part_num].offset < (__s64)mtd_part_offset)
+	if (qs->spt.partition[part_num].offset < (__s64)qs->mtd_part_offset)
 		return -1;
 
-	*offset = (off_t)(spt.partition[part_num].offset - mtd_part_offset);
+	*offset = (off_t)(qs->spt.partition[part_num].offset -
+			  qs->mtd_part_offset);
 
 	return 0;
 }
@@ -385,7 +577,7 @@ static int check_spt(void)
 {
 	int x;
 	int y;
-	unsigned int max_len = sizeof(spt.partition[0].name);
+	unsigned int max_len = sizeof(qs->spt.partition[0].name);
 	__u32 calc_crc;
 	char *spt_data;
 
@@ -397,7 +589,7 @@ static int check_spt(void)
 	librsu_log(HIGH, __func__, "MAX length of a name = %i bytes",
 		   max_len - 1);
 
-	if (spt.version > SPT_VERSION &&
+	if (qs->spt.version > SPT_VERSION &&
 	    librsu_cfg_spt_checksum_enabled()) {
 		librsu_log(HIGH, __func__,
 			   "check SPT checksum...\n");
@@ -408,14 +600,14 @@ static int check_spt(void)
 			return -1;
 		}
 
-		memcpy(spt_data, &spt, SPT_SIZE);
+		memcpy(spt_data, &qs->spt, SPT_SIZE);
 		memset(spt_data + SPT_CHECKSUM_OFFSET,
-		       0, sizeof(spt.checksum));
+		       0, sizeof(qs->spt.checksum));
 
 		/* calculate the checksum */
 		swap_bits(spt_data, SPT_SIZE);
 		calc_crc = crc32(0, (void *)spt_data, SPT_SIZE);
-		if (swap_endian32(spt.checksum) != calc_crc) {
+		if (swap_endian32(qs->spt.checksum) != calc_crc) {
 			librsu_log(LOW, __func__,
 				   "Error, bad SPT checksum\n");
 			free(spt_data);
@@ -425,25 +617,26 @@ static int check_spt(void)
 		free(spt_data);
 	}
 
-	if (spt.partitions > SPT_MAX_PARTITIONS) {
+	if (qs->spt.partitions > SPT_MAX_PARTITIONS) {
 		librsu_log(LOW, __func__, "bigger than max partition\n");
 		return -1;
 	}
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strnlen(spt.partition[x].name, max_len) >= max_len)
-			spt.partition[x].name[max_len - 1] = '\0';
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strnlen(qs->spt.partition[x].name, max_len) >= max_len)
+			qs->spt.partition[x].name[max_len - 1] = '\0';
 
 		librsu_log(HIGH, __func__,
 			   "offset=0x%016llx, length=0x%08x\n",
-			   spt.partition[x].offset,
-			   spt.partition[x].length);
+			   qs->spt.partition[x].offset,
+			   qs->spt.partition[x].length);
 
 		/* check if the partition is overlap */
-		__u64 s_start = spt.partition[x].offset;
-		__u64 s_end = spt.partition[x].offset + spt.partition[x].length;
+		__u64 s_start = qs->spt.partition[x].offset;
+		__u64 s_end = qs->spt.partition[x].offset +
+			      qs->spt.partition[x].length;
 
-		for (y = 0; y < spt.partitions; y++) {
+		for (y = 0; y < qs->spt.partitions; y++) {
 			if (x == y)
 				continue;
 
@@ -451,16 +644,16 @@ static int check_spt(void)
 			 * don't allow the same partition name to appear
 			 * more than once
 			 */
-			if (!(strcmp(spt.partition[x].name,
-				     spt.partition[y].name))) {
+			if (!(strcmp(qs->spt.partition[x].name,
+				     qs->spt.partition[y].name))) {
 				librsu_log(LOW, __func__,
 					   "partition name appears more than once");
 				return -1;
 			}
 
-			__u64 d_start = spt.partition[y].offset;
-			__u64 d_end = spt.partition[y].offset +
-				      spt.partition[y].length;
+			__u64 d_start = qs->spt.partition[y].offset;
+			__u64 d_end = qs->spt.partition[y].offset +
+				      qs->spt.partition[y].length;
 
 			if ((s_start < d_end) && (s_end > d_start)) {
 				librsu_log(LOW, __func__,
@@ -471,18 +664,20 @@ static int check_spt(void)
 		}
 
 		librsu_log(HIGH, __func__, "%-16s %016llX - %016llX (%X)",
-			   spt.partition[x].name, spt.partition[x].offset,
-			   (spt.partition[x].offset + spt.partition[x].length -
-			    1), spt.partition[x].flags);
+			   qs->spt.partition[x].name,
+			   qs->spt.partition[x].offset,
+			   (qs->spt.partition[x].offset +
+			    qs->spt.partition[x].length - 1),
+			   qs->spt.partition[x].flags);
 
 
-		if (strcmp(spt.partition[x].name, "SPT0") == 0)
+		if (strcmp(qs->spt.partition[x].name, "SPT0") == 0)
 			spt0_found = 1;
-		else if (strcmp(spt.partition[x].name, "SPT1") == 0)
+		else if (strcmp(qs->spt.partition[x].name, "SPT1") == 0)
 			spt1_found = 1;
-		else if (strcmp(spt.partition[x].name, "CPB0") == 0)
+		else if (strcmp(qs->spt.partition[x].name, "CPB0") == 0)
 			cpb0_found = 1;
-		else if (strcmp(spt.partition[x].name, "CPB1") == 0)
+		else if (strcmp(qs->spt.partition[x].name, "CPB1") == 0)
 			cpb1_found = 1;
 	}
 
@@ -499,9 +694,9 @@ static int load_spt0_offset(void)
 {
 	int x;
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strcmp(spt.partition[x].name, "SPT0") == 0) {
-			mtd_part_offset = spt.partition[x].offset;
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strcmp(qs->spt.partition[x].name, "SPT0") == 0) {
+			qs->mtd_part_offset = qs->spt.partition[x].offset;
 			return 0;
 		}
 	}
@@ -511,44 +706,30 @@ static int load_spt0_offset(void)
 	return -1;
 }
 
-static int check_both_spt(void)
+/**
+ * load_spt_copy() - check one of the SPT copies read by load_spt()
+ * @data: SPT copy
+ *
+ * The copy becomes the working SPT.
+ *
+ * Return: zero value for a good copy, or negative value otherwise
+ */
+static int load_spt_copy(char *data)
 {
-	int ret;
-	char *spt0_data;
-	char *spt1_data;
+	memcpy(&qs->spt, data, sizeof(qs->spt));
 
-	spt0_data = (char *)malloc(SPT_SIZE);
-	if (!spt0_data) {
-		librsu_log(LOW, __func__, "failed to allocate spt0_data");
+	if (qs->spt.magic_number != SPT_MAGIC_NUMBER) {
+		librsu_log(MED, __func__, "Bad SPT magic number 0x%08X",
+			   qs->spt.magic_number);
 		return -1;
 	}
 
-	spt1_data = (char *)malloc(SPT_SIZE);
-	if (!spt1_data) {
-		librsu_log(LOW, __func__, "failed to allocate spt1_data");
-		free(spt0_data);
+	if (check_spt() || load_spt0_offset()) {
+		librsu_log(MED, __func__, "SPT validity check failed");
 		return -1;
 	}
 
-	ret = read_dev(spt0_offset, spt0_data, SPT_SIZE);
-	if (ret) {
-		librsu_log(LOW, __func__, "failed to read spt0_data");
-		goto ops_error;
-	}
-
-	ret = read_dev(spt1_offset, spt1_data, SPT_SIZE);
-	if (ret) {
-		librsu_log(LOW, __func__, "failed to read spt1_data");
-		goto ops_error;
-	}
-
-	ret = memcmp(spt0_data, spt1_data, SPT_SIZE);
-
-ops_error:
-	free(spt1_data);
-	free(spt0_data);
-
-	return ret;
+	return 0;
 }
 
 /**
@@ -559,60 +740,53 @@ static int load_spt(void)
 {
 	int spt0_good = 0;
 	int spt1_good = 0;
-	mtd_part_offset = 0;
+	qs->mtd_part_offset = 0;
+
+	spt_index_reset();
+	qs->spt_pair_good = false;
 
 	librsu_log(HIGH, __func__, "SPT1");
-	if (read_dev(spt1_offset, &spt, sizeof(spt)) == 0 &&
-	    spt.magic_number == SPT_MAGIC_NUMBER) {
-		if (check_spt() == 0 && load_spt0_offset() == 0)
-			spt1_good = 1;
-		else
-			librsu_log(MED, __func__, "SPT1 validity check failed");
-	} else {
-		librsu_log(MED, __func__, "Bad SPT1 magic number 0x%08X",
-			   spt.magic_number);
-	}
+	if (read_dev(qs->spt1_offset, qs->spt1_data, SPT_SIZE) == 0 &&
+	    load_spt_copy(qs->spt1_data) == 0)
+		spt1_good = 1;
 
 	librsu_log(HIGH, __func__, "SPT0");
-	if (read_dev(spt0_offset, &spt, sizeof(spt)) == 0 &&
-	    spt.magic_number == SPT_MAGIC_NUMBER) {
-		if (check_spt() == 0 && load_spt0_offset() == 0)
-			spt0_good = 1;
-		else
-			librsu_log(MED, __func__, "SPT0 validitiy check fail");
-	} else {
-		librsu_log(MED, __func__, "Bad SPT0 magic number 0x%08X",
-			   spt.magic_number);
-	}
+	if (read_dev(qs->spt0_offset, qs->spt0_data, SPT_SIZE) == 0 &&
+	    load_spt_copy(qs->spt0_data) == 0)
+		spt0_good = 1;
 
 	if (spt0_good && spt1_good) {
-		if (check_both_spt()) {
+		if (memcmp(qs->spt0_data, qs->spt1_data, SPT_SIZE)) {
 			librsu_log(LOW, __func__,
 				   "error: unmatched SPT0/1 data");
-			spt_corrupted = true;
+			qs->spt_corrupted = true;
 			return -1;
 		}
+		qs->spt_pair_good = true;
 		return 0;
 	}
 
+	metadata_cache_drop();
+
 	if (spt0_good) {
 		librsu_log(LOW, __func__, "warning: Restoring SPT1");
 
-		if (erase_dev(spt1_offset, 32 * 1024)) {
+		if (erase_dev(qs->spt1_offset, 32 * 1024, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Erase SPT1 region failed");
 			return -1;
 		}
 
-		spt.magic_number = (__s32)0xFFFFFFFF;
-		if (write_dev(spt1_offset, &spt, sizeof(spt))) {
+		qs->spt.magic_number = (__s32)0xFFFFFFFF;
+		if (write_dev(qs->spt1_offset, &qs->spt, sizeof(qs->spt))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write SPT1 table");
 			return -1;
 		}
 
-		spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
-		if (write_dev(spt1_offset, &spt, sizeof(spt.magic_number))) {
+		qs->spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
+		if (write_dev(qs->spt1_offset, &qs->spt,
+			      sizeof(qs->spt.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to wr SPT1 magic #");
 			return -1;
@@ -622,30 +796,29 @@ static int load_spt(void)
 	}
 
 	if (spt1_good) {
-		if (read_dev(spt1_offset, &spt, sizeof(spt)) ||
-		    spt.magic_number != SPT_MAGIC_NUMBER ||
-		    check_spt() || load_spt0_offset()) {
+		if (load_spt_copy(qs->spt1_data)) {
 			librsu_log(MED, __func__, "error: Failed to load SPT1");
 			return -1;
 		}
 
 		librsu_log(LOW, __func__, "warning: Restoring SPT0");
 
-		if (erase_dev(spt0_offset, 32 * 1024)) {
+		if (erase_dev(qs->spt0_offset, 32 * 1024, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Erase SPT0 region failed");
 			return -1;
 		}
 
-		spt.magic_number = (__s32)0xFFFFFFFF;
-		if (write_dev(spt0_offset, &spt, sizeof(spt))) {
+		qs->spt.magic_number = (__s32)0xFFFFFFFF;
+		if (write_dev(qs->spt0_offset, &qs->spt, sizeof(qs->spt))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write SPT0 table");
 			return -1;
 		}
 
-		spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
-		if (write_dev(spt0_offset, &spt, sizeof(spt.magic_number))) {
+		qs->spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
+		if (write_dev(qs->spt0_offset, &qs->spt,
+			      sizeof(qs->spt.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to wr SPT0 magic #");
 			return -1;
@@ -654,7 +827,7 @@ static int load_spt(void)
 		return 0;
 	}
 
-	spt_corrupted = true;
+	qs->spt_corrupted = true;
 	librsu_log(LOW, __func__, "error: No valid SPT0 or SPT1 found");
 	return -1;
 }
@@ -667,7 +840,7 @@ static int read_part(int part_num, int offset, void *buf, int len)
 		return -1;
 
 	if (offset < 0 || len < 0 ||
-	    (offset + len) > spt.partition[part_num].length)
+	    (offset + len) > qs->spt.partition[part_num].length)
 		return -1;
 
 	return read_dev(part_offset + (off_t)offset, buf, len);
@@ -681,20 +854,28 @@ static int write_part(int part_num, int offset, void *buf, int len)
 		return -1;
 
 	if (offset < 0 || len < 0 ||
-	    (offset + len) > spt.partition[part_num].length)
+	    (offset + len) > qs->spt.partition[part_num].length)
 		return -1;
 
 	return write_dev(part_offset + (off_t)offset, buf, len);
 }
 
-static int erase_part(int part_num)
+/*
+ * erase_part() - erase a whole partition
+ * part_num: partition number
+ * report: report the erase progress, see erase_dev()
+ *
+ * Returns 0 on success, or -1 on error
+ */
+static int erase_part(int part_num, int report)
 {
 	off_t part_offset;
 
 	if (get_part_offset(part_num, &part_offset))
 		return -1;
 
-	return erase_dev(part_offset, spt.partition[part_num].length);
+	return erase_dev(part_offset, qs->spt.partition[part_num].length,
+			 report);
 }
 
 static int writeback_spt(void)
@@ -704,19 +885,21 @@ static int writeback_spt(void)
 	char *spt_data;
 	__u32 calc_crc;
 
+	spt_index_reset();
+	metadata_cache_drop();
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strcmp(spt.partition[x].name, "SPT0") &&
-		    strcmp(spt.partition[x].name, "SPT1"))
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strcmp(qs->spt.partition[x].name, "SPT0") &&
+		    strcmp(qs->spt.partition[x].name, "SPT1"))
 			continue;
 
-		if (erase_part(x)) {
+		if (erase_part(x, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to ease SPTx");
 			return -1;
 		}
 
-		if (spt.version > SPT_VERSION &&
+		if (qs->spt.version > SPT_VERSION &&
 		    librsu_cfg_spt_checksum_enabled()) {
 			librsu_log(MED, __func__,
 				   "update SPT checksum...\n");
@@ -727,10 +910,10 @@ static int writeback_spt(void)
 				return -1;
 			}
 
-			spt.checksum = (__s32)0xFFFFFFFF;
+			qs->spt.checksum = (__s32)0xFFFFFFFF;
 			if (write_part(x, SPT_CHECKSUM_OFFSET,
-				       &spt.checksum,
-				       sizeof(spt.checksum))) {
+				       &qs->spt.checksum,
+				       sizeof(qs->spt.checksum))) {
 				librsu_log(LOW, __func__,
 					   "failed to write checksum");
 				free(spt_data);
@@ -738,34 +921,34 @@ static int writeback_spt(void)
 			}
 
 			/* calculate the new checksum */
-			memcpy(spt_data, &spt, SPT_SIZE);
+			memcpy(spt_data, &qs->spt, SPT_SIZE);
 			memset(spt_data + SPT_CHECKSUM_OFFSET,
-			       0, sizeof(spt.checksum));
+			       0, sizeof(qs->spt.checksum));
 
 			swap_bits(spt_data, SPT_SIZE);
 			calc_crc = crc32(0, (void *)spt_data, SPT_SIZE);
-			spt.checksum = swap_endian32(calc_crc);
+			qs->spt.checksum = swap_endian32(calc_crc);
 			swap_bits(spt_data, SPT_SIZE);
 			free(spt_data);
 
 			if (write_part(x, SPT_CHECKSUM_OFFSET,
-				       &spt.checksum,
-				       sizeof(spt.checksum))) {
+				       &qs->spt.checksum,
+				       sizeof(qs->spt.checksum))) {
 				librsu_log(LOW, __func__,
 					   "failed to write checksum");
 				return -1;
 			}
 		}
 
-		spt.magic_number = (__s32)0xFFFFFFFF;
-		if (write_part(x, 0, &spt, sizeof(spt))) {
+		qs->spt.magic_number = (__s32)0xFFFFFFFF;
+		if (write_part(x, 0, &qs->spt, sizeof(qs->spt))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write SPTx table");
 			return -1;
 		}
 
-		spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
-		if (write_part(x, 0, &spt, sizeof(spt.magic_number))) {
+		qs->spt.magic_number = (__s32)SPT_MAGIC_NUMBER;
+		if (write_part(x, 0, &qs->spt, sizeof(qs->spt.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to wr SPTx magic #");
 			return -1;
@@ -842,7 +1025,7 @@ static int restore_spt_from_file(char *name)
 		goto ops_error;
 	}
 
-	memcpy(&spt, spt_data, SPT_SIZE);
+	memcpy(&qs->spt, spt_data, SPT_SIZE);
 
 	if (load_spt0_offset()) {
 		librsu_log(LOW, __func__, "failure to determine SPT0 offset");
@@ -856,11 +1039,11 @@ static int restore_spt_from_file(char *name)
 		goto ops_error;
 	}
 
-	spt_corrupted = false;
+	qs->spt_corrupted = false;
 
 	/* try to reload CPB, as we have a new SPT */
-	cpb_corrupted = false;
-	if (load_cpb() && !cpb_corrupted)
+	qs->cpb_corrupted = false;
+	if (load_cpb() && !qs->cpb_corrupted)
 		librsu_log(LOW, __func__,
 			   "failed to load CPB after restoring SPT\n");
 
@@ -870,14 +1053,88 @@ ops_error:
 	return ret;
 }
 
-static union CMF_POINTER_BLOCK cpb;
-static CMF_POINTER *cpb_slots;
-static int cpb0_part = -1;
-static int cpb1_part = -1;
-
 #define ERASED_ENTRY ((__s64)-1)
 #define SPENT_ENTRY ((__s64)0)
 
+static void priority_index_reset(void)
+{
+	qs->priority_index_valid = false;
+}
+
+static int compare_part_offset(const void *a, const void *b)
+{
+	__s64 offs_a = qs->spt.partition[*(const int *)a].offset;
+	__s64 offs_b = qs->spt.partition[*(const int *)b].offset;
+
+	if (offs_a < offs_b)
+		return -1;
+
+	return offs_a > offs_b;
+}
+
+/**
+ * find_part_by_offset() - find the partition starting at an offset
+ * @offset: partition offset
+ *
+ * Return: partition number, or -1 if no partition starts at the offset
+ */
+static int find_part_by_offset(__s64 offset)
+{
+	int lo = 0;
+	int hi = qs->spt.partitions - 1;
+	int mid;
+	__s64 mid_offset;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		mid_offset = qs->spt.partition[qs->part_by_offset[mid]].offset;
+
+		if (mid_offset == offset)
+			return qs->part_by_offset[mid];
+
+		if (mid_offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+/**
+ * priority_index_build() - compute the priority of all partitions
+ *
+ * Priorities count from 1 for the highest priority, which is the last valid
+ * CPB pointer. Partitions not in the CPB have priority 0.
+ */
+static void priority_index_build(void)
+{
+	int x;
+	int part;
+	int priority = 0;
+
+	for (x = 0; x < qs->spt.partitions; x++) {
+		qs->part_by_offset[x] = x;
+		qs->part_priority[x] = 0;
+	}
+
+	qsort(qs->part_by_offset, qs->spt.partitions,
+	      sizeof(qs->part_by_offset[0]), compare_part_offset);
+
+	for (x = qs->cpb.header.image_ptr_slots; x > 0; x--) {
+		if (qs->cpb_slots[x - 1] == ERASED_ENTRY ||
+		    qs->cpb_slots[x - 1] == SPENT_ENTRY)
+			continue;
+
+		priority++;
+		part = find_part_by_offset(qs->cpb_slots[x - 1]);
+		if (part >= 0 && !qs->part_priority[part])
+			qs->part_priority[part] = priority;
+	}
+
+	qs->priority_index_valid = true;
+}
+
 /**
  * check CPB other header value and image pointer
  */
@@ -885,7 +1142,7 @@ static int check_cpb(void)
 {
 	int x, y;
 
-	if (cpb.header.header_size > CPB_HEADER_SIZE) {
+	if (qs->cpb.header.header_size > CPB_HEADER_SIZE) {
 		librsu_log(LOW, __func__,
 			   "warning: CPB header is larger than expected");
 		librsu_log(LOW, __func__,
@@ -893,30 +1150,30 @@ static int check_cpb(void)
 			   LIBRSU_VER);
 	}
 
-	for (x = 0; x < cpb.header.image_ptr_slots; x++) {
-		if (cpb_slots[x] == ERASED_ENTRY ||
-		    cpb_slots[x] == SPENT_ENTRY)
+	for (x = 0; x < qs->cpb.header.image_ptr_slots; x++) {
+		if (qs->cpb_slots[x] == ERASED_ENTRY ||
+		    qs->cpb_slots[x] == SPENT_ENTRY)
 			continue;
 
-		for (y = 0; y < spt.partitions; y++) {
-			if (cpb_slots[x] == spt.partition[y].offset) {
+		for (y = 0; y < qs->spt.partitions; y++) {
+			if (qs->cpb_slots[x] == qs->spt.partition[y].offset) {
 				librsu_log(HIGH, __func__,
 					   "cpb_slots[%i] = %s", x,
-					   spt.partition[y].name);
+					   qs->spt.partition[y].name);
 				break;
 			}
 		}
 
-		if (y >= spt.partitions) {
+		if (y >= qs->spt.partitions) {
 			librsu_log(LOW, __func__,
 				   "error: CPB is not included in SPT");
 			librsu_log(HIGH, __func__,
 				   "cpb_slots[%i] = %016llX ???", x,
-				   cpb_slots[x]);
+				   qs->cpb_slots[x]);
 			return -1;
 		}
 
-		if (spt.partition[y].flags & SPT_FLAG_RESERVED) {
+		if (qs->spt.partition[y].flags & SPT_FLAG_RESERVED) {
 			librsu_log(LOW, __func__,
 				   "CPB is included in SPT but reserved\n");
 			return -1;
@@ -926,43 +1183,25 @@ static int check_cpb(void)
 	return 0;
 }
 
-static int check_both_cpb(void)
+/**
+ * load_cpb_copy() - check one of the CPB copies read by load_cpb()
+ * @data: CPB copy
+ *
+ * The copy becomes the working CPB.
+ *
+ * Return: zero value for a good copy, or negative value otherwise
+ */
+static int load_cpb_copy(char *data)
 {
-	int ret;
-	char *cpb0_data;
-	char *cpb1_data;
+	memcpy(&qs->cpb, data, sizeof(qs->cpb));
 
-	cpb0_data = (char *)malloc(CPB_SIZE);
-	if (!cpb0_data) {
-		librsu_log(LOW, __func__, "failed to allocate cpb0_data");
+	if (qs->cpb.header.magic_number != CPB_MAGIC_NUMBER)
 		return -1;
-	}
-
-	cpb1_data = (char *)malloc(CPB_SIZE);
-	if (!cpb1_data) {
-		librsu_log(LOW, __func__, "failed to allocate cpb1_data");
-		free(cpb0_data);
-		return -1;
-	}
 
-	ret = read_part(cpb0_part, 0, cpb0_data, CPB_SIZE);
-	if (ret) {
-		librsu_log(LOW, __func__, "failed to read cpb0_data");
-		goto ops_error;
-	}
-
-	ret = read_part(cpb1_part, 0, cpb1_data, CPB_SIZE);
-	if (ret) {
-		librsu_log(LOW, __func__, "failed to read cpb1_data");
-		goto ops_error;
-	}
+	qs->cpb_slots = (CMF_POINTER *)
+		&qs->cpb.data[qs->cpb.header.image_ptr_offset];
 
-	ret = memcmp(cpb0_data, cpb1_data, CPB_SIZE);
-
-ops_error:
-	free(cpb1_data);
-	free(cpb0_data);
-	return ret;
+	return check_cpb();
 }
 
 static int save_cpb_to_file(char *name)
@@ -987,7 +1226,7 @@ static int save_cpb_to_file(char *name)
 		return -1;
 	}
 
-	ret = read_part(cpb0_part, 0, cpb_data, CPB_SIZE);
+	ret = read_part(qs->cpb0_part, 0, cpb_data, CPB_SIZE);
 	if (ret) {
 		librsu_log(LOW, __func__, "failed to read CPB data");
 		goto ops_err;
@@ -1018,7 +1257,7 @@ ops_err:
 
 static int corrupted_cpb(void)
 {
-	return cpb_corrupted;
+	return qs->cpb_corrupted;
 }
 
 /**
@@ -1029,167 +1268,208 @@ static int corrupted_cpb(void)
  * When CPB_CORRUPTED flag is true, all CPB operations are blocked
  * except restore_cpb and empty_cpb.
  */
-static int load_cpb(void)
+/**
+ * find_cpb_parts() - find the CPB0 and CPB1 partitions in the SPT
+ *
+ * Return: zero value on success, or negative value if either is missing
+ */
+static int find_cpb_parts(void)
 {
 	int x;
+
+	qs->cpb0_part = -1;
+	qs->cpb1_part = -1;
+
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strcmp(qs->spt.partition[x].name, "CPB0") == 0)
+			qs->cpb0_part = x;
+		else if (strcmp(qs->spt.partition[x].name, "CPB1") == 0)
+			qs->cpb1_part = x;
+
+		if (qs->cpb0_part >= 0 && qs->cpb1_part >= 0)
+			break;
+	}
+
+	if (qs->cpb0_part < 0 || qs->cpb1_part < 0) {
+		librsu_log(LOW, __func__, "error: Missing CPB0/1 partition");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int load_cpb(void)
+{
 	int cpb0_good = 0;
 	int cpb1_good = 0;
 
 	struct rsu_status_info info;
 	int cpb0_corrupted = 0;
 
+	priority_index_reset();
+	qs->cpb_pair_good = false;
+
 	if (librsu_misc_get_devattr("state", &info.state))
 		return -EFILEIO;
 
 	librsu_log(HIGH, __func__, "state=0x%08X\n", info.state);
 
-	if (!cpb_fixed && info.state == STATE_CPB0_CPB1_CORRUPTED) {
+	if (!qs->cpb_fixed && info.state == STATE_CPB0_CPB1_CORRUPTED) {
 		librsu_log(LOW, __func__,
 			   "FW detects both CPBs corrupted\n");
-		cpb_corrupted = true;
+		qs->cpb_corrupted = true;
 		return -ECORRUPTED_CPB;
 	}
 
-	if (!cpb_fixed && info.state == STATE_CPB0_CORRUPTED) {
+	if (!qs->cpb_fixed && info.state == STATE_CPB0_CORRUPTED) {
 		librsu_log(LOW, __func__,
 			   "FW detects corrupted CPB0, fine CPB1\n");
 		cpb0_corrupted = 1;
 	}
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strcmp(spt.partition[x].name, "CPB0") == 0)
-			cpb0_part = x;
-		else if (strcmp(spt.partition[x].name, "CPB1") == 0)
-			cpb1_part = x;
-
-		if (cpb0_part >= 0 && cpb1_part >= 0)
-			break;
-	}
-
-	if (cpb0_part < 0 || cpb1_part < 0) {
-		librsu_log(LOW, __func__, "error: Missing CPB0/1 partition");
+	if (find_cpb_parts())
 		return -1;
-	}
 
-	if (read_part(cpb1_part, 0, &cpb, sizeof(cpb)) == 0 &&
-	    cpb.header.magic_number == CPB_MAGIC_NUMBER) {
-		cpb_slots = (CMF_POINTER *)
-			&cpb.data[cpb.header.image_ptr_offset];
-		if (check_cpb() == 0)
-			cpb1_good = 1;
-	} else {
+	if (read_part(qs->cpb1_part, 0, qs->cpb1_data, CPB_SIZE) == 0 &&
+	    load_cpb_copy(qs->cpb1_data) == 0)
+		cpb1_good = 1;
+	else
 		librsu_log(MED, __func__, "Bad CPB1 is bad");
-	}
 
 	if (!cpb0_corrupted) {
-		if (read_part(cpb0_part, 0, &cpb, sizeof(cpb)) == 0 &&
-		    cpb.header.magic_number == CPB_MAGIC_NUMBER) {
-			cpb_slots = (CMF_POINTER *)
-				&cpb.data[cpb.header.image_ptr_offset];
-			if (check_cpb() == 0)
-				cpb0_good = 1;
-		} else {
+		if (read_part(qs->cpb0_part, 0, qs->cpb0_data, CPB_SIZE) == 0 &&
+		    load_cpb_copy(qs->cpb0_data) == 0)
+			cpb0_good = 1;
+		else
 			librsu_log(MED, __func__, "Bad CPB0 is bad");
-		}
 	}
 
 	if (cpb0_good && cpb1_good) {
-		if (check_both_cpb()) {
+		if (memcmp(qs->cpb0_data, qs->cpb1_data, CPB_SIZE)) {
 			librsu_log(LOW, __func__,
 				   "error: unmatched CPB0/1 data");
-			cpb_corrupted = true;
+			qs->cpb_corrupted = true;
 			return -1;
 		}
-		cpb_slots = (CMF_POINTER *)
-		    &cpb.data[cpb.header.image_ptr_offset];
+		qs->cpb_slots = (CMF_POINTER *)
+		    &qs->cpb.data[qs->cpb.header.image_ptr_offset];
+		qs->cpb_pair_good = true;
 		return 0;
 	}
 
+	metadata_cache_drop();
+
 	if (cpb0_good) {
 		librsu_log(LOW, __func__, "warning: Restoring CPB1");
-		if (erase_part(cpb1_part)) {
+		if (erase_part(qs->cpb1_part, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Failed erase CPB1");
 			return -1;
 		}
 
-		cpb.header.magic_number = (__s32)0xFFFFFFFF;
-		if (write_part(cpb1_part, 0, &cpb, sizeof(cpb))) {
+		qs->cpb.header.magic_number = (__s32)0xFFFFFFFF;
+		if (write_part(qs->cpb1_part, 0, &qs->cpb, sizeof(qs->cpb))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPB1 table");
 			return -1;
 		}
-		cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
-		if (write_part(cpb1_part, 0, &cpb,
-			       sizeof(cpb.header.magic_number))) {
+		qs->cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
+		if (write_part(qs->cpb1_part, 0, &qs->cpb,
+			       sizeof(qs->cpb.header.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPB1 magic number");
 			return -1;
 		}
 
-		cpb_slots = (CMF_POINTER *)
-		    &cpb.data[cpb.header.image_ptr_offset];
+		qs->cpb_slots = (CMF_POINTER *)
+		    &qs->cpb.data[qs->cpb.header.image_ptr_offset];
 		return 0;
 	}
 
 	if (cpb1_good) {
-		if (read_part(cpb1_part, 0, &cpb, sizeof(cpb)) ||
-		    cpb.header.magic_number != CPB_MAGIC_NUMBER) {
+		if (load_cpb_copy(qs->cpb1_data)) {
 			librsu_log(MED, __func__, "error: Unable to load CPB1");
 			return -1;
 		}
 
 		librsu_log(LOW, __func__, "warning: Restoring CPB0");
-		if (erase_part(cpb0_part)) {
+		if (erase_part(qs->cpb0_part, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Failed erase CPB0");
 			return -1;
 		}
 
-		cpb.header.magic_number = (__s32)0xFFFFFFFF;
-		if (write_part(cpb0_part, 0, &cpb, sizeof(cpb))) {
+		qs->cpb.header.magic_number = (__s32)0xFFFFFFFF;
+		if (write_part(qs->cpb0_part, 0, &qs->cpb, sizeof(qs->cpb))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPB0 table");
 			return -1;
 		}
-		cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
-		if (write_part(cpb0_part, 0, &cpb,
-			       sizeof(cpb.header.magic_number))) {
+		qs->cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
+		if (write_part(qs->cpb0_part, 0, &qs->cpb,
+			       sizeof(qs->cpb.header.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPB0 magic number");
 			return -1;
 		}
 
-		cpb_slots = (CMF_POINTER *)
-		    &cpb.data[cpb.header.image_ptr_offset];
+		qs->cpb_slots = (CMF_POINTER *)
+		    &qs->cpb.data[qs->cpb.header.image_ptr_offset];
 		return 0;
 	}
 
-	cpb_corrupted = true;
+	qs->cpb_corrupted = true;
 	librsu_log(LOW, __func__, "error: found both corrupted CPBs");
 
 	return -1;
 }
 
+/*
+ * update_cpb() - change a single CPB pointer in both CPBs
+ *
+ * Pointers can only move from erased to a value and from a value to spent,
+ * by clearing bits, so only the bytes of the pointer which actually change
+ * are programmed, rather than the whole table.
+ */
 static int update_cpb(int slot, __s64 ptr)
 {
 	int x;
 	int updates = 0;
+	int first;
+	int last;
+	int offset;
+	__u8 old[sizeof(CMF_POINTER)];
+	__u8 *new;
 
-	if (slot < 0 || slot > cpb.header.image_ptr_slots)
+	if (slot < 0 || slot > qs->cpb.header.image_ptr_slots)
 		return -1;
 
-	if ((cpb_slots[slot] & ptr) != ptr)
+	if ((qs->cpb_slots[slot] & ptr) != ptr)
 		return -1;
 
-	cpb_slots[slot] = ptr;
+	new = (__u8 *)&qs->cpb_slots[slot];
+	memcpy(old, new, sizeof(old));
+	qs->cpb_slots[slot] = ptr;
+	priority_index_reset();
+	metadata_cache_drop();
+
+	for (first = 0; first < (int)sizeof(old); first++)
+		if (old[first] != new[first])
+			break;
+
+	for (last = sizeof(old) - 1; last >= first; last--)
+		if (old[last] != new[last])
+			break;
+
+	offset = (__u8 *)&qs->cpb_slots[slot] - (__u8 *)&qs->cpb + first;
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strcmp(spt.partition[x].name, "CPB0") &&
-		    strcmp(spt.partition[x].name, "CPB1"))
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strcmp(qs->spt.partition[x].name, "CPB0") &&
+		    strcmp(qs->spt.partition[x].name, "CPB1"))
 			continue;
 
-		if (write_part(x, 0, &cpb, sizeof(cpb)))
+		if (last >= first &&
+		    write_part(x, offset, new + first, last - first + 1))
 			return -1;
 		updates++;
 	}
@@ -1207,25 +1487,29 @@ static int writeback_cpb(void)
 	int x;
 	int updates = 0;
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strcmp(spt.partition[x].name, "CPB0") &&
-		    strcmp(spt.partition[x].name, "CPB1"))
+	priority_index_reset();
+	metadata_cache_drop();
+
+	for (x = 0; x < qs->spt.partitions; x++) {
+		if (strcmp(qs->spt.partition[x].name, "CPB0") &&
+		    strcmp(qs->spt.partition[x].name, "CPB1"))
 			continue;
 
-		if (erase_part(x)) {
+		if (erase_part(x, 0)) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to ease CPBx");
 			return -1;
 		}
 
-		cpb.header.magic_number = (__s32)0xFFFFFFFF;
-		if (write_part(x, 0, &cpb, sizeof(cpb))) {
+		qs->cpb.header.magic_number = (__s32)0xFFFFFFFF;
+		if (write_part(x, 0, &qs->cpb, sizeof(qs->cpb))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPBx table");
 			return -1;
 		}
-		cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
-		if (write_part(x, 0, &cpb, sizeof(cpb.header.magic_number))) {
+		qs->cpb.header.magic_number = (__s32)CPB_MAGIC_NUMBER;
+		if (write_part(x, 0, &qs->cpb,
+			       sizeof(qs->cpb.header.magic_number))) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to write CPBx magic number");
 			return -1;
@@ -1256,7 +1540,7 @@ static int empty_cpb(void)
 
 	struct cpb_header *c_header;
 
-	if (spt_corrupted) {
+	if (qs->spt_corrupted) {
 		librsu_log(LOW, __func__, "corrupted SPT ---");
 		librsu_log(LOW, __func__,
 			   "run rsu_client restore-spt <file_name> first\n");
@@ -1276,8 +1560,8 @@ static int empty_cpb(void)
 	c_header->image_ptr_offset = CPB_IMAGE_PTR_OFFSET;
 	c_header->image_ptr_slots = CPB_IMAGE_PTR_NSLOTS;
 
-	memset(&cpb, -1, CPB_SIZE);
-	memcpy(&cpb, c_header, (__u32)sizeof(*c_header));
+	memset(&qs->cpb, -1, CPB_SIZE);
+	memcpy(&qs->cpb, c_header, (__u32)sizeof(*c_header));
 
 	ret = writeback_cpb();
 	if (ret) {
@@ -1285,9 +1569,10 @@ static int empty_cpb(void)
 		goto ops_error;
 	}
 
-	cpb_slots = (CMF_POINTER *)&cpb.data[cpb.header.image_ptr_offset];
-	cpb_corrupted = false;
-	cpb_fixed = true;
+	qs->cpb_slots = (CMF_POINTER *)
+		&qs->cpb.data[qs->cpb.header.image_ptr_offset];
+	qs->cpb_corrupted = false;
+	qs->cpb_fixed = true;
 
 ops_error:
 	free(c_header);
@@ -1303,7 +1588,7 @@ static int restore_cpb_from_file(char *name)
 	__u32 magic_number;
 	int ret;
 
-	if (spt_corrupted) {
+	if (qs->spt_corrupted) {
 		librsu_log(LOW, __func__, "corrupted SPT ---");
 		librsu_log(LOW, __func__,
 			   "run rsu_client restore-spt <file_name> first\n");
@@ -1362,16 +1647,17 @@ static int restore_cpb_from_file(char *name)
 		goto ops_error;
 	}
 
-	memcpy(&cpb, cpb_data, CPB_SIZE);
+	memcpy(&qs->cpb, cpb_data, CPB_SIZE);
 	ret = writeback_cpb();
 	if (ret) {
 		librsu_log(LOW, __func__, "failed to write back cpb\n");
 		goto ops_error;
 	}
 
-	cpb_slots = (CMF_POINTER *)&cpb.data[cpb.header.image_ptr_offset];
-	cpb_corrupted = false;
-	cpb_fixed = true;
+	qs->cpb_slots = (CMF_POINTER *)
+		&qs->cpb.data[qs->cpb.header.image_ptr_offset];
+	qs->cpb_corrupted = false;
+	qs->cpb_fixed = true;
 
 ops_error:
 	free(cpb_data);
@@ -1379,47 +1665,321 @@ ops_error:
 	return ret;
 }
 
-static void ll_close(void)
+/**
+ * metadata_key_get() - build the key a cache file has to match
+ * @key: key to fill in
+ *
+ * Return: zero value on success, or negative value if the RSU state does not
+ * allow caching
+ */
+static int metadata_key_get(struct metadata_key *key)
 {
-	/* close the dev */
-	for (int i = 0; i < flash_list->flash_count; i++) {
-		if (flash_list->dev_file[i] >= 0)
-			close(flash_list->dev_file[i]);
-		flash_list->dev_file[i] = -1;
+	FILE *file;
+	int i;
 
-		if (!flash_info->root_path[i])
-			free(flash_info->root_path[i]);
+	memset(key, 0, sizeof(*key));
+
+	file = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!file)
+		return -1;
+
+	if (!fgets(key->boot_id, sizeof(key->boot_id), file)) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	if (librsu_misc_get_devattr("state", &key->state))
+		return -1;
+
+	if (key->state == STATE_CPB0_CORRUPTED ||
+	    key->state == STATE_CPB0_CPB1_CORRUPTED)
+		return -1;
+
+	for (i = 0; i < qs->flash_list->flash_count; i++) {
+		if (!qs->flash_info->root_path[i])
+			continue;
+
+		key->root_crc = crc32(key->root_crc,
+				      (void *)qs->flash_info->root_path[i],
+				      strlen(qs->flash_info->root_path[i]));
 	}
 
-	mtd_part_offset = 0;
-	spt.partitions = 0;
-	cpb.header.image_ptr_slots = 0;
-	cpb0_part = -1;
-	cpb1_part = -1;
-	cpb_corrupted = false;
-	cpb_fixed = false;
-	spt_corrupted = false;
+	key->spt0_offset = qs->spt0_offset;
+	key->spt1_offset = qs->spt1_offset;
+	key->flash_count = qs->flash_list->flash_count;
+	memcpy(key->dev_info, qs->flash_list->dev_info, sizeof(key->dev_info));
+
+	return 0;
+}
+
+static __u32 metadata_crc(void)
+{
+	return crc32(0, (void *)&qs->metadata.key, sizeof(qs->metadata) -
+		     offsetof(struct metadata_cache, key));
+}
+
+/**
+ * metadata_flash_match() - check SPT and CPB data against SPT0 and CPB0
+ * @spt_data: SPT data to check
+ * @cpb_data: CPB data to check
+ *
+ * All of CPB0 is compared. When the SPT carries a checksum only the SPT
+ * header, which holds it, is compared, otherwise all of SPT0 is. The CPB0
+ * partition must already be known.
+ *
+ * Return: zero value if both match, or negative value if not
+ */
+static int metadata_flash_match(char *spt_data, char *cpb_data)
+{
+	struct SUB_PARTITION_TABLE *spt = (void *)spt_data;
+	char data[SPT_SIZE > CPB_SIZE ? SPT_SIZE : CPB_SIZE];
+	size_t len = SPT_SIZE;
+
+	if (spt->version > SPT_VERSION && librsu_cfg_spt_checksum_enabled())
+		len = METADATA_SPT_HEAD;
+
+	if (read_dev(qs->spt0_offset, data, len) ||
+	    memcmp(data, spt_data, len))
+		return -1;
+
+	if (read_part(qs->cpb0_part, 0, data, CPB_SIZE) ||
+	    memcmp(data, cpb_data, CPB_SIZE))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * metadata_cache_load() - load the SPT and CPB from the cache file
+ *
+ * SPT0 and CPB0 are read back from flash, to make sure the cache still
+ * describes the flash.
+ *
+ * Return: zero value on success, or negative value if the tables have to be
+ * loaded from flash
+ */
+static int metadata_cache_load(void)
+{
+	char *path = librsu_cfg_get_metadata_cache();
+	struct metadata_key key;
+	FILE *file;
+	size_t len;
+
+	if (!path || metadata_key_get(&key))
+		return -1;
+
+	file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	len = fread(&qs->metadata, 1, sizeof(qs->metadata), file);
+	fclose(file);
+
+	if (len != sizeof(qs->metadata) ||
+	    qs->metadata.magic != METADATA_CACHE_MAGIC ||
+	    qs->metadata.crc != metadata_crc() ||
+	    memcmp(&qs->metadata.key, &key, sizeof(key))) {
+		librsu_log(HIGH, __func__, "stale metadata cache");
+		return -1;
+	}
+
+	spt_index_reset();
+	qs->mtd_part_offset = 0;
+
+	if (load_spt_copy(qs->metadata.spt_data) || find_cpb_parts())
+		return -1;
+
+	if (metadata_flash_match(qs->metadata.spt_data,
+				 qs->metadata.cpb_data)) {
+		librsu_log(HIGH, __func__, "metadata cache out of date");
+		return -1;
+	}
+
+	if (load_cpb_copy(qs->metadata.cpb_data))
+		return -1;
+
+	librsu_log(HIGH, __func__, "SPT/CPB loaded from '%s'", path);
+
+	return 0;
+}
+
+/**
+ * metadata_cache_save() - save the SPT and CPB just loaded from flash
+ *
+ * The cache is written to a temporary file which is then renamed, so it is
+ * never seen partially written. Under the cache lock, the tables are read
+ * back from flash once more before the rename, so tables changed by another
+ * process since they were loaded are not saved.
+ */
+static void metadata_cache_save(void)
+{
+	char *path = librsu_cfg_get_metadata_cache();
+	char tmp_path[140];
+	FILE *file;
+	int lock;
+
+	if (!path || !qs->spt_pair_good || !qs->cpb_pair_good ||
+	    metadata_key_get(&qs->metadata.key))
+		return;
+
+	qs->metadata.magic = METADATA_CACHE_MAGIC;
+	memcpy(qs->metadata.spt_data, qs->spt0_data, SPT_SIZE);
+	memcpy(qs->metadata.cpb_data, qs->cpb0_data, CPB_SIZE);
+	qs->metadata.crc = metadata_crc();
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	lock = librsu_misc_lock_file(path);
+	if (lock < 0)
+		return;
+
+	file = fopen(tmp_path, "wb");
+	if (!file) {
+		librsu_log(LOW, __func__, "error: Unable to open '%s'",
+			   tmp_path);
+		close(lock);
+		return;
+	}
+
+	if (fwrite(&qs->metadata, sizeof(qs->metadata), 1, file) != 1) {
+		librsu_log(LOW, __func__, "error: Unable to write '%s'",
+			   tmp_path);
+		fclose(file);
+		remove(tmp_path);
+		close(lock);
+		return;
+	}
+
+	fclose(file);
+
+	if (metadata_flash_match(qs->metadata.spt_data,
+				 qs->metadata.cpb_data)) {
+		librsu_log(HIGH, __func__, "tables changed, cache not saved");
+		remove(tmp_path);
+	} else if (rename(tmp_path, path)) {
+		librsu_log(LOW, __func__, "error: Unable to update '%s'", path);
+	}
+
+	close(lock);
+}
+
+/**
+ * metadata_cache_drop() - remove the cache file before the SPT or CPB change
+ */
+static void metadata_cache_drop(void)
+{
+	char *path = librsu_cfg_get_metadata_cache();
+	int lock;
+
+	if (!path)
+		return;
+
+	lock = librsu_misc_lock_file(path);
+
+	if (remove(path) && errno != ENOENT)
+		librsu_log(LOW, __func__, "error: Unable to remove '%s'", path);
+
+	if (lock >= 0)
+		close(lock);
+}
+
+static void ll_close(void)
+{
+	/* close the dev */
+	for (int i = 0; i < qs->flash_list->flash_count; i++) {
+		if (qs->flash_list->dev_file[i] >= 0)
+			close(qs->flash_list->dev_file[i]);
+		qs->flash_list->dev_file[i] = -1;
+
+		if (!qs->flash_info->root_path[i])
+			free(qs->flash_info->root_path[i]);
+	}
+
+	qs->mtd_part_offset = 0;
+	qs->spt.partitions = 0;
+	qs->cpb.header.image_ptr_slots = 0;
+	qs->cpb0_part = -1;
+	qs->cpb1_part = -1;
+	spt_index_reset();
+	qs->cpb_corrupted = false;
+	qs->cpb_fixed = false;
+	qs->spt_corrupted = false;
 }
 
 static int partition_count(void)
 {
-	return spt.partitions;
+	return qs->spt.partitions;
+}
+
+static int partition_slots(void)
+{
+	if (!qs->slot_index_valid)
+		slot_index_build();
+
+	return qs->slot_cnt;
+}
+
+static int partition_slot2part(int slot)
+{
+	if (!qs->slot_index_valid)
+		slot_index_build();
+
+	if (slot < 0 || slot >= qs->slot_cnt)
+		return -1;
+
+	return qs->slot_part[slot];
+}
+
+static int partition_part2slot(int part_num)
+{
+	if (part_num < 0 || part_num >= qs->spt.partitions)
+		return -1;
+
+	if (!qs->slot_index_valid)
+		slot_index_build();
+
+	return qs->part_slot[part_num];
+}
+
+static int partition_by_name(char *name)
+{
+	unsigned int key;
+	int part_num;
+
+	if (strnlen(name, sizeof(qs->spt.partition[0].name)) >=
+	    sizeof(qs->spt.partition[0].name))
+		return -1;
+
+	if (!qs->slot_index_valid)
+		slot_index_build();
+
+	key = name_hash_key(name);
+	while (qs->name_hash[key]) {
+		part_num = qs->name_hash[key] - 1;
+		if (strncmp(qs->spt.partition[part_num].name, name,
+			    sizeof(qs->spt.partition[0].name)) == 0)
+			return part_num;
+		key = (key + 1) & (NAME_HASH_SZ - 1);
+	}
+
+	return -1;
 }
 
 static char *partition_name(int part_num)
 {
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return "BAD";
 
-	return spt.partition[part_num].name;
+	return qs->spt.partition[part_num].name;
 }
 
 static __s64 partition_offset(int part_num)
 {
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	return spt.partition[part_num].offset;
+	return qs->spt.partition[part_num].offset;
 }
 
 /*
@@ -1431,69 +1991,152 @@ static __s64 factory_offset(void)
 {
 	int x;
 
-	for (x = 0; x < spt.partitions; x++)
-		if (strncmp(spt.partition[x].name, FACTORY_IMAGE_NAME,
-			    sizeof(spt.partition[0].name) - 1) == 0)
-			return spt.partition[x].offset;
+	for (x = 0; x < qs->spt.partitions; x++)
+		if (strncmp(qs->spt.partition[x].name, FACTORY_IMAGE_NAME,
+			    sizeof(qs->spt.partition[0].name) - 1) == 0)
+			return qs->spt.partition[x].offset;
 
 	return -1;
 }
 
 static int partition_size(int part_num)
 {
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	return spt.partition[part_num].length;
+	return qs->spt.partition[part_num].length;
 }
 
 static int partition_reserved(int part_num)
 {
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return 0;
 
-	return (spt.partition[part_num].flags & SPT_FLAG_RESERVED) ? 1 : 0;
+	return (qs->spt.partition[part_num].flags & SPT_FLAG_RESERVED) ? 1 : 0;
 }
 
 static int partition_readonly(int part_num)
 {
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return 0;
 
-	return (spt.partition[part_num].flags & SPT_FLAG_READONLY) ? 1 : 0;
+	return (qs->spt.partition[part_num].flags & SPT_FLAG_READONLY) ? 1 : 0;
 }
 
 static int priority_get(int part_num)
 {
-	int x;
-	int priority = 0;
-
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	for (x = cpb.header.image_ptr_slots; x > 0; x--) {
-		if (cpb_slots[x - 1] != ERASED_ENTRY &&
-		    cpb_slots[x - 1] != SPENT_ENTRY) {
-			priority++;
-			if (cpb_slots[x - 1] == spt.partition[part_num].offset)
-				return priority;
+	if (!qs->priority_index_valid)
+		priority_index_build();
+
+	return qs->part_priority[part_num];
+}
+
+/*
+ * compact_cpb() - rewrite the CPB keeping only the valid pointers
+ * ptr: pointer to add above the valid ones, or ERASED_ENTRY for none
+ *
+ * Returns 0 on success, or -1 on error
+ */
+static int compact_cpb(__s64 ptr)
+{
+	int x;
+	int y;
+
+	for (x = 0, y = 0; x < qs->cpb.header.image_ptr_slots; x++) {
+		if (qs->cpb_slots[x] != ERASED_ENTRY &&
+		    qs->cpb_slots[x] != SPENT_ENTRY) {
+			qs->cpb_slots[y++] = qs->cpb_slots[x];
 		}
 	}
 
+	if (ptr != ERASED_ENTRY) {
+		if (y < qs->cpb.header.image_ptr_slots)
+			qs->cpb_slots[y++] = ptr;
+		else
+			return -1;
+	}
+
+	while (y < qs->cpb.header.image_ptr_slots)
+		qs->cpb_slots[y++] = ERASED_ENTRY;
+
+	if (writeback_cpb() || load_cpb())
+		return -1;
+
 	return 0;
 }
 
+/*
+ * count_spent() - count the spent pointers in the CPB
+ *
+ * Returns the number of spent pointers
+ */
+static int count_spent(void)
+{
+	int spent = 0;
+	int x;
+
+	for (x = 0; x < qs->cpb.header.image_ptr_slots; x++)
+		if (qs->cpb_slots[x] == SPENT_ENTRY)
+			spent++;
+
+	return spent;
+}
+
+/*
+ * cpb_compact() - compact the CPB if enough pointers were spent
+ * threshold: minimum number of spent pointers to compact the CPB
+ *
+ * Returns 0 on success, or -1 on error
+ */
+static int cpb_compact(int threshold)
+{
+	int spent = count_spent();
+
+	if (!spent || spent < threshold) {
+		librsu_log(MED, __func__, "%i spent CPB pointers, not compacting",
+			   spent);
+		return 0;
+	}
+
+	librsu_log(MED, __func__, "Compressing CPB, %i spent pointers", spent);
+
+	return compact_cpb(ERASED_ENTRY);
+}
+
+/*
+ * cpb_spent() - report when the CPB is due for compaction
+ *
+ * Compacting erases and rewrites both CPB copies, so the calls spending
+ * pointers leave it to rsu_cpb_compact(), run as maintenance once the
+ * cpb-compact-threshold is reached.
+ */
+static void cpb_spent(void)
+{
+	int threshold = librsu_cfg_cpb_compact_threshold();
+	int spent;
+
+	if (!threshold)
+		return;
+
+	spent = count_spent();
+	if (spent >= threshold)
+		librsu_log(MED, __func__,
+			   "%i spent CPB pointers, compaction is due", spent);
+}
+
 static int priority_add(int part_num)
 {
 	int x;
-	int y;
 
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	for (x = 0; x < cpb.header.image_ptr_slots; x++) {
-		if (cpb_slots[x] == ERASED_ENTRY) {
-			if (update_cpb(x, spt.partition[part_num].offset)) {
+	for (x = 0; x < qs->cpb.header.image_ptr_slots; x++) {
+		if (qs->cpb_slots[x] == ERASED_ENTRY) {
+			if (update_cpb(x, qs->spt.partition[part_num].offset)) {
 				load_cpb();
 				return -1;
 			}
@@ -1503,43 +2146,114 @@ static int priority_add(int part_num)
 
 	librsu_log(MED, __func__, "Compressing CPB");
 
-	for (x = 0, y = 0; x < cpb.header.image_ptr_slots; x++) {
-		if (cpb_slots[x] != ERASED_ENTRY &&
-		    cpb_slots[x] != SPENT_ENTRY) {
-			cpb_slots[y++] = cpb_slots[x];
-		}
-	}
+	return compact_cpb(qs->spt.partition[part_num].offset);
+}
 
-	if (y < cpb.header.image_ptr_slots)
-		cpb_slots[y++] = spt.partition[part_num].offset;
-	else
+static int priority_remove(int part_num)
+{
+	int x;
+
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	while (y < cpb.header.image_ptr_slots)
-		cpb_slots[y++] = ERASED_ENTRY;
+	for (x = 0; x < qs->cpb.header.image_ptr_slots; x++) {
+		if (qs->cpb_slots[x] == qs->spt.partition[part_num].offset)
+			if (update_cpb(x, SPENT_ENTRY)) {
+				load_cpb();
+				return -1;
+			}
+	}
 
-	if (writeback_cpb() || load_cpb())
+	if (load_cpb())
 		return -1;
 
+	cpb_spent();
+
 	return 0;
 }
 
-static int priority_remove(int part_num)
+/*
+ * priority_set_order() - make the CPB hold exactly a list of partitions
+ * parts: partitions in priority order, highest priority first
+ * count: number of partitions in the list
+ *
+ * The longest leading part of the new order which the CPB already holds in
+ * the right sequence is kept, the rest of the partitions are added above it
+ * and all other pointers are spent. New pointers are added before old ones
+ * are spent, so a bootable image stays in the CPB throughout. The CPB is
+ * compacted once if there are not enough erased pointers left.
+ *
+ * Returns 0 on success, or -1 on error
+ */
+static int priority_set_order(int *parts, int count)
 {
+	__s64 order[CPB_IMAGE_PTR_NSLOTS];
+	int slots = qs->cpb.header.image_ptr_slots;
+	int kept = 0;
+	int top = -1;
 	int x;
 
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (count < 0 || count > slots || slots > CPB_IMAGE_PTR_NSLOTS)
 		return -1;
 
-	for (x = 0; x < cpb.header.image_ptr_slots; x++) {
-		if (cpb_slots[x] == spt.partition[part_num].offset)
-			if (update_cpb(x, SPENT_ENTRY)) {
-				load_cpb();
-				return -1;
-			}
+	/* CPB order is lowest priority first */
+	for (x = 0; x < count; x++) {
+		if (parts[x] < 0 || parts[x] >= qs->spt.partitions)
+			return -1;
+		order[count - 1 - x] = qs->spt.partition[parts[x]].offset;
+	}
+
+	for (x = 0; x < slots; x++) {
+		if (qs->cpb_slots[x] == ERASED_ENTRY)
+			continue;
+
+		top = x;
+		if (qs->cpb_slots[x] != SPENT_ENTRY && kept < count &&
+		    qs->cpb_slots[x] == order[kept])
+			kept++;
+	}
+
+	if (count - kept > slots - 1 - top) {
+		librsu_log(MED, __func__, "Compressing CPB");
+
+		for (x = 0; x < slots; x++)
+			qs->cpb_slots[x] = x < count ? order[x] : ERASED_ENTRY;
+
+		if (writeback_cpb() || load_cpb())
+			return -1;
+
+		return 0;
+	}
+
+	for (x = kept; x < count; x++) {
+		if (update_cpb(top + 1 + x - kept, order[x])) {
+			load_cpb();
+			return -1;
+		}
 	}
 
-	return load_cpb();
+	for (x = 0, kept = 0; x <= top; x++) {
+		if (qs->cpb_slots[x] == ERASED_ENTRY ||
+		    qs->cpb_slots[x] == SPENT_ENTRY)
+			continue;
+
+		if (kept < count && qs->cpb_slots[x] == order[kept]) {
+			kept++;
+			continue;
+		}
+
+		if (update_cpb(x, SPENT_ENTRY)) {
+			load_cpb();
+			return -1;
+		}
+	}
+
+	if (load_cpb())
+		return -1;
+
+	cpb_spent();
+
+	return 0;
 }
 
 static int data_read(int part_num, int offset, int bytes, void *buf)
@@ -1554,35 +2268,49 @@ static int data_write(int part_num, int offset, int bytes, void *buf)
 
 static int data_erase(int part_num)
 {
-	return erase_part(part_num);
+	return erase_part(part_num, 1);
 }
 
-static int partition_rename(int part_num, char *name)
+/*
+ * Erase part of a partition; offset and bytes must be multiples of the flash
+ * erase block size.
+ */
+static int data_erase_range(int part_num, int offset, int bytes)
 {
-	int x;
+	off_t part_offset;
 
-	if (part_num < 0 || part_num >= spt.partitions)
+	if (get_part_offset(part_num, &part_offset))
+		return -1;
+
+	if (offset < 0 || bytes < 0 ||
+	    (__s64)offset + bytes > qs->spt.partition[part_num].length)
+		return -1;
+
+	return erase_dev(part_offset + offset, bytes, 1);
+}
+
+static int partition_rename(int part_num, char *name)
+{
+	if (part_num < 0 || part_num >= qs->spt.partitions)
 		return -1;
 
-	if (strnlen(name, sizeof(spt.partition[0].name)) >=
-	    sizeof(spt.partition[0].name)) {
+	if (strnlen(name, sizeof(qs->spt.partition[0].name)) >=
+	    sizeof(qs->spt.partition[0].name)) {
 		librsu_log(LOW, __func__,
 			   "error: Partition name is too long - limited to %i",
-			   sizeof(spt.partition[0].name) - 1);
+			   sizeof(qs->spt.partition[0].name) - 1);
 		return -1;
 	}
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strncmp(spt.partition[x].name, name,
-			    sizeof(spt.partition[0].name) - 1) == 0) {
-			librsu_log(LOW, __func__,
-				   "error: Partition rename already in use");
-			return -1;
-		}
+	if (partition_by_name(name) >= 0) {
+		librsu_log(LOW, __func__,
+			   "error: Partition rename already in use");
+		return -1;
 	}
 
-	SAFE_STRCPY(spt.partition[part_num].name, sizeof(spt.partition[0].name),
-		    name, sizeof(spt.partition[0].name));
+	SAFE_STRCPY(qs->spt.partition[part_num].name,
+		    sizeof(qs->spt.partition[0].name), name,
+		    sizeof(qs->spt.partition[0].name));
 
 	if (writeback_spt())
 		return -1;
@@ -1603,16 +2331,16 @@ static int partition_delete(int part_num)
 {
 	int x;
 
-	if (part_num < 0 || part_num >= spt.partitions) {
+	if (part_num < 0 || part_num >= qs->spt.partitions) {
 		librsu_log(LOW, __func__,
 			   "error: Invalid partition number");
 		return -1;
 	}
 
-	for (x = part_num; x < spt.partitions; x++)
-		spt.partition[x] = spt.partition[x + 1];
+	for (x = part_num; x < qs->spt.partitions; x++)
+		qs->spt.partition[x] = qs->spt.partition[x + 1];
 
-	spt.partitions--;
+	qs->spt.partitions--;
 
 	if (writeback_spt())
 		return -1;
@@ -1637,42 +2365,39 @@ static int partition_create(char *name, __u64 start, unsigned int size)
 	__u64 end = start + size;
 
 	/* get erasesize from flash 0 since all flash are similar */
-	if (size % flash_list->dev_info[0].erasesize) {
+	if (size % qs->flash_list->dev_info[0].erasesize) {
 		librsu_log(LOW, __func__, "error: Invalid partition size");
 		return -1;
 	}
 
-	if (start % flash_list->dev_info[0].erasesize) {
+	if (start % qs->flash_list->dev_info[0].erasesize) {
 		librsu_log(LOW, __func__, "error: Invalid partition address");
 		return -1;
 	}
 
-	if (strnlen(name, sizeof(spt.partition[0].name)) >=
-	    sizeof(spt.partition[0].name)) {
+	if (strnlen(name, sizeof(qs->spt.partition[0].name)) >=
+	    sizeof(qs->spt.partition[0].name)) {
 		librsu_log(LOW, __func__,
 			   "error: Partition name is too long - limited to %i",
-			   sizeof(spt.partition[0].name) - 1);
+			   sizeof(qs->spt.partition[0].name) - 1);
 		return -1;
 	}
 
-	for (x = 0; x < spt.partitions; x++) {
-		if (strncmp(spt.partition[x].name, name,
-			    sizeof(spt.partition[0].name) - 1) == 0) {
-			librsu_log(LOW, __func__,
-				   "error: Partition name already in use");
-			return -1;
-		}
+	if (partition_by_name(name) >= 0) {
+		librsu_log(LOW, __func__,
+			   "error: Partition name already in use");
+		return -1;
 	}
 
-	if (spt.partitions == SPT_MAX_PARTITIONS) {
+	if (qs->spt.partitions == SPT_MAX_PARTITIONS) {
 		librsu_log(LOW, __func__, "error: Partition table is full");
 		return -1;
 	}
 
-	for (x = 0; x < spt.partitions; x++) {
-		__u64 pstart = spt.partition[x].offset;
-		__u64 pend = spt.partition[x].offset +
-			     spt.partition[x].length;
+	for (x = 0; x < qs->spt.partitions; x++) {
+		__u64 pstart = qs->spt.partition[x].offset;
+		__u64 pend = qs->spt.partition[x].offset +
+			     qs->spt.partition[x].length;
 
 		if ((start < pend) && (end > pstart)) {
 			librsu_log(LOW, __func__, "error: Partition overlap");
@@ -1680,14 +2405,14 @@ static int partition_create(char *name, __u64 start, unsigned int size)
 		}
 	}
 
-	SAFE_STRCPY(spt.partition[spt.partitions].name,
-		    sizeof(spt.partition[0].name), name,
-		    sizeof(spt.partition[0].name));
-	spt.partition[spt.partitions].offset = start;
-	spt.partition[spt.partitions].length = size;
-	spt.partition[spt.partitions].flags = 0;
+	SAFE_STRCPY(qs->spt.partition[qs->spt.partitions].name,
+		    sizeof(qs->spt.partition[0].name), name,
+		    sizeof(qs->spt.partition[0].name));
+	qs->spt.partition[qs->spt.partitions].offset = start;
+	qs->spt.partition[qs->spt.partitions].length = size;
+	qs->spt.partition[qs->spt.partitions].flags = 0;
 
-	spt.partitions++;
+	qs->spt.partitions++;
 
 	if (writeback_spt())
 		return -1;
@@ -1698,10 +2423,14 @@ static int partition_create(char *name, __u64 start, unsigned int size)
 	return 0;
 }
 
-static struct librsu_ll_intf qspi_ll_intf = {
+static const struct librsu_ll_intf qspi_ll_intf = {
 	.close = ll_close,
 
 	.partition.count = partition_count,
+	.partition.slots = partition_slots,
+	.partition.slot2part = partition_slot2part,
+	.partition.part2slot = partition_part2slot,
+	.partition.by_name = partition_by_name,
 	.partition.name = partition_name,
 	.partition.offset = partition_offset,
 	.partition.factory_offset = factory_offset,
@@ -1715,142 +2444,181 @@ static struct librsu_ll_intf qspi_ll_intf = {
 	.priority.get = priority_get,
 	.priority.add = priority_add,
 	.priority.remove = priority_remove,
+	.priority.set_order = priority_set_order,
 
 	.data.read = data_read,
 	.data.write = data_write,
 	.data.erase = data_erase,
+	.data.erase_range = data_erase_range,
 
 	.spt_ops.restore = restore_spt_from_file,
 	.spt_ops.save = save_spt_to_file,
 	.spt_ops.corrupted = corrupted_spt,
 
 	.cpb_ops.empty = empty_cpb,
+	.cpb_ops.compact = cpb_compact,
 	.cpb_ops.restore = restore_cpb_from_file,
 	.cpb_ops.save = save_cpb_to_file,
 	.cpb_ops.corrupted = corrupted_cpb
 };
 
+void *librsu_ll_qspi_state_new(void)
+{
+	struct qspi_state *state;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
+
+	state->spt1_offset = qspi_default.spt1_offset;
+	state->cpb0_part = -1;
+	state->cpb1_part = -1;
+
+	return state;
+}
+
+void librsu_ll_qspi_state_free(void *state)
+{
+	free(state);
+}
+
+void librsu_ll_qspi_state_select(void *state)
+{
+	qs = state ? state : &qspi_default;
+}
+
 int librsu_ll_open_qspi(struct librsu_ll_intf **intf)
 {
 	char *type_str;
 	int ret;
 	int flash_count;
 
+	/* the ops are shared, the flash data belongs to the context */
+	qs->intf = qspi_ll_intf;
+
 	/* data struct ptr for multiflash */
-	flash_list = &qspi_ll_intf.flash_list;
-	flash_info = &qspi_ll_intf.flash_info;
+	qs->flash_list = &qs->intf.flash_list;
+	qs->flash_info = &qs->intf.flash_info;
 
 	/* retrieve multiple mtd path from cfg */
-	flash_count = librsu_cfg_get_rootpath(flash_info);
+	flash_count = librsu_cfg_get_rootpath(qs->flash_info);
 	if (!flash_count) {
 		librsu_log(LOW, __func__, "error: get_flash_info error.");
 		return -1;
 	}
 
 	/* init flash count */
-	flash_list->flash_count = flash_count;
+	qs->flash_list->flash_count = flash_count;
 
-	ret = librsu_misc_get_devattr("spt0_address", &spt0_address);
+	ret = librsu_misc_get_devattr("spt0_address", &qs->spt0_address);
 	if (!ret)
-		ret = librsu_misc_get_devattr("spt1_address", &spt1_address);
+		ret = librsu_misc_get_devattr("spt1_address",
+					      &qs->spt1_address);
 
 	if (!ret) {
-		spt1_offset = spt1_address - spt0_address;
+		qs->spt1_offset = qs->spt1_address - qs->spt0_address;
 		librsu_log(HIGH, __func__, "spt1_offset calculated: %d",
-			   spt1_offset);
+			   qs->spt1_offset);
 	} else {
 		librsu_log(HIGH, __func__, "spt1_offset default used: %d",
-			   spt1_offset);
+			   qs->spt1_offset);
 	}
 
-	if (!flash_info) {
+	if (!qs->flash_info) {
 		librsu_log(LOW, __func__, "error: No root specified");
 		return -1;
 	} else {
-		for (int i = 0; i < flash_list->flash_count; i++) {
-			if (flash_info->root_path[i])
+		for (int i = 0; i < qs->flash_list->flash_count; i++) {
+			if (qs->flash_info->root_path[i])
 				librsu_log(HIGH, __func__, "flash_info[%d]: %s\n", i,
-						   flash_info->root_path[i]);
+						   qs->flash_info->root_path[i]);
 			else
 				librsu_log(HIGH, __func__, "flash_info[%d]: Empty\n", i);
 		}
 	}
 
 	/* open the mtd dev from cfg, 1 mtd = 1 flash */
-	for (int i = 0; i < flash_list->flash_count; i++) {
-		flash_list->dev_file[i] = open(flash_info->root_path[i],
+	for (int i = 0; i < qs->flash_list->flash_count; i++) {
+		qs->flash_list->dev_file[i] = open(qs->flash_info->root_path[i],
 					       O_RDWR | O_SYNC);
 
-		if (flash_list->dev_file[i] < 0) {
+		if (qs->flash_list->dev_file[i] < 0) {
 			librsu_log(LOW, __func__, "error: Unable to open '%s'",
-				   flash_info->root_path[i]);
+				   qs->flash_info->root_path[i]);
 			/* free the opened dev_file */
 			ll_close();
 			return -1;
 		}
 
-		if (ioctl(flash_list->dev_file[i], MEMGETINFO,
-			  &flash_list->dev_info[i])) {
+		if (ioctl(qs->flash_list->dev_file[i], MEMGETINFO,
+			  &qs->flash_list->dev_info[i])) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to find mtd info for '%s'",
-				   flash_info->root_path[i]);
+				   qs->flash_info->root_path[i]);
 			ll_close();
 			return -1;
 		}
 
-		if (flash_list->dev_info[i].type == MTD_NORFLASH)
+		if (qs->flash_list->dev_info[i].type == MTD_NORFLASH)
 			type_str = "NORFLASH";
-		else if (flash_list->dev_info[i].type == MTD_NANDFLASH)
+		else if (qs->flash_list->dev_info[i].type == MTD_NANDFLASH)
 			type_str = "NANDFLASH";
-		else if (flash_list->dev_info[i].type == MTD_RAM)
+		else if (qs->flash_list->dev_info[i].type == MTD_RAM)
 			type_str = "RAM";
-		else if (flash_list->dev_info[i].type == MTD_ROM)
+		else if (qs->flash_list->dev_info[i].type == MTD_ROM)
 			type_str = "ROM";
-		else if (flash_list->dev_info[i].type == MTD_DATAFLASH)
+		else if (qs->flash_list->dev_info[i].type == MTD_DATAFLASH)
 			type_str = "DATAFLASH";
-		else if (flash_list->dev_info[i].type == MTD_UBIVOLUME)
+		else if (qs->flash_list->dev_info[i].type == MTD_UBIVOLUME)
 			type_str = "UBIVOLUME";
 		else
 			type_str = "[UNKNOWN]";
 
 		librsu_log(HIGH, __func__, "MTD flash type is (%i) %s",
-			   flash_list->dev_info[i].type, type_str);
+			   qs->flash_list->dev_info[i].type, type_str);
 		librsu_log(HIGH, __func__, "MTD flash size = %i",
-			   flash_list->dev_info[i].size);
+			   qs->flash_list->dev_info[i].size);
 		librsu_log(HIGH, __func__, "MTD flash erase size = %i",
-			   flash_list->dev_info[i].erasesize);
+			   qs->flash_list->dev_info[i].erasesize);
 		librsu_log(HIGH, __func__, "MTD flash write size = %i",
-			   flash_list->dev_info[i].writesize);
+			   qs->flash_list->dev_info[i].writesize);
 
-		if (flash_list->dev_info[i].flags & MTD_WRITEABLE)
+		if (qs->flash_list->dev_info[i].flags & MTD_WRITEABLE)
 			librsu_log(HIGH, __func__, "MTD flash is MTD_WRITEABLE");
 
-		if (flash_list->dev_info[i].flags & MTD_BIT_WRITEABLE)
+		if (qs->flash_list->dev_info[i].flags & MTD_BIT_WRITEABLE)
 			librsu_log(HIGH, __func__,
 				   "MTD flash is MTD_BIT_WRITEABLE");
 
-		if (flash_list->dev_info[i].flags & MTD_NO_ERASE)
+		if (qs->flash_list->dev_info[i].flags & MTD_NO_ERASE)
 			librsu_log(HIGH, __func__, "MTD flash is MTD_NO_ERASE");
 
-		if (flash_list->dev_info[i].flags & MTD_POWERUP_LOCK)
+		if (qs->flash_list->dev_info[i].flags & MTD_POWERUP_LOCK)
 			librsu_log(HIGH, __func__, "MTD flash is MTD_POWERUP_LOCK");
 	}
 
-	if (load_spt() && !spt_corrupted) {
+	if (metadata_cache_load() == 0) {
+		*intf = &qs->intf;
+		return 0;
+	}
+
+	if (load_spt() && !qs->spt_corrupted) {
 		librsu_log(LOW, __func__, "error: Bad SPT");
 		ll_close();
 		return -1;
 	}
 
-	if (spt_corrupted) {
-		cpb_corrupted = true;
-	} else if (load_cpb() && !cpb_corrupted) {
+	if (qs->spt_corrupted) {
+		qs->cpb_corrupted = true;
+	} else if (load_cpb() && !qs->cpb_corrupted) {
 		librsu_log(LOW, __func__, "error: Bad CPB");
 		ll_close();
 		return -1;
 	}
 
-	*intf = &qspi_ll_intf;
+	metadata_cache_save();
+
+	*intf = &qs->intf;
 
 	return 0;
 }
@@ -1863,68 +2631,78 @@ int librsu_ll_open_datafile(struct librsu_ll_intf **intf)
 {
 	int flash_count;
 
+	/* the ops are shared, the flash data belongs to the context */
+	qs->intf = qspi_ll_intf;
+
 	/* data struct ptr for multiflash */
-	flash_list = &qspi_ll_intf.flash_list;
-	flash_info = &qspi_ll_intf.flash_info;
+	qs->flash_list = &qs->intf.flash_list;
+	qs->flash_info = &qs->intf.flash_info;
 
 	/* retrieve multiple mtd path from cfg */
-	flash_count = librsu_cfg_get_rootpath(flash_info);
+	flash_count = librsu_cfg_get_rootpath(qs->flash_info);
 	if (flash_count) {
 		librsu_log(LOW, __func__, "error: get_rootpath error.");
 		return -1;
 	}
 
 	/* init flash count */
-	flash_list->flash_count = flash_count;
+	qs->flash_list->flash_count = flash_count;
 
-	if (!flash_info) {
+	if (!qs->flash_info) {
 		librsu_log(LOW, __func__, "error: No root specified");
 		return -1;
 	} else {
-		for (int i = 0; i < flash_list->flash_count; i++) {
-			if (flash_info->root_path[i])
+		for (int i = 0; i < qs->flash_list->flash_count; i++) {
+			if (qs->flash_info->root_path[i])
 				librsu_log(HIGH, __func__, "flash_info[%d]: %s\n", i,
-						   flash_info->root_path[i]);
+						   qs->flash_info->root_path[i]);
 			else
 				librsu_log(HIGH, __func__, "flash_info[%d]: Empty\n", i);
 		}
 	}
 
 	/* open the mtd dev from cfg, 1 mtd = 1 flash */
-	for (int i = 0; i < flash_list->flash_count; i++) {
-		flash_list->dev_file[i] = open(flash_info->root_path[i],
+	for (int i = 0; i < qs->flash_list->flash_count; i++) {
+		qs->flash_list->dev_file[i] = open(qs->flash_info->root_path[i],
 					       O_RDWR | O_SYNC);
 
-		if (flash_list->dev_file[i] < 0) {
+		if (qs->flash_list->dev_file[i] < 0) {
 			librsu_log(LOW, __func__,
 				   "error: Unable to open dev_file '%s'",
-					flash_info->root_path[i]);
+					qs->flash_info->root_path[i]);
 			/* free the opened dev_file */
 			ll_close();
 			return -1;
 		}
 
-		flash_list->dev_info[i].type = MTD_ABSENT;
-		flash_list->dev_info[i].erasesize = 0;
-		flash_list->dev_info[i].writesize = 1;
-		flash_list->dev_info[i].oobsize = 0;
+		qs->flash_list->dev_info[i].type = MTD_ABSENT;
+		qs->flash_list->dev_info[i].erasesize = 0;
+		qs->flash_list->dev_info[i].writesize = 1;
+		qs->flash_list->dev_info[i].oobsize = 0;
+	}
+
+	if (metadata_cache_load() == 0) {
+		*intf = &qs->intf;
+		return 0;
 	}
 
 	if (load_spt()) {
 		librsu_log(LOW, __func__, "error: Bad SPT in dev_file '%s'",
-			   flash_info->root_path[0]);
+			   qs->flash_info->root_path[0]);
 		ll_close();
 		return -1;
 	}
 
 	if (load_cpb()) {
 		librsu_log(LOW, __func__, "error: Bad CPB in dev_file '%s'",
-			   flash_info->root_path[0]);
+			   qs->flash_info->root_path[0]);
 		ll_close();
 		return -1;
 	}
 
-	*intf = &qspi_ll_intf;
+	metadata_cache_save();
+
+	*intf = &qs->intf;
 
 	return 0;
 }
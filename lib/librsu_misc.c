@@ -2,12 +2,16 @@
 
 /* Intel Copyright 2018 */
 
+#include <errno.h>
 #include <fcntl.h>
 #include "librsu_cfg.h"
 #include "librsu_misc.h"
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 static char *reserved_names[] = {
@@ -35,71 +39,184 @@ int librsu_misc_is_rsvd_name(char *name)
 
 int librsu_misc_is_slot(struct librsu_ll_intf *ll_intf, int part_num)
 {
-	if (ll_intf->partition.readonly(part_num) ||
-	    ll_intf->partition.reserved(part_num))
-		return 0;
-
-	if (librsu_misc_is_rsvd_name(ll_intf->partition.name(part_num)))
-		return 0;
-
-	return 1;
+	return ll_intf->partition.part2slot(part_num) >= 0;
 }
 
 int librsu_misc_slot2part(struct librsu_ll_intf *ll_intf, int slot)
 {
-	int partitions;
-	int cnt = 0;
-	int x;
+	return ll_intf->partition.slot2part(slot);
+}
 
-	partitions = ll_intf->partition.count();
+/*
+ * Read only device attributes are opened once and re-read with pread() at
+ * offset zero, which makes sysfs regenerate the value, so repeated status
+ * queries do not open and close the attribute files every time.
+ */
+#define DEVATTR_MAX	32
 
-	for (x = 0; x < partitions; x++) {
-		if (librsu_misc_is_slot(ll_intf, x)) {
-			if (slot == cnt)
-				return x;
-			cnt++;
-		}
-	}
+struct misc_state {
+	struct {
+		char name[32];
+		int fd;
+	} devattr_fds[DEVATTR_MAX];
+	int devattr_cnt;
 
-	return -1;
+	/* progress reporting, see librsu_misc_progress_begin() */
+	rsu_progress_callback progress_cb;
+	void *progress_arg;
+	int progress_interval;
+	int progress_active;
+	struct rsu_progress progress;
+	struct timespec progress_start;
+	long progress_last;
+
+	/* see librsu_misc_cancel_begin(), set by librsu_misc_cancel() */
+	_Atomic int cancel;
+	int cancel_depth;
+};
+
+enum { CANCEL_IDLE = 0, CANCEL_ARMED, CANCEL_REQUESTED };
+
+#define PROGRESS_INTERVAL_MS	500
+
+/* each library context has its own, see librsu_misc_state_select() */
+static struct misc_state misc_default;
+static _Thread_local struct misc_state *ms = &misc_default;
+
+/* callback of the asynchronous operation run by the thread, if any */
+static _Thread_local rsu_progress_callback progress_op_cb;
+static _Thread_local void *progress_op_arg;
+
+void *librsu_misc_state_new(void)
+{
+	return calloc(1, sizeof(struct misc_state));
 }
 
-int librsu_misc_get_devattr(char *attr, __u64 *value)
+void librsu_misc_state_free(void *state)
 {
-	FILE *attr_file;
-	char *buf;
-	int size = 256;
+	free(state);
+}
 
-	buf = (char *)calloc(1, size);
-	if (!buf) {
+void librsu_misc_state_select(void *state)
+{
+	ms = state ? state : &misc_default;
+}
+
+static int devattr_open(char *attr)
+{
+	char path[256];
+	int fd;
+	int x;
+
+	for (x = 0; x < ms->devattr_cnt; x++)
+		if (strcmp(ms->devattr_fds[x].name, attr) == 0)
+			return ms->devattr_fds[x].fd;
+
+	snprintf(path, sizeof(path), "%s/%s", librsu_cfg_get_rsu_dev(), attr);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		librsu_log(LOW, __func__,
-			   "error: failed to alloc buf\n");
+			   "error: Unable to open device attribute file '%s'",
+			   path);
 		return -1;
 	}
 
-	strncat(buf, librsu_cfg_get_rsu_dev(), size - strlen(buf) - 1);
-	strncat(buf, "/", size - strlen(buf) - 1);
-	strncat(buf, attr, size - strlen(buf) - 1);
+	if (ms->devattr_cnt < DEVATTR_MAX &&
+	    strlen(attr) < sizeof(ms->devattr_fds[0].name)) {
+		strcpy(ms->devattr_fds[ms->devattr_cnt].name, attr);
+		ms->devattr_fds[ms->devattr_cnt].fd = fd;
+		ms->devattr_cnt++;
+	}
 
-	attr_file = fopen(buf, "r");
-	if (!attr_file) {
-		librsu_log(LOW, __func__,
-			   "error: Unable to open device attribute file '%s'",
-			   buf);
-		free(buf);
+	return fd;
+}
+
+static int devattr_cached(int fd)
+{
+	int x;
+
+	for (x = 0; x < ms->devattr_cnt; x++)
+		if (ms->devattr_fds[x].fd == fd)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * devattr_drop() - close a device attribute file which can not be read
+ * @fd: file descriptor
+ *
+ * The file is dropped from the cache, so that the next access opens it again,
+ * for instance after the driver was rebound and the sysfs node recreated.
+ */
+static void devattr_drop(int fd)
+{
+	int x;
+
+	for (x = 0; x < ms->devattr_cnt; x++)
+		if (ms->devattr_fds[x].fd == fd)
+			break;
+
+	if (x < ms->devattr_cnt)
+		ms->devattr_fds[x] = ms->devattr_fds[--ms->devattr_cnt];
+
+	close(fd);
+}
+
+int librsu_misc_devattr_fd(char *attr)
+{
+	int fd;
+
+	fd = devattr_open(attr);
+	if (fd >= 0 && !devattr_cached(fd)) {
+		close(fd);
 		return -1;
 	}
 
-	if (fgets(buf, size, attr_file)) {
-		*value = strtol(buf, NULL, 0);
-		fclose(attr_file);
-		free(buf);
-		return 0;
+	return fd;
+}
+
+void librsu_misc_close_devattrs(void)
+{
+	int x;
+
+	for (x = 0; x < ms->devattr_cnt; x++)
+		close(ms->devattr_fds[x].fd);
+
+	ms->devattr_cnt = 0;
+}
+
+int librsu_misc_get_devattr(char *attr, __u64 *value)
+{
+	char buf[64];
+	ssize_t len;
+	int retry;
+	int fd;
+
+	for (retry = 0; retry < 2; retry++) {
+		fd = devattr_open(attr);
+		if (fd < 0)
+			return -1;
+
+		len = pread(fd, buf, sizeof(buf) - 1, 0);
+		if (len > 0)
+			break;
+
+		/* a cached file may be stale, read it once more from a new one */
+		devattr_drop(fd);
 	}
 
-	fclose(attr_file);
-	free(buf);
-	return -1;
+	if (len <= 0)
+		return -1;
+
+	if (!devattr_cached(fd))
+		close(fd);
+
+	buf[len] = '\0';
+	*value = strtol(buf, NULL, 0);
+
+	return 0;
 }
 
 int librsu_misc_put_devattr(char *attr, __u64 value)
@@ -140,3 +257,204 @@ int librsu_misc_put_devattr(char *attr, __u64 value)
 	free(buf);
 	return -1;
 }
+
+/**
+ * librsu_misc_lock_file() - take the lock serializing updates of a cache file
+ * @path: cache file path
+ *
+ * The lock is held on a separate "<path>.lock" file, so that it survives the
+ * cache file being replaced by a rename. Close the returned descriptor to
+ * release the lock.
+ *
+ * Return: lock file descriptor, or negative value if the lock is unavailable
+ */
+int librsu_misc_lock_file(char *path)
+{
+	char lock_path[140];
+	int fd;
+
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+
+	fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		librsu_log(LOW, __func__, "error: Unable to open '%s'",
+			   lock_path);
+		return -1;
+	}
+
+	while (flock(fd, LOCK_EX)) {
+		if (errno != EINTR) {
+			librsu_log(LOW, __func__, "error: Unable to lock '%s'",
+				   lock_path);
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+int librsu_misc_progress_set(rsu_progress_callback callback, void *arg,
+			     int interval_ms)
+{
+	if (interval_ms < 0)
+		return -1;
+
+	ms->progress_cb = callback;
+	ms->progress_arg = arg;
+	ms->progress_interval = interval_ms ? interval_ms :
+			       PROGRESS_INTERVAL_MS;
+
+	return 0;
+}
+
+void librsu_misc_progress_override(rsu_progress_callback callback, void *arg)
+{
+	progress_op_cb = callback;
+	progress_op_arg = arg;
+}
+
+static long progress_elapsed_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - ms->progress_start.tv_sec) * 1000 +
+	       (now.tv_nsec - ms->progress_start.tv_nsec) / 1000000;
+}
+
+static void progress_report(long elapsed)
+{
+	struct rsu_progress *p = &ms->progress;
+	__u64 togo;
+
+	p->elapsed_ms = elapsed;
+
+	/* Rate in hundredths of MB/s */
+	p->rate = elapsed > 0 ? p->done * 1000 * 100 /
+				((__u64)elapsed * 1024 * 1024) : 0;
+
+	if (p->total >= p->done && p->done && elapsed > 0) {
+		togo = p->total - p->done;
+		p->eta_ms = togo * elapsed / p->done;
+	} else {
+		p->eta_ms = p->total && p->done == p->total ? 0 : -1;
+	}
+
+	ms->progress_last = elapsed;
+
+	if (progress_op_cb)
+		progress_op_cb(p, progress_op_arg);
+	else
+		ms->progress_cb(p, ms->progress_arg);
+}
+
+/**
+ * librsu_misc_progress_begin() - start reporting the progress of a phase
+ * @phase: RSU_PROGRESS_* phase
+ * @total: bytes to process, or 0 if not known
+ *
+ * Does nothing when no progress callback is registered. The progress of the
+ * phase is then given with librsu_misc_progress(), which only calls the
+ * callback once per interval, and the phase closed with
+ * librsu_misc_progress_end(), which reports the final progress of phases
+ * which completed.
+ */
+void librsu_misc_progress_begin(int phase, __u64 total)
+{
+	ms->progress_active = progress_op_cb || ms->progress_cb;
+	if (!ms->progress_active)
+		return;
+
+	memset(&ms->progress, 0, sizeof(ms->progress));
+	ms->progress.phase = phase;
+	ms->progress.total = total;
+	clock_gettime(CLOCK_MONOTONIC, &ms->progress_start);
+
+	progress_report(0);
+}
+
+void librsu_misc_progress(__u64 done)
+{
+	long elapsed;
+	int interval;
+
+	if (!ms->progress_active)
+		return;
+
+	ms->progress.done = done;
+
+	interval = ms->progress_interval ? ms->progress_interval :
+		   PROGRESS_INTERVAL_MS;
+
+	elapsed = progress_elapsed_ms();
+	if (elapsed - ms->progress_last < interval)
+		return;
+
+	progress_report(elapsed);
+}
+
+void librsu_misc_progress_end(int rtn)
+{
+	if (!ms->progress_active)
+		return;
+
+	ms->progress_active = 0;
+
+	/* failed phases end without a final report */
+	if (rtn)
+		return;
+
+	if (!ms->progress.total)
+		ms->progress.total = ms->progress.done;
+
+	progress_report(progress_elapsed_ms());
+}
+
+/**
+ * librsu_misc_cancel_begin() - start an operation which can be cancelled
+ *
+ * Cancel requests are only accepted between librsu_misc_cancel_begin() and
+ * the matching librsu_misc_cancel_end(). Calls nest, so that an asynchronous
+ * operation can be cancelled as soon as it is queued, and the operations it
+ * runs do not drop the requests made before they start.
+ */
+void librsu_misc_cancel_begin(void)
+{
+	if (!ms->cancel_depth++)
+		ms->cancel = CANCEL_ARMED;
+}
+
+/**
+ * librsu_misc_cancel_end() - end an operation which can be cancelled
+ *
+ * A request which was not acted upon is dropped with the outermost call.
+ */
+void librsu_misc_cancel_end(void)
+{
+	if (ms->cancel_depth > 0 && !--ms->cancel_depth)
+		ms->cancel = CANCEL_IDLE;
+}
+
+/**
+ * librsu_misc_cancel() - request the operation in progress to stop
+ * @state: state of the context running the operation, or NULL for the
+ *         default one
+ *
+ * This may be called from any thread. Operations check for the request at
+ * block boundaries with librsu_misc_cancelled(). A request made while no
+ * operation runs is ignored.
+ */
+void librsu_misc_cancel(void *state)
+{
+	struct misc_state *st = state ? state : &misc_default;
+	int armed = CANCEL_ARMED;
+
+	atomic_compare_exchange_strong(&st->cancel, &armed, CANCEL_REQUESTED);
+}
+
+int librsu_misc_cancelled(void)
+{
+	return ms->cancel == CANCEL_REQUESTED;
+}
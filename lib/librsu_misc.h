@@ -6,6 +6,7 @@
 #define __LIBRSU_MISC_H__
 
 #include "librsu_ll.h"
+#include <librsu.h>
 
 int librsu_misc_is_rsvd_name(char *name);
 
@@ -14,6 +15,26 @@ int librsu_misc_slot2part(struct librsu_ll_intf *ll_intf, int slot);
 
 int librsu_misc_get_devattr(char *attr, __u64 *value);
 int librsu_misc_put_devattr(char *attr, __u64 value);
+int librsu_misc_devattr_fd(char *attr);
+void librsu_misc_close_devattrs(void);
+
+int librsu_misc_lock_file(char *path);
+
+int librsu_misc_progress_set(rsu_progress_callback callback, void *arg,
+			     int interval_ms);
+void librsu_misc_progress_override(rsu_progress_callback callback, void *arg);
+void librsu_misc_progress_begin(int phase, __u64 total);
+void librsu_misc_progress(__u64 done);
+void librsu_misc_progress_end(int rtn);
+
+void librsu_misc_cancel_begin(void);
+void librsu_misc_cancel_end(void);
+void librsu_misc_cancel(void *state);
+int librsu_misc_cancelled(void);
+
+void *librsu_misc_state_new(void);
+void librsu_misc_state_free(void *state);
+void librsu_misc_state_select(void *state);
 
 void swap_bits(char *data, int size);
 __u32 swap_endian32(__u32 val);